@@ -0,0 +1,30 @@
+// ==========================================================================
+// Blurs one layer of the bilateral grid along one axis with 1 4 6 4 1 / 16
+// ==========================================================================
+#version 410
+
+// first output is mapped to the framebuffer's colour index by default
+out vec4 FragmentColour;
+
+uniform sampler3D cells;
+uniform ivec3 direction;  //axis of this pass
+uniform int layer;        //intensity cell being rendered
+
+void main(void)
+{
+    float weights[5] = float[5](0.0625, 0.25, 0.375, 0.25, 0.0625);
+    ivec3 size = textureSize(cells, 0);
+    ivec3 cell = ivec3(ivec2(gl_FragCoord.xy), layer);
+
+    //cells beyond the grid count as empty
+    vec4 sum = vec4(0, 0, 0, 0);
+    for(int i=-2;i<=2;i++)
+    {
+      ivec3 p = cell + i * direction;
+      if(all(greaterThanEqual(p, ivec3(0))) && all(lessThan(p, size)))
+      {
+        sum += weights[i+2] * texelFetch(cells, p, 0);
+      }
+    }
+    FragmentColour = sum;
+}
@@ -0,0 +1,17 @@
+// ==========================================================================
+// Adds one splatted texel to its cell of the bilateral grid
+//
+// The points of all texels are drawn in one pass with additive blending, so
+// every cell ends up with the summed colour and the count of its texels.
+// ==========================================================================
+#version 410
+
+// first output is mapped to the framebuffer's colour index by default
+out vec4 FragmentColour;
+
+in vec4 CellColour;
+
+void main(void)
+{
+    FragmentColour = CellColour;
+}
@@ -0,0 +1,21 @@
+// ==========================================================================
+// Sends every splatted texel to the intensity layer of its cell
+// ==========================================================================
+#version 410
+
+layout(points) in;
+layout(points, max_vertices = 1) out;
+
+in vec4 TexelColour[];
+flat in int TexelLayer[];
+
+out vec4 CellColour;
+
+void main()
+{
+    gl_Layer = TexelLayer[0];
+    gl_Position = gl_in[0].gl_Position;
+    CellColour = TexelColour[0];
+    EmitVertex();
+    EndPrimitive();
+}
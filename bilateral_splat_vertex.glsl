@@ -0,0 +1,30 @@
+// ==========================================================================
+// Splats the picture into the bilateral grid, one point per texel
+//
+// Every vertex is one texel; it is moved to the centre of its nearest cell,
+// the same binning the CPU path uses in BuildBilateralGrid(), and the
+// geometry stage sends it to the intensity layer of that cell.
+// ==========================================================================
+#version 410
+
+uniform sampler2DRect tex;
+uniform ivec2 size;       //of the picture
+uniform ivec2 cells;      //of the grid along x and y
+uniform int spatial;      //texels per cell along x and y
+uniform float range;      //intensity per cell
+uniform int pad;          //empty cells around the picture
+
+out vec4 TexelColour;
+flat out int TexelLayer;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_VertexID % size.x, gl_VertexID / size.x);
+    vec3 colour = texelFetch(tex, texel).rgb;
+    float L = clamp(dot(colour, vec3(0.299, 0.587, 0.114)), 0.0, 1.0);
+
+    ivec2 cell = (texel + spatial / 2) / spatial + ivec2(pad);
+    gl_Position = vec4((vec2(cell) + 0.5) / vec2(cells) * 2.0 - 1.0, 0.0, 1.0);
+    TexelColour = vec4(colour, 1.0);
+    TexelLayer = int(L / range + 0.5) + pad;
+}
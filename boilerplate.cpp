@@ -15,7 +15,11 @@
 #include <algorithm>
 #include <string>
 #include <iterator>
+#include <map>
 #include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
 
 // specify that we want the OpenGL core profile before including GLFW headers
@@ -28,6 +32,16 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+#include "cpufilter.h"
+#include "sequence.h"
+#include "server.h"
+#include "pixelcache.h"
+#include "fixedpoint.h"
+#include "regress.h"
+#include "sheet.h"
+#include "resample.h"
+#include "memory.h"
+
 //Globals
 float picWidth;
 float picHeight;
@@ -38,14 +52,26 @@ std::string picName = "";
 int colourEffect;
 int blur;
 int edgeEffect;
+int rankRadius = 1;             //window radius and percentile of the rank filter (blur 5)
+int rankPercentile = 50;
+int bilateralSpatial = 16;      //spatial and range sigmas of the bilateral blur (blur 4)
+float bilateralRange = 0.1f;
 float centerX;
 float centerY;
 float pictureCenterX;
 float pictureCenterY;
-float oldPictureCenterX;
-float oldPictureCenterY;
 bool pressed;
 int rotateFlag = 0;
+float edgeKernel[9];
+bool cpuPath = false;
+MyExportOptions exportOptions;  //size and kernel of the exports, from the command line
+
+//Progressive preview while scrolling or dragging
+double frameBudget = 16.0;      //milliseconds a frame may take during interaction
+double idleDelay = 0.25;        //seconds without input before refining
+double lastInteraction = -1.0;
+double fullFrameCost = 0.0;     //milliseconds a full quality frame takes
+int previewStep = 1;            //resolution divisor of the frame on screen
 
 using namespace std;
 // --------------------------------------------------------------------------
@@ -56,42 +82,411 @@ bool CheckGLErrors();
 
 string LoadSource(const string &filename);
 GLuint CompileShader(GLenum shaderType, const string &source);
-GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader);
+GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader, GLuint geometryShader = 0);
 
 void PicGen(std::string name);
+bool GpuFilterFrame(MyFrame *frame, MyFrame *done);
+void DestroySequenceTargets();
+EffectState CurrentEffects();
+bool FilteringOnCpu();
+void CpuPicGen(std::string name);
+void UploadVisibleTiles();
+void RefineFrame();
+void ExportCurrentView(GLFWwindow *window);
+void RegisterEvictors();
+void DestroyPictures();
+
+// --------------------------------------------------------------------------
+// OpenGL state cache
+//
+// Every bind goes through these, which skip it when the object is already
+// bound, so the draw paths can bind what they need without tracking what
+// the previous one left behind. Objects are deleted through the Delete*()
+// functions, which forget the names they delete wherever they were bound,
+// since GL unbinds them and may hand the names out again.
+
+const int cachedTextureUnits = 4;
+
+struct MyGLState
+{
+	GLuint program;
+	GLuint vertexArray;
+	GLuint drawFramebuffer;
+	GLuint readFramebuffer;
+	GLenum activeTexture;
+	GLuint textures[cachedTextureUnits][4];    // rectangle, 2D, 3D and 2D array per unit
+
+	// GL calls made, and calls the caches found redundant and skipped, since
+	// the last frame
+	int calls;
+	int skipped;
+
+	MyGLState() : activeTexture(GL_TEXTURE0), calls(0), skipped(0)
+	{
+		Forget();
+	}
+
+	// nothing is known to be bound, the next binds all go through
+	void Forget()
+	{
+		program = vertexArray = drawFramebuffer = readFramebuffer = ~0u;
+		for (int i = 0; i < cachedTextureUnits; i++)
+			for (int j = 0; j < 4; j++)
+				textures[i][j] = ~0u;
+	}
+
+	// deleted names revert to 0 wherever they were bound; a program stays
+	// in use until another one is, so it is only known to be unknown
+	void ForgetTextures(GLsizei count, const GLuint *names)
+	{
+		for (GLsizei n = 0; n < count; n++)
+			for (int i = 0; i < cachedTextureUnits; i++)
+				for (int j = 0; j < 4; j++)
+					if (textures[i][j] == names[n])
+						textures[i][j] = 0;
+	}
+	void ForgetVertexArrays(GLsizei count, const GLuint *names)
+	{
+		for (GLsizei n = 0; n < count; n++)
+			if (vertexArray == names[n])
+				vertexArray = 0;
+	}
+	void ForgetFramebuffers(GLsizei count, const GLuint *names)
+	{
+		for (GLsizei n = 0; n < count; n++)
+		{
+			if (drawFramebuffer == names[n])
+				drawFramebuffer = 0;
+			if (readFramebuffer == names[n])
+				readFramebuffer = 0;
+		}
+	}
+	void ForgetProgram(GLuint name)
+	{
+		if (program == name)
+			program = ~0u;
+	}
+};
+
+MyGLState glState;
+bool reportGLCalls = false;     //--gl-calls prints the count every frame
+
+// makes an OpenGL call of the render path that --gl-calls measures and
+// counts it; the binds count themselves in the wrappers below
+template <typename Function, typename... Arguments>
+auto CountedGL(Function function, Arguments... arguments) -> decltype(function(arguments...))
+{
+	glState.calls++;
+	return function(arguments...);
+}
+
+// true when cached differs from value, which it then takes; counted as
+// skipped otherwise
+bool StateChanged(GLuint *cached, GLuint value)
+{
+	if (*cached == value)
+	{
+		glState.skipped++;
+		return false;
+	}
+	*cached = value;
+	return true;
+}
+
+void UseProgram(GLuint program)
+{
+	if (StateChanged(&glState.program, program))
+		CountedGL(glUseProgram, program);
+}
+
+void BindVertexArray(GLuint vertexArray)
+{
+	if (StateChanged(&glState.vertexArray, vertexArray))
+		CountedGL(glBindVertexArray, vertexArray);
+}
+
+void ActiveTexture(GLenum unit)
+{
+	if (StateChanged(&glState.activeTexture, unit))
+		CountedGL(glActiveTexture, unit);
+}
+
+void BindTexture(GLenum target, GLuint texture)
+{
+	int unit = glState.activeTexture - GL_TEXTURE0;
+	int slot = target == GL_TEXTURE_RECTANGLE ? 0 : target == GL_TEXTURE_2D ? 1 :
+	           target == GL_TEXTURE_3D ? 2 : target == GL_TEXTURE_2D_ARRAY ? 3 : -1;
+	if (unit < 0 || unit >= cachedTextureUnits || slot < 0)
+		CountedGL(glBindTexture, target, texture);
+	else if (StateChanged(&glState.textures[unit][slot], texture))
+		CountedGL(glBindTexture, target, texture);
+}
+
+void BindFramebuffer(GLenum target, GLuint framebuffer)
+{
+	if (target == GL_FRAMEBUFFER)
+	{
+		if (glState.drawFramebuffer == framebuffer && glState.readFramebuffer == framebuffer)
+		{
+			glState.skipped++;
+			return;
+		}
+		glState.drawFramebuffer = glState.readFramebuffer = framebuffer;
+		CountedGL(glBindFramebuffer, target, framebuffer);
+	}
+	else if (StateChanged(target == GL_DRAW_FRAMEBUFFER ? &glState.drawFramebuffer : &glState.readFramebuffer, framebuffer))
+		CountedGL(glBindFramebuffer, target, framebuffer);
+}
+
+void DeleteVertexArrays(GLsizei count, const GLuint *vertexArrays)
+{
+	glState.ForgetVertexArrays(count, vertexArrays);
+	glDeleteVertexArrays(count, vertexArrays);
+}
+
+void DeleteFramebuffers(GLsizei count, const GLuint *framebuffers)
+{
+	glState.ForgetFramebuffers(count, framebuffers);
+	glDeleteFramebuffers(count, framebuffers);
+}
+
+void DeleteProgram(GLuint program)
+{
+	glState.ForgetProgram(program);
+	glDeleteProgram(program);
+}
+
+// --------------------------------------------------------------------------
+// GPU memory accounting
+//
+// Textures and buffers report their size under their name after every
+// glTexImage or glBufferData, which replaces what an earlier one of the same
+// object reported, and are deleted through DeleteTextures() and
+// DeleteBuffers(), which release it again. The sizes are estimates: drivers
+// pad RGB to RGBA and round up, and add their own overhead.
+
+struct MyDeviceAllocation
+{
+	MemoryCategory category;
+	long long bytes;
+
+	MyDeviceAllocation() : category(intermediateMemory), bytes(0)
+	{}
+};
+
+// textures and buffers have names of their own
+enum DeviceObject { deviceTexture, deviceBuffer };
+
+map<pair<DeviceObject, GLuint>, MyDeviceAllocation> deviceAllocations;
+
+// bytes a texture of the given internal format and size takes
+long long TextureBytes(GLenum internalFormat, int width, int height, int depth = 1)
+{
+	int texel = 4;      // GL_RGB, GL_RGBA and GL_RGBA8
+	if (internalFormat == GL_R8)
+		texel = 1;
+	else if (internalFormat == GL_RGB16 || internalFormat == GL_RGBA16 ||
+	         internalFormat == GL_RGBA16F || internalFormat == GL_RG32F)
+		texel = 8;
+	else if (internalFormat == GL_RGBA32F)
+		texel = 16;
+	return (long long)width * height * depth * texel;
+}
+
+void CountDeviceObject(DeviceObject kind, GLuint name, MemoryCategory category, long long bytes)
+{
+	MyDeviceAllocation &allocation = deviceAllocations[make_pair(kind, name)];
+	CountMemory(deviceMemory, allocation.category, -allocation.bytes);
+	allocation.category = category;
+	allocation.bytes = bytes;
+	CountMemory(deviceMemory, category, bytes);
+}
+
+void CountTexture(GLuint texture, MemoryCategory category, GLenum internalFormat,
+                  int width, int height, int depth = 1)
+{
+	CountDeviceObject(deviceTexture, texture, category, TextureBytes(internalFormat, width, height, depth));
+}
+
+void CountBuffer(GLuint buffer, MemoryCategory category, long long bytes)
+{
+	CountDeviceObject(deviceBuffer, buffer, category, bytes);
+}
+
+// makes room for texture to be (re)specified with the given format and size;
+// returns true if it fits under the GPU memory cap. The evictors delete
+// textures and unbind them, so call it before binding texture
+bool ReserveTexture(GLuint texture, GLenum internalFormat, int width, int height, int depth = 1)
+{
+	map<pair<DeviceObject, GLuint>, MyDeviceAllocation>::iterator found = deviceAllocations.find(make_pair(deviceTexture, texture));
+	long long held = found != deviceAllocations.end() ? found->second.bytes : 0;
+	return ReserveMemory(deviceMemory, TextureBytes(internalFormat, width, height, depth) - held);
+}
+
+void ForgetDeviceObjects(DeviceObject kind, GLsizei count, const GLuint *names)
+{
+	for (GLsizei i = 0; i < count; i++)
+	{
+		map<pair<DeviceObject, GLuint>, MyDeviceAllocation>::iterator found = deviceAllocations.find(make_pair(kind, names[i]));
+		if (found == deviceAllocations.end())
+			continue;
+		CountMemory(deviceMemory, found->second.category, -found->second.bytes);
+		deviceAllocations.erase(found);
+	}
+}
+
+void DeleteTextures(GLsizei count, const GLuint *textures)
+{
+	ForgetDeviceObjects(deviceTexture, count, textures);
+	glState.ForgetTextures(count, textures);
+	glDeleteTextures(count, textures);
+}
+
+void DeleteBuffers(GLsizei count, const GLuint *buffers)
+{
+	ForgetDeviceObjects(deviceBuffer, count, buffers);
+	glDeleteBuffers(count, buffers);
+}
+
+// --------------------------------------------------------------------------
+// Effect parameters of fragment.glsl, in one std140 uniform block
+
+// binding point of the Effects block
+const GLuint effectBinding = 0;
+
+// the Effects block of fragment.glsl, laid out by the std140 rules
+struct MyEffectBlock
+{
+	GLfloat edge[12];       // mat3, every column padded to a vec4
+	GLint colourEffect;
+	GLint edgeEffect;
+	GLint blur;
+	GLint cpuFiltered;
+	GLfloat gridScale[3];   // cells per texel along x and y, per intensity along z
+	GLint gridPad;
+	GLint rankRadius;
+	GLint rankIndex;
+	GLint padding[2];       // the block takes whole vec4s
+
+	MyEffectBlock()
+	{
+		memset(this, 0, sizeof(*this));
+	}
+};
+
+struct MyEffectBuffer
+{
+	GLuint buffer;
+	MyEffectBlock uploaded;     // what the buffer holds
+
+	MyEffectBuffer() : buffer(0)
+	{}
+};
+
+MyEffectBuffer effectBuffer;
+
+// hands the effect parameters to fragment.glsl with one glBufferSubData, or
+// none when they are what the buffer already holds
+void UploadEffects(const EffectState &state, bool cpuFiltered)
+{
+	MyEffectBlock block;
+	for (int row = 0; row < 3; row++)
+		for (int column = 0; column < 3; column++)
+			block.edge[column * 4 + row] = state.edge[row * 3 + column];
+	block.colourEffect = state.colourEffect;
+	block.edgeEffect = state.edgeEffect;
+	block.blur = state.blur;
+	block.cpuFiltered = cpuFiltered;
+	block.gridScale[0] = block.gridScale[1] = 1.f / state.bilateralSpatial;
+	block.gridScale[2] = 1.f / state.bilateralRange;
+	block.gridPad = bilateralPad;
+	block.rankRadius = state.rankRadius;
+	block.rankIndex = RankIndex(state);
+
+	if (effectBuffer.buffer == 0)
+	{
+		glGenBuffers(1, &effectBuffer.buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, effectBuffer.buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(block), &block, GL_DYNAMIC_DRAW);
+		CountBuffer(effectBuffer.buffer, intermediateMemory, sizeof(block));
+		glBindBufferBase(GL_UNIFORM_BUFFER, effectBinding, effectBuffer.buffer);
+		effectBuffer.uploaded = block;
+		return;
+	}
+	if (memcmp(&block, &effectBuffer.uploaded, sizeof(block)) == 0)
+	{
+		glState.skipped += 2;   // the bind and the upload below
+		return;
+	}
+	CountedGL(glBindBuffer, GL_UNIFORM_BUFFER, effectBuffer.buffer);
+	CountedGL(glBufferSubData, GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	effectBuffer.uploaded = block;
+}
+
+void DestroyEffectBuffer()
+{
+	DeleteBuffers(1, &effectBuffer.buffer);
+	effectBuffer = MyEffectBuffer();
+}
 
 // --------------------------------------------------------------------------
 // Functions to set up OpenGL shader programs for rendering
 
 struct MyShader
 {
-	// OpenGL names for vertex and fragment shaders, shader program
+	// OpenGL names for vertex, fragment and geometry shaders, shader program
 	GLuint  vertex;
 	GLuint  fragment;
+	GLuint  geometry;
+	GLuint  compute;
 	GLuint  program;
 
 	// initialize shader and program names to zero (OpenGL reserved value)
-	MyShader() : vertex(0), fragment(0), program(0)
+	MyShader() : vertex(0), fragment(0), geometry(0), compute(0), program(0)
 	{}
 };
 
 //global
 MyShader shader;
 
-// load, compile, and link shaders, returning true if successful
-bool InitializeShaders(MyShader *shader)
+// load, compile, and link shaders, returning true if successful; the
+// geometry shader is optional
+bool InitializeShaders(MyShader *shader, const char *fragmentFile = "fragment.glsl",
+                       const char *vertexFile = "vertex.glsl", const char *geometryFile = nullptr)
 {
 	// load shader source from files
-	string vertexSource = LoadSource("vertex.glsl");
-	string fragmentSource = LoadSource("fragment.glsl");
+	string vertexSource = LoadSource(vertexFile);
+	string fragmentSource = LoadSource(fragmentFile);
+	string geometrySource = geometryFile ? LoadSource(geometryFile) : "";
 	if (vertexSource.empty() || fragmentSource.empty()) return false;
+	if (geometryFile && geometrySource.empty()) return false;
 
 	// compile shader source into shader objects
 	shader->vertex = CompileShader(GL_VERTEX_SHADER, vertexSource);
 	shader->fragment = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	if (geometryFile)
+		shader->geometry = CompileShader(GL_GEOMETRY_SHADER, geometrySource);
 
 	// link shader program
-	shader->program = LinkProgram(shader->vertex, shader->fragment);
+	shader->program = LinkProgram(shader->vertex, shader->fragment, shader->geometry);
+
+	// the picture is read from texture unit 0, the bilateral grid from 1, the
+	// Canny edges from 2 and the levels curves from 3
+	UseProgram(shader->program);
+	GLint locG = glGetUniformLocation(shader->program, "grid");
+	if (locG != -1)
+		glUniform1i(locG, 1);
+	GLint locK = glGetUniformLocation(shader->program, "canny");
+	if (locK != -1)
+		glUniform1i(locK, 2);
+	GLint locL = glGetUniformLocation(shader->program, "levels");
+	if (locL != -1)
+		glUniform1i(locL, 3);
+
+	// and the effect parameters from the uniform buffer
+	GLuint effects = glGetUniformBlockIndex(shader->program, "Effects");
+	if (effects != GL_INVALID_INDEX)
+		glUniformBlockBinding(shader->program, effects, effectBinding);
 
 	// check for OpenGL errors and return false if error occurred
 	return !CheckGLErrors();
@@ -101,10 +496,80 @@ bool InitializeShaders(MyShader *shader)
 void DestroyShaders(MyShader *shader)
 {
 	// unbind any shader programs and destroy shader objects
-	glUseProgram(0);
-	glDeleteProgram(shader->program);
+	UseProgram(0);
+	DeleteProgram(shader->program);
 	glDeleteShader(shader->vertex);
 	glDeleteShader(shader->fragment);
+	glDeleteShader(shader->geometry);
+	glDeleteShader(shader->compute);
+}
+
+// --------------------------------------------------------------------------
+// OpenGL 4.3 entry points of the compute shaders
+//
+// The headers of macOS stop at OpenGL 4.1 and declare neither the functions
+// nor the constants, so the functions are looked up at run time and called
+// only when the context has them
+
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_SHADER_STORAGE_BARRIER_BIT
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#endif
+#ifndef GL_TEXTURE_FETCH_BARRIER_BIT
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#endif
+
+struct MyComputeGL
+{
+	void (*DispatchCompute)(GLuint x, GLuint y, GLuint z);
+	void (*ClearBufferData)(GLenum target, GLenum internalFormat, GLenum format, GLenum type, const void *data);
+	void (*BindImageTexture)(GLuint unit, GLuint texture, GLint level, GLboolean layered, GLint layer,
+	                         GLenum access, GLenum format);
+	void (*MemoryBarrier)(GLbitfield barriers);
+
+	MyComputeGL() : DispatchCompute(nullptr), ClearBufferData(nullptr), BindImageTexture(nullptr), MemoryBarrier(nullptr)
+	{}
+};
+
+MyComputeGL computeGL;
+
+// looks the entry points up if the context is OpenGL 4.3 or later; returns
+// true if all of them were found
+bool LoadComputeGL()
+{
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major * 10 + minor < 43)
+		return false;
+
+	MyComputeGL &gl = computeGL;
+	gl.DispatchCompute = (void (*)(GLuint, GLuint, GLuint))glfwGetProcAddress("glDispatchCompute");
+	gl.ClearBufferData = (void (*)(GLenum, GLenum, GLenum, GLenum, const void *))glfwGetProcAddress("glClearBufferData");
+	gl.BindImageTexture = (void (*)(GLuint, GLuint, GLint, GLboolean, GLint, GLenum, GLenum))
+		glfwGetProcAddress("glBindImageTexture");
+	gl.MemoryBarrier = (void (*)(GLbitfield))glfwGetProcAddress("glMemoryBarrier");
+	return gl.DispatchCompute && gl.ClearBufferData && gl.BindImageTexture && gl.MemoryBarrier;
+}
+
+// load, compile, and link a compute shader, which needs OpenGL 4.3; returns
+// true if successful
+bool InitializeComputeShader(MyShader *shader, const char *computeFile)
+{
+	string computeSource = LoadSource(computeFile);
+	if (computeSource.empty()) return false;
+
+	shader->compute = CompileShader(GL_COMPUTE_SHADER, computeSource);
+	shader->program = LinkProgram(shader->compute, 0);
+
+	GLint status;
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	return status == GL_TRUE && !CheckGLErrors();
 }
 
 // --------------------------------------------------------------------------
@@ -124,17 +589,31 @@ struct MyTexture
 
 bool InitializeTexture(MyTexture* texture, const char* filename, GLuint target = GL_TEXTURE_2D)
 {
-	int numComponents;
-	stbi_set_flip_vertically_on_load(true);
-	unsigned char *data = stbi_load(filename, &texture->width, &texture->height, &numComponents, 0);
-	if (data != nullptr)
+	// decoded texels come mapped from the pixel cache when it has them; all
+	// 16 bits of 16-bit PNGs are kept instead of reducing them to 8
+	double start = glfwGetTime();
+	MyMappedImage image;
+	if (LoadCachedPixels(filename, &image))
 	{
+		int numComponents = image.numComponents;
+		bool sixteenBit = image.bytesPerComponent == 2;
+		const void *data = image.pixels;
+		texture->width = image.width;
+		texture->height = image.height;
+
 		texture->target = target;
 		glGenTextures(1, &texture->textureID);
-		glBindTexture(texture->target, texture->textureID);
 		GLuint format = numComponents == 3 ? GL_RGB : GL_RGBA;
+		GLuint internalFormat = format;
+		if (sixteenBit)
+			internalFormat = numComponents == 3 ? GL_RGB16 : GL_RGBA16;
                 //cout << numComponents << endl;
-		glTexImage2D(texture->target, 0, format, texture->width, texture->height, 0, format, GL_UNSIGNED_BYTE, data);
+		ReserveTexture(texture->textureID, internalFormat, texture->width, texture->height);
+		BindTexture(texture->target, texture->textureID);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(texture->target, 0, internalFormat, texture->width, texture->height, 0, format,
+		             sixteenBit ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, data);
+		CountTexture(texture->textureID, sourceMemory, internalFormat, texture->width, texture->height);
 
 		// Note: Only wrapping modes supported for GL_TEXTURE_RECTANGLE when defining
 		// GL_TEXTURE_WRAP are GL_CLAMP_TO_EDGE or GL_CLAMP_TO_BORDER
@@ -147,9 +626,12 @@ bool InitializeTexture(MyTexture* texture, const char* filename, GLuint target =
                 picHeight = texture->height;
                 //cout << picWidth << endl;
 
+		cout << "Loaded " << filename << (image.mapping ? " from the pixel cache" : "") << " in "
+		     << (glfwGetTime() - start) * 1000.0 << " ms" << endl;
+
 		// Clean up
-		glBindTexture(texture->target, 0);
-		stbi_image_free(data);
+		BindTexture(texture->target, 0);
+		ReleaseCachedPixels(&image);
 		return !CheckGLErrors();
 	}
 	return true; //error
@@ -158,8 +640,8 @@ bool InitializeTexture(MyTexture* texture, const char* filename, GLuint target =
 // deallocate texture-related objects
 void DestroyTexture(MyTexture *texture)
 {
-	glBindTexture(texture->target, 0);
-	glDeleteTextures(1, &texture->textureID);
+	BindTexture(texture->target, 0);
+	DeleteTextures(1, &texture->textureID);
 }
 
 void SaveImage(const char* filename, int width, int height, unsigned char *data, int numComponents = 3, int stride = 0)
@@ -180,49 +662,44 @@ struct MyGeometry
 	GLuint  vertexArray;
 	GLsizei elementCount;
 
+	// what the vertex and texture coordinate buffers hold, so that a view
+	// that did not change uploads nothing
+	GLfloat vertices[6][2];
+	GLfloat textureCoordinates[6][2];
+
 	// initialize object names to zero (OpenGL reserved value)
-	MyGeometry() : vertexBuffer(0), colourBuffer(0), vertexArray(0), elementCount(0)
-	{}
+	MyGeometry() : vertexBuffer(0), textureBuffer(0), colourBuffer(0), vertexArray(0), elementCount(0)
+	{
+		memset(vertices, 0, sizeof(vertices));
+		memset(textureCoordinates, 0, sizeof(textureCoordinates));
+	}
 };
 
-// create buffers and fill with geometry data, returning true if successful
-bool InitializeGeometry(MyGeometry *geometry)
+// replaces the six points a buffer of the quad holds when they changed
+void UpdateQuadBuffer(GLuint buffer, GLfloat held[6][2], const GLfloat points[][2])
 {
-	//cout << mag << endl;
-	float heightRatio = 1;
-	float widthRatio = 1;
-	
-	//if((picHeight>screenSize)||(picWidth>screenSize))
-	//{
-		if(picWidth>picHeight)
-		{
-			heightRatio = 1;
-			widthRatio = picWidth/picHeight;
-		}
-		else if(picHeight>picWidth)
-		{
-			heightRatio = picHeight/picWidth;
-			widthRatio = 1;
-		}
-	//}
-
-         int tempPictureCenterX = pictureCenterX;
-         int tempPictureCenterY = pictureCenterY;
-         pictureCenterX = pictureCenterX - oldPictureCenterX;
-         pictureCenterY = pictureCenterY - oldPictureCenterY;
-         oldPictureCenterX = tempPictureCenterX;
-         oldPictureCenterY = tempPictureCenterY;
-
-         //four vertex positions and assocated colours of a polygon
-        const GLfloat vertices[][2] = {
-                { (((-1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
-                { (((-1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY},
-                { (((1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+	if (memcmp(held, points, 6 * 2 * sizeof(GLfloat)) == 0)
+	{
+		glState.skipped += 2;   // the bind and the upload below
+		return;
+	}
+	memcpy(held, points, 6 * 2 * sizeof(GLfloat));
+	CountedGL(glBindBuffer, GL_ARRAY_BUFFER, buffer);
+	CountedGL(glBufferSubData, GL_ARRAY_BUFFER, 0, 6 * 2 * sizeof(GLfloat), points);
+}
 
-                { (((1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
-                { (((1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
-                { (((-1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
-        };
+// fill buffers with the six vertices of a textured quad, or update the
+// buffers it already has, returning true if successful
+bool FillGeometry(MyGeometry *geometry, const GLfloat vertices[][2], const GLfloat textureCoordinates[][2])
+{
+	if (geometry->vertexArray != 0)
+	{
+		UpdateQuadBuffer(geometry->vertexBuffer, geometry->vertices, vertices);
+		UpdateQuadBuffer(geometry->textureBuffer, geometry->textureCoordinates, textureCoordinates);
+		return true;
+	}
+	memcpy(geometry->vertices, vertices, sizeof(geometry->vertices));
+	memcpy(geometry->textureCoordinates, textureCoordinates, sizeof(geometry->textureCoordinates));
 
         const GLfloat colours[][3] = {
 				{ 1.0f, 0.0f, 0.0f },
@@ -232,17 +709,6 @@ bool InitializeGeometry(MyGeometry *geometry)
                 { 0.0f, 0.0f, 1.0f },
                 { 1.0f, 0.0f, 0.0f }
 	};
-        const GLfloat textureCoordinates[][2] = {
-				{0.f,0.f},
-				{0.f,picHeight},
-				{picWidth,picHeight},
-
-				{picWidth,picHeight},
-				{picWidth,0.f},
-				{0.f,0.f}
-        };
-
-        //cout << picWidth << endl;
 
         geometry->elementCount = 6;
 
@@ -255,21 +721,24 @@ bool InitializeGeometry(MyGeometry *geometry)
 	// create an array buffer object for storing our vertices
 	glGenBuffers(1, &geometry->vertexBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, 6 * 2 * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+	CountBuffer(geometry->vertexBuffer, intermediateMemory, 6 * 2 * sizeof(GLfloat));
 
         //Create array buffer for storing texture coordinates
         glGenBuffers(1,&geometry->textureBuffer);
         glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(textureCoordinates), textureCoordinates, GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, 6 * 2 * sizeof(GLfloat), textureCoordinates, GL_STATIC_DRAW);
+        CountBuffer(geometry->textureBuffer, intermediateMemory, 6 * 2 * sizeof(GLfloat));
 
 	// create another one for storing our colours
 	glGenBuffers(1, &geometry->colourBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, geometry->colourBuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(colours), colours, GL_STATIC_DRAW);
+	CountBuffer(geometry->colourBuffer, intermediateMemory, sizeof(colours));
 
 	// create a vertex array object encapsulating all our vertex attributes
 	glGenVertexArrays(1, &geometry->vertexArray);
-	glBindVertexArray(geometry->vertexArray);
+	BindVertexArray(geometry->vertexArray);
 
 	// associate the position array with the vertex array object
 	glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
@@ -288,21 +757,140 @@ bool InitializeGeometry(MyGeometry *geometry)
 
 	// unbind our buffers, resetting to default state
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+	BindVertexArray(0);
 
 	// check for OpenGL errors and return false if error occurred
 	return !CheckGLErrors();
 }
 
+// create buffers and fill with the picture's quad under the current view, or
+// update them when the view or the picture's aspect ratio changed, returning
+// true if successful
+bool InitializeGeometry(MyGeometry *geometry)
+{
+	//cout << mag << endl;
+	float heightRatio = 1;
+	float widthRatio = 1;
+	
+	//if((picHeight>screenSize)||(picWidth>screenSize))
+	//{
+		if(picWidth>picHeight)
+		{
+			heightRatio = 1;
+			widthRatio = picWidth/picHeight;
+		}
+		else if(picHeight>picWidth)
+		{
+			heightRatio = picHeight/picWidth;
+			widthRatio = 1;
+		}
+	//}
+
+         //four vertex positions and assocated colours of a polygon
+        const GLfloat vertices[][2] = {
+                { (((-1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+                { (((-1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY},
+                { (((1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+
+                { (((1.f/heightRatio)*cos(orien)-(1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+                { (((1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+                { (((-1.f/heightRatio)*cos(orien)-(-1.f/widthRatio)*sin(orien))*mag)+pictureCenterX, (((-1.f/heightRatio)*sin(orien)+(-1.f/widthRatio)*cos(orien))*mag)+pictureCenterY },
+        };
+
+        const GLfloat textureCoordinates[][2] = {
+				{0.f,0.f},
+				{0.f,picHeight},
+				{picWidth,picHeight},
+
+				{picWidth,picHeight},
+				{picWidth,0.f},
+				{0.f,0.f}
+        };
+
+        //cout << picWidth << endl;
+
+	return FillGeometry(geometry, vertices, textureCoordinates);
+}
+
+// create a quad covering the whole viewport that maps every fragment to the
+// texel it sits on, for filtering images off-screen at their own size
+bool InitializeQuad(MyGeometry *geometry, float width, float height)
+{
+	const GLfloat vertices[][2] = {
+		{ -1.f, -1.f }, { -1.f, 1.f }, { 1.f, 1.f },
+		{ 1.f, 1.f }, { 1.f, -1.f }, { -1.f, -1.f }
+	};
+	const GLfloat textureCoordinates[][2] = {
+		{ 0.f, 0.f }, { 0.f, height }, { width, height },
+		{ width, height }, { width, 0.f }, { 0.f, 0.f }
+	};
+	return FillGeometry(geometry, vertices, textureCoordinates);
+}
+
 // deallocate geometry-related objects
 void DestroyGeometry(MyGeometry *geometry)
 {
 	// unbind and destroy our vertex array object and associated buffers
-	glBindVertexArray(0);
-	glDeleteVertexArrays(1, &geometry->vertexArray);
-        glDeleteBuffers(1, &geometry->textureBuffer);
-	glDeleteBuffers(1, &geometry->vertexBuffer);
-        glDeleteBuffers(1, &geometry->colourBuffer);
+	BindVertexArray(0);
+	DeleteVertexArrays(1, &geometry->vertexArray);
+        DeleteBuffers(1, &geometry->textureBuffer);
+	DeleteBuffers(1, &geometry->vertexBuffer);
+        DeleteBuffers(1, &geometry->colourBuffer);
+	*geometry = MyGeometry();
+}
+
+// --------------------------------------------------------------------------
+// Functions to set up OpenGL framebuffers for off-screen rendering
+
+struct MyFramebuffer
+{
+	GLuint  framebuffer;
+	GLuint  colour;
+	int     width;
+	int     height;
+
+	// initialize object names to zero (OpenGL reserved value)
+	MyFramebuffer() : framebuffer(0), colour(0), width(0), height(0)
+	{}
+};
+
+// create a framebuffer with a single colour texture, returning true if successful;
+// the default half-float format keeps signed and out of range intermediates
+bool InitializeFramebuffer(MyFramebuffer *framebuffer, int width, int height, GLenum format = GL_RGBA16F)
+{
+	// before anything is filled in, since the evictors may reset framebuffer
+	ReserveTexture(framebuffer->colour, format, width, height);
+	framebuffer->width = width;
+	framebuffer->height = height;
+
+	glGenTextures(1, &framebuffer->colour);
+	BindTexture(GL_TEXTURE_2D, framebuffer->colour);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	CountTexture(framebuffer->colour, intermediateMemory, format, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	BindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &framebuffer->framebuffer);
+	BindFramebuffer(GL_FRAMEBUFFER, framebuffer->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebuffer->colour, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (!complete)
+		cout << "Framebuffer is incomplete" << endl;
+	return complete && !CheckGLErrors();
+}
+
+// deallocate framebuffer-related objects
+void DestroyFramebuffer(MyFramebuffer *framebuffer)
+{
+	BindFramebuffer(GL_FRAMEBUFFER, 0);
+	DeleteFramebuffers(1, &framebuffer->framebuffer);
+	DeleteTextures(1, &framebuffer->colour);
+	*framebuffer = MyFramebuffer();
 }
 
 // --------------------------------------------------------------------------
@@ -312,285 +900,833 @@ void RenderScene(MyGeometry *geometry, MyTexture* texture, MyShader *shader)
 {
         //cout << "Rednering Scene" << endl;
         // clear screen to a dark grey colour
-	glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	CountedGL(glClearColor, 0.2f, 0.2f, 0.2f, 1.0f);
+	CountedGL(glClear, GL_COLOR_BUFFER_BIT);
 
 	// bind our shader program and the vertex array object containing our
-	// scene geometry, then tell OpenGL to draw our geometry
-	glUseProgram(shader->program);
-        glBindVertexArray(geometry->vertexArray);
-        glBindTexture(texture->target, texture->textureID);
-        glDrawArrays(GL_TRIANGLES, 0, geometry->elementCount);
-
-	// reset state to default (no shader or geometry bound)
-        glBindTexture(texture->target, 0);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	// scene geometry, then tell OpenGL to draw our geometry; the binds are
+	// left in place, so the next frame only pays for what changed
+	UseProgram(shader->program);
+        BindVertexArray(geometry->vertexArray);
+        BindTexture(texture->target, texture->textureID);
+        CountedGL(glDrawArrays, GL_TRIANGLES, 0, geometry->elementCount);
 
 	// check for an report any OpenGL errors
 	CheckGLErrors();
 }
 
 // --------------------------------------------------------------------------
-// GLFW callback functions
+// Progressive rendering while the user scrolls or drags
 
-// reports GLFW errors
-void ErrorCallback(int error, const char* description)
+MyFramebuffer preview;
+MyGeometry shownGeometry;   // what is on screen, kept so it can be refined
+MyTexture shownTexture;
+
+// draws the scene at 1/step of the window resolution and scales it up to the
+// window, so the effects are evaluated for 1/step^2 of the fragments
+void RenderPreview(MyGeometry *geometry, MyTexture* texture, MyShader *shader, int step)
 {
-	cout << "GLFW ERROR " << error << ":" << endl;
-	cout << description << endl;
+	GLint viewport[4];
+	CountedGL(glGetIntegerv, GL_VIEWPORT, viewport);
+	int width = max(viewport[2] / step, 1);
+	int height = max(viewport[3] / step, 1);
+	if (preview.width != width || preview.height != height)
+	{
+		DestroyFramebuffer(&preview);
+		if (!InitializeFramebuffer(&preview, width, height))
+		{
+			RenderScene(geometry, texture, shader);
+			return;
+		}
+	}
+
+	BindFramebuffer(GL_FRAMEBUFFER, preview.framebuffer);
+	CountedGL(glViewport, 0, 0, width, height);
+	RenderScene(geometry, texture, shader);
+
+	BindFramebuffer(GL_READ_FRAMEBUFFER, preview.framebuffer);
+	BindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	CountedGL(glBlitFramebuffer, 0, 0, width, height,
+	          viewport[0], viewport[1], viewport[0] + viewport[2], viewport[1] + viewport[3],
+	          GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	BindFramebuffer(GL_FRAMEBUFFER, 0);
+	CountedGL(glViewport, viewport[0], viewport[1], viewport[2], viewport[3]);
 }
 
-// handles keyboard input events
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+// true while scroll or drag input is still arriving
+bool Interacting()
 {
-        glUseProgram(shader.program);
-        MyGeometry geometry;
-	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, GL_TRUE);
+	return glfwGetTime() - lastInteraction < idleDelay;
+}
 
-        //When 1 is pressed display image 1
-        else if(key == GLFW_KEY_1 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            mag = 1;
-            orien = 0;
-            blur = 0;
-            cout << "Image 1" << endl;
-            picName = "image1-mandrill.png";
-            PicGen(picName);
-        }
-        //When 2 is pressed display image 2
-        else if(key == GLFW_KEY_2 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            mag = 1;
-            orien = 0;
-            blur = 0;
-            cout << "Image 2" << endl;
-            picName = "image2-uclogo.png";
-            PicGen(picName);
-        }
-        //When 3 is pressed display image 3
-        else if(key == GLFW_KEY_3 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            mag = 1;
-            orien = 0;
-            blur = 0;
-            cout << "Image 3" << endl;
-            picName = "image3-aerial.jpg";
-            PicGen(picName);
-        }
-        //When 4 is pressed display image 4
-        else if(key == GLFW_KEY_4 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            orien = 0;
-            mag = 1;
-            blur = 0;
-            cout << "Image 4" << endl;
-            picName = "image4-thirsk.jpg";
-            PicGen(picName);
-        }
-        //When 5 is pressed display image 5
-        else if(key == GLFW_KEY_5 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            orien = 0;
-            mag = 1;
-            blur = 0;
-            cout << "Image 5" << endl;
-            picName = "image5-pattern.png";
-            PicGen(picName);
-        }
-        //When 6 is pressed display image 6
-        else if(key == GLFW_KEY_6 && action == GLFW_PRESS)
-        {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            orien = 0;
-            mag = 1;
-            blur = 0;
-            cout << "Image 6" << endl;
-            picName = "image6-war.jpg";            
-            if (!InitializeGeometry(&geometry))
-                cout << "Program failed to intialize geometry!" << endl;
-PicGen(picName);
-            PicGen(picName);
-        }
-        //When 7 is pressed display image 7
-        else if(key == GLFW_KEY_7 && action == GLFW_PRESS)
+// resolution divisor for the next frame: heavy effects are drawn at a reduced
+// resolution during interaction, picked so that the frame fits the budget
+int InteractiveStep()
+{
+	bool heavy = blur != 0 || edgeEffect != 0;
+	if (!Interacting() || !heavy || fullFrameCost <= frameBudget)
+		return 1;
+	return min((int)ceil(sqrt(fullFrameCost / frameBudget)), 8);
+}
+
+// draws the scene at the quality the interaction allows, and keeps track of
+// how long a full quality frame takes
+void RenderFrame(MyGeometry *geometry, MyTexture* texture)
+{
+	bool onCpu = FilteringOnCpu();
+	int step = onCpu ? 1 : InteractiveStep();
+
+	double start = glfwGetTime();
+	if (step > 1)
+		RenderPreview(geometry, texture, &shader, step);
+	else
+		RenderScene(geometry, texture, &shader);
+	CountedGL(glFinish);
+
+	// shading cost scales with the number of fragments
+	fullFrameCost = (glfwGetTime() - start) * 1000.0 * step * step;
+	if (!onCpu)
+		previewStep = step;
+
+	if (reportGLCalls)
+		cout << "Frame: " << glState.calls << " GL calls, " << glState.skipped << " redundant ones skipped ("
+		     << glState.calls + glState.skipped << " without the caches)" << endl;
+	glState.calls = glState.skipped = 0;
+
+	shownGeometry = *geometry;
+	shownTexture = *texture;
+}
+
+// --------------------------------------------------------------------------
+// Bilateral grid for the edge-preserving blur (blur level 4)
+
+struct MyBilateralGrid3D
+{
+	MyShader splat;
+	MyShader blur;
+	GLuint textures[2];     // RGBA float grids, the blur passes go back and forth
+	GLuint framebuffer;
+	MyGeometry quad;
+	int width;
+	int height;
+	int depth;
+	string source;          // picture the grid was built from
+	int spatial;            // and the sigmas it was built with
+	float range;
+
+	MyBilateralGrid3D() : framebuffer(0), width(0), height(0), depth(0), spatial(0), range(0.f)
+	{
+		textures[0] = textures[1] = 0;
+	}
+};
+
+MyBilateralGrid3D bilateralGrid;
+
+// renders every intensity layer of target with the bound program
+void DrawGridLayers(MyBilateralGrid3D *grid, GLuint target, GLint layerUniform)
+{
+	for (int z = 0; z < grid->depth; z++)
+	{
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, 0, z);
+		glUniform1i(layerUniform, z);
+		glDrawArrays(GL_TRIANGLES, 0, grid->quad.elementCount);
+	}
+}
+
+// splats the picture into the grid with the sigmas of state and blurs it on
+// the GPU, then binds the result to texture unit 1 where fragment.glsl slices
+// it; returns true if successful
+bool BuildBilateralGrid3D(MyTexture *texture, const string &name, const EffectState &state)
+{
+	MyBilateralGrid3D &grid = bilateralGrid;
+	if (grid.splat.program == 0)
+	{
+		if (!InitializeShaders(&grid.splat, "bilateral_splat.glsl", "bilateral_splat_vertex.glsl",
+		                       "bilateral_splat_geometry.glsl") ||
+		    !InitializeShaders(&grid.blur, "bilateral_blur.glsl"))
+		{
+			cout << "Program could not initialize the bilateral grid shaders" << endl;
+			return false;
+		}
+		glGenTextures(2, grid.textures);
+		glGenFramebuffers(1, &grid.framebuffer);
+	}
+
+	int width, height, depth;
+	BilateralGridSize(texture->width, texture->height, state.bilateralSpatial, state.bilateralRange,
+	                  &width, &height, &depth);
+	if (grid.width != width || grid.height != height || grid.depth != depth)
+	{
+		grid.width = width;
+		grid.height = height;
+		grid.depth = depth;
+		for (int i = 0; i < 2; i++)
+		{
+			ReserveTexture(grid.textures[i], GL_RGBA32F, width, height, depth);
+			BindTexture(GL_TEXTURE_3D, grid.textures[i]);
+			glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, width, height, depth, 0, GL_RGBA, GL_FLOAT, nullptr);
+			CountTexture(grid.textures[i], intermediateMemory, GL_RGBA32F, width, height, depth);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		}
+		BindTexture(GL_TEXTURE_3D, 0);
+		DestroyGeometry(&grid.quad);
+		grid.quad = MyGeometry();
+		InitializeQuad(&grid.quad, width, height);
+	}
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	BindFramebuffer(GL_FRAMEBUFFER, grid.framebuffer);
+	glViewport(0, 0, width, height);
+	BindVertexArray(grid.quad.vertexArray);
+
+	// every texel is read once and drawn as a point into its cell, on all
+	// layers of the grid at once, and the blending sums the points per cell
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, grid.textures[0], 0);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	GLuint splat = grid.splat.program;
+	UseProgram(splat);
+	glUniform2i(glGetUniformLocation(splat, "size"), texture->width, texture->height);
+	glUniform2i(glGetUniformLocation(splat, "cells"), width, height);
+	glUniform1i(glGetUniformLocation(splat, "spatial"), state.bilateralSpatial);
+	glUniform1f(glGetUniformLocation(splat, "range"), state.bilateralRange);
+	glUniform1i(glGetUniformLocation(splat, "pad"), bilateralPad);
+	BindTexture(texture->target, texture->textureID);
+	glDrawArrays(GL_POINTS, 0, texture->width * texture->height);
+	BindTexture(texture->target, 0);
+	glDisable(GL_BLEND);
+
+	// then the grid is blurred along x, y and intensity, ending up in textures[1]
+	GLuint blurProgram = grid.blur.program;
+	UseProgram(blurProgram);
+	const GLint directions[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+	for (int axis = 0; axis < 3; axis++)
+	{
+		glUniform3iv(glGetUniformLocation(blurProgram, "direction"), 1, directions[axis]);
+		BindTexture(GL_TEXTURE_3D, grid.textures[axis % 2]);
+		DrawGridLayers(&grid, grid.textures[(axis + 1) % 2], glGetUniformLocation(blurProgram, "layer"));
+	}
+	BindTexture(GL_TEXTURE_3D, 0);
+
+	BindVertexArray(0);
+	BindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	ActiveTexture(GL_TEXTURE1);
+	BindTexture(GL_TEXTURE_3D, grid.textures[1]);
+	ActiveTexture(GL_TEXTURE0);
+	UseProgram(shader.program);
+
+	grid.source = name;
+	grid.spatial = state.bilateralSpatial;
+	grid.range = state.bilateralRange;
+	return !CheckGLErrors();
+}
+
+// deallocate the bilateral grid shaders, textures and framebuffer
+void DestroyBilateralGrid3D()
+{
+	MyBilateralGrid3D &grid = bilateralGrid;
+	if (grid.splat.program == 0)
+		return;
+	DestroyShaders(&grid.splat);
+	DestroyShaders(&grid.blur);
+	DeleteTextures(2, grid.textures);
+	DeleteFramebuffers(1, &grid.framebuffer);
+	DestroyGeometry(&grid.quad);
+	grid = MyBilateralGrid3D();
+}
+
+// --------------------------------------------------------------------------
+// Canny edge detector (edge effect 3)
+
+struct MyCannyEdgesGL
+{
+	MyShader gradient;
+	MyShader suppress;
+	GLuint textures[3];     // RG float gradient, the texel classes and the edges
+	GLuint framebuffer;
+	MyGeometry quad;
+	int width;
+	int height;
+	MyCannyEdges classes;   // read back for the hysteresis
+	string source;          // picture the edges were found in
+
+	MyCannyEdgesGL() : framebuffer(0), width(0), height(0)
+	{
+		textures[0] = textures[1] = textures[2] = 0;
+	}
+};
+
+MyCannyEdgesGL cannyEdges;
+
+// draws the quad into target with the bound program
+void DrawCannyPass(MyCannyEdgesGL *canny, GLuint target)
+{
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, target, 0);
+	glDrawArrays(GL_TRIANGLES, 0, canny->quad.elementCount);
+}
+
+// runs the gradient and suppression passes over the picture and the
+// hysteresis on the CPU, then binds the edges to texture unit 2 where
+// fragment.glsl reads them; returns true if successful.
+//
+// Hysteresis as repeated passes promotes one texel along a weak chain per
+// pass and needed hundreds of them on noisy pictures, where reading back a
+// byte per texel and joining the chains with union-find costs a few ms
+bool BuildCannyEdgesGL(MyTexture *texture, const string &name)
+{
+	MyCannyEdgesGL &canny = cannyEdges;
+	if (canny.gradient.program == 0)
+	{
+		if (!InitializeShaders(&canny.gradient, "canny_gradient.glsl") ||
+		    !InitializeShaders(&canny.suppress, "canny_suppress.glsl"))
+		{
+			cout << "Program could not initialize the Canny shaders" << endl;
+			return false;
+		}
+		glGenTextures(3, canny.textures);
+		glGenFramebuffers(1, &canny.framebuffer);
+	}
+
+	int width = texture->width, height = texture->height;
+	if (canny.width != width || canny.height != height)
+	{
+		canny.width = width;
+		canny.height = height;
+		for (int i = 0; i < 3; i++)
+		{
+			GLenum internalFormat = i == 0 ? GL_RG32F : GL_R8;
+			ReserveTexture(canny.textures[i], internalFormat, width, height);
+			BindTexture(GL_TEXTURE_RECTANGLE, canny.textures[i]);
+			if (i == 0)
+				glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RG32F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
+			else
+				glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+			CountTexture(canny.textures[i], intermediateMemory, internalFormat, width, height);
+			glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		BindTexture(GL_TEXTURE_RECTANGLE, 0);
+		DestroyGeometry(&canny.quad);
+		canny.quad = MyGeometry();
+		InitializeQuad(&canny.quad, width, height);
+	}
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	BindFramebuffer(GL_FRAMEBUFFER, canny.framebuffer);
+	glViewport(0, 0, width, height);
+	BindVertexArray(canny.quad.vertexArray);
+
+	// magnitude and direction in one pass
+	GLuint program = canny.gradient.program;
+	UseProgram(program);
+	glUniform2i(glGetUniformLocation(program, "size"), width, height);
+	BindTexture(texture->target, texture->textureID);
+	DrawCannyPass(&canny, canny.textures[0]);
+	BindTexture(texture->target, 0);
+
+	program = canny.suppress.program;
+	UseProgram(program);
+	glUniform2i(glGetUniformLocation(program, "size"), width, height);
+	glUniform1f(glGetUniformLocation(program, "low"), cannyLow);
+	glUniform1f(glGetUniformLocation(program, "high"), cannyHigh);
+	BindTexture(GL_TEXTURE_RECTANGLE, canny.textures[0]);
+	DrawCannyPass(&canny, canny.textures[1]);
+	BindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+	// the classes come back as the bytes 0, 1 and 2
+	canny.classes.width = width;
+	canny.classes.height = height;
+	canny.classes.edges.resize((size_t)width * height);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, &canny.classes.edges[0]);
+	TraceCannyEdges(&canny.classes);
+
+	BindVertexArray(0);
+	BindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	ActiveTexture(GL_TEXTURE2);
+	BindTexture(GL_TEXTURE_RECTANGLE, canny.textures[2]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, &canny.classes.edges[0]);
+	ActiveTexture(GL_TEXTURE0);
+	UseProgram(shader.program);
+
+	canny.source = name;
+	return !CheckGLErrors();
+}
+
+// deallocate the Canny shaders, textures and framebuffer
+void DestroyCannyEdgesGL()
+{
+	MyCannyEdgesGL &canny = cannyEdges;
+	if (canny.gradient.program == 0)
+		return;
+	DestroyShaders(&canny.gradient);
+	DestroyShaders(&canny.suppress);
+	DeleteTextures(3, canny.textures);
+	DeleteFramebuffers(1, &canny.framebuffer);
+	DestroyGeometry(&canny.quad);
+	canny = MyCannyEdgesGL();
+}
+
+// --------------------------------------------------------------------------
+// Auto levels and histogram equalization (colour effects 6 and 7)
+
+struct MyLevelsGL
+{
+	MyShader histogram;
+	MyShader curves;
+	bool computeChecked;    // compute shaders were tried, they stay zero without OpenGL 4.3
+	GLuint buffer;          // 4 x 256 counts, as in MyHistogram
+	GLuint texture;         // 256 x 2 RGBA float curves, as in MyLevels
+	string source;          // picture the curves were built for
+
+	MyLevelsGL() : computeChecked(false), buffer(0), texture(0)
+	{}
+};
+
+MyLevelsGL levelsCurves;
+
+// counts the histogram of the picture and turns it into the curves with two
+// compute passes, then binds the curves to texture unit 3 where fragment.glsl
+// looks them up; returns true if successful.
+//
+// Without OpenGL 4.3 (macOS stops at 4.1) the curves are built on the CPU
+// from image, or from the picture file when image is null, and uploaded
+bool BuildLevelsGL(MyTexture *texture, const MyImage *image, const string &name)
+{
+	MyLevelsGL &levels = levelsCurves;
+	if (!levels.computeChecked)
+	{
+		levels.computeChecked = true;
+		if (LoadComputeGL())
+		{
+			if (!InitializeComputeShader(&levels.histogram, "levels_histogram.glsl") ||
+			    !InitializeComputeShader(&levels.curves, "levels_curves.glsl"))
+			{
+				cout << "Program could not initialize the levels shaders, the curves are built on the CPU" << endl;
+				DestroyShaders(&levels.histogram);
+				DestroyShaders(&levels.curves);
+				levels.histogram = levels.curves = MyShader();
+			}
+			else
+			{
+				glGenBuffers(1, &levels.buffer);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, levels.buffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, 4 * histogramBins * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+				CountBuffer(levels.buffer, intermediateMemory, 4 * histogramBins * sizeof(GLuint));
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			}
+		}
+
+		glGenTextures(1, &levels.texture);
+		BindTexture(GL_TEXTURE_RECTANGLE, levels.texture);
+		glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA32F, histogramBins, 2, 0, GL_RGBA, GL_FLOAT, nullptr);
+		CountTexture(levels.texture, intermediateMemory, GL_RGBA32F, histogramBins, 2);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		BindTexture(GL_TEXTURE_RECTANGLE, 0);
+	}
+
+	if (levels.curves.program != 0)
+	{
+		const GLuint zero = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, levels.buffer);
+		computeGL.ClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, levels.buffer);
+
+		// one workgroup per 64 x 64 tile, each counting in shared memory
+		UseProgram(levels.histogram.program);
+		BindTexture(texture->target, texture->textureID);
+		computeGL.DispatchCompute((texture->width + 63) / 64, (texture->height + 63) / 64, 1);
+		BindTexture(texture->target, 0);
+		computeGL.MemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		// then a single workgroup scans the counts into the curves
+		UseProgram(levels.curves.program);
+		computeGL.BindImageTexture(0, levels.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		computeGL.DispatchCompute(1, 1, 1);
+		computeGL.MemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+	else
+	{
+		MyImage loaded;
+		if (image == nullptr)
+		{
+			if (!LoadCachedImage(&loaded, name.c_str()))
+			{
+				cout << "Unable to load image: " << name << endl;
+				return false;
+			}
+			image = &loaded;
+		}
+		MyPlanarImage planes;
+		Deinterleave(*image, &planes);
+		MyHistogram histogram;
+		BuildHistogram(planes, &histogram);
+		MyLevels curves;
+		BuildLevels(histogram, &curves);
+
+		BindTexture(GL_TEXTURE_RECTANGLE, levels.texture);
+		glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, histogramBins, 2, GL_RGBA, GL_FLOAT, &curves.curves[0]);
+		BindTexture(GL_TEXTURE_RECTANGLE, 0);
+	}
+
+	ActiveTexture(GL_TEXTURE3);
+	BindTexture(GL_TEXTURE_RECTANGLE, levels.texture);
+	ActiveTexture(GL_TEXTURE0);
+	UseProgram(shader.program);
+
+	levels.source = name;
+	return !CheckGLErrors();
+}
+
+// deallocate the levels shaders, buffer and texture
+void DestroyLevelsGL()
+{
+	MyLevelsGL &levels = levelsCurves;
+	if (!levels.computeChecked)
+		return;
+	DestroyShaders(&levels.histogram);
+	DestroyShaders(&levels.curves);
+	DeleteBuffers(1, &levels.buffer);
+	DeleteTextures(1, &levels.texture);
+	levels = MyLevelsGL();
+}
+
+// --------------------------------------------------------------------------
+// Contact sheet of every picture in a directory
+
+// space around each cell of the sheet, in window pixels
+const int sheetGap = 8;
+
+// a thumbnail as the instanced draw sees it
+struct MySheetInstance
+{
+	GLfloat rect[4];        // x, y, width, height in window pixels, y down
+	GLfloat thumbnail[3];   // layer (-1 while loading), u and v extent
+};
+
+struct MySheet
+{
+	MyShader shader;
+	GLuint thumbnails;      // GL_TEXTURE_2D_ARRAY, a layer per picture
+	GLuint vertexArray;
+	GLuint cornerBuffer;
+	GLuint instanceBuffer;
+
+	vector<string> files;
+	vector<MySheetInstance> instances;
+	vector<bool> loaded;
+	MyThumbnailJobs jobs;
+
+	int columns;            // of the current layout, 0 before the first one
+	float scroll;
+	bool active;            // shown instead of the picture
+
+	MySheet() : thumbnails(0), vertexArray(0), cornerBuffer(0), instanceBuffer(0),
+		columns(0), scroll(0), active(false)
+	{}
+};
+
+MySheet sheet;
+
+// cell of the sheet that the i'th picture sits in
+void PlaceThumbnail(int i)
+{
+	int cell = thumbnailSize + sheetGap;
+	MySheetInstance &instance = sheet.instances[i];
+	float width = thumbnailSize, height = thumbnailSize;
+	if (instance.thumbnail[0] >= 0)
+	{
+		width = instance.thumbnail[1] * thumbnailSize;
+		height = instance.thumbnail[2] * thumbnailSize;
+	}
+	instance.rect[0] = sheetGap + (i % sheet.columns) * cell + (thumbnailSize - width) / 2;
+	instance.rect[1] = sheetGap + (i / sheet.columns) * cell + (thumbnailSize - height) / 2;
+	instance.rect[2] = width;
+	instance.rect[3] = height;
+}
+
+// lists the pictures of the directory and starts making their thumbnails;
+// the sheet fills in as they arrive
+bool OpenSheet(const string &directory)
+{
+	vector<string> files = ListImages(directory);
+	if (files.empty())
+	{
+		cout << "No pictures found in " << directory << endl;
+		return false;
+	}
+	GLint maxLayers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	if ((GLint)files.size() > maxLayers)
+	{
+		cout << "Showing the first " << maxLayers << " of " << files.size() << " pictures" << endl;
+		files.resize(maxLayers);
+	}
+
+	if (sheet.shader.program == 0)
+	{
+		if (!InitializeShaders(&sheet.shader, "sheet_fragment.glsl", "sheet_vertex.glsl"))
+		{
+			cout << "Program could not initialize the contact sheet shaders" << endl;
+			return false;
+		}
+		glGenTextures(1, &sheet.thumbnails);
+
+		// a unit square drawn as two triangles, shared by every instance
+		const GLfloat corners[][2] = { { 0, 0 }, { 0, 1 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 1, 0 } };
+		glGenVertexArrays(1, &sheet.vertexArray);
+		BindVertexArray(sheet.vertexArray);
+		glGenBuffers(1, &sheet.cornerBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, sheet.cornerBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+		CountBuffer(sheet.cornerBuffer, cacheMemory, sizeof(corners));
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		glEnableVertexAttribArray(0);
+
+		// the rest advances once per instance
+		glGenBuffers(1, &sheet.instanceBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, sheet.instanceBuffer);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(MySheetInstance),
+		                      (const GLvoid *)offsetof(MySheetInstance, rect));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(MySheetInstance),
+		                      (const GLvoid *)offsetof(MySheetInstance, thumbnail));
+		glVertexAttribDivisor(1, 1);
+		glVertexAttribDivisor(2, 1);
+		glEnableVertexAttribArray(1);
+		glEnableVertexAttribArray(2);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		BindVertexArray(0);
+	}
+
+	ReserveTexture(sheet.thumbnails, GL_RGBA8, thumbnailSize, thumbnailSize, files.size());
+	BindTexture(GL_TEXTURE_2D_ARRAY, sheet.thumbnails);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, thumbnailSize, thumbnailSize, files.size(), 0,
+	             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	CountTexture(sheet.thumbnails, cacheMemory, GL_RGBA8, thumbnailSize, thumbnailSize, files.size());
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	MySheetInstance loading = { { 0, 0, 0, 0 }, { -1, 0, 0 } };
+	sheet.files = files;
+	sheet.instances.assign(files.size(), loading);
+	sheet.loaded.assign(files.size(), false);
+	sheet.columns = 0;
+	sheet.scroll = 0;
+	sheet.active = true;
+	StartThumbnails(&sheet.jobs, files);
+	cout << "Contact sheet of " << files.size() << " pictures in " << directory << endl;
+	return !CheckGLErrors();
+}
+
+// uploads the thumbnails that finished since the last frame, lays the sheet
+// out for the window width and draws every thumbnail with one instanced draw
+void RenderSheet(GLFWwindow *window)
+{
+	vector<int> ready;
+	CollectThumbnails(&sheet.jobs, &ready);
+	BindTexture(GL_TEXTURE_2D_ARRAY, sheet.thumbnails);
+	for (size_t j = 0; j < ready.size(); j++)
+	{
+		int i = ready[j];
+		const MyImage &image = sheet.jobs.thumbnails[i];
+		sheet.loaded[i] = true;
+		if (image.pixels.empty())
+		{
+			cout << "Unable to load image: " << sheet.files[i] << endl;
+			continue;
+		}
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, image.width, image.height, 1,
+		                GL_RGBA, GL_UNSIGNED_BYTE, &image.pixels[0]);
+		MySheetInstance &instance = sheet.instances[i];
+		instance.thumbnail[0] = i;
+		instance.thumbnail[1] = (float)image.width / thumbnailSize;
+		instance.thumbnail[2] = (float)image.height / thumbnailSize;
+		if (sheet.columns > 0)
+			PlaceThumbnail(i);
+
+		// the texels live in the array now
+		ReleaseThumbnail(&sheet.jobs, i);
+	}
+
+	int windowWidth, windowHeight, width, height;
+	glfwGetWindowSize(window, &windowWidth, &windowHeight);
+	glfwGetFramebufferSize(window, &width, &height);
+	int columns = max((windowWidth - sheetGap) / (thumbnailSize + sheetGap), 1);
+	bool relayout = columns != sheet.columns;
+	if (relayout)
+	{
+		sheet.columns = columns;
+		for (size_t i = 0; i < sheet.instances.size(); i++)
+			PlaceThumbnail(i);
+	}
+	if (relayout || !ready.empty())
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, sheet.instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sheet.instances.size() * sizeof(MySheetInstance),
+		             &sheet.instances[0], GL_DYNAMIC_DRAW);
+		CountBuffer(sheet.instanceBuffer, cacheMemory, sheet.instances.size() * sizeof(MySheetInstance));
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glViewport(0, 0, width, height);
+	glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	UseProgram(sheet.shader.program);
+	glUniform2f(glGetUniformLocation(sheet.shader.program, "viewport"), windowWidth, windowHeight);
+	glUniform1f(glGetUniformLocation(sheet.shader.program, "scroll"), sheet.scroll);
+	BindVertexArray(sheet.vertexArray);
+	BindTexture(GL_TEXTURE_2D_ARRAY, sheet.thumbnails);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, 6, sheet.instances.size());
+
+	BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	BindVertexArray(0);
+	UseProgram(0);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	CheckGLErrors();
+}
+
+// scrolls the sheet by whole pixels, keeping the last row in reach
+void ScrollSheet(GLFWwindow *window, double offset)
+{
+	int windowWidth, windowHeight;
+	glfwGetWindowSize(window, &windowWidth, &windowHeight);
+	int columns = max(sheet.columns, 1);
+	int rows = (sheet.instances.size() + columns - 1) / columns;
+	float bottom = sheetGap + rows * (thumbnailSize + sheetGap) - windowHeight;
+	sheet.scroll = min(max(sheet.scroll - (float)offset * (thumbnailSize + sheetGap) / 2, 0.f), max(bottom, 0.f));
+}
+
+// index of the picture under the cursor, or -1
+int PickThumbnail(GLFWwindow *window)
+{
+	double x, y;
+	glfwGetCursorPos(window, &x, &y);
+	int cell = thumbnailSize + sheetGap;
+	int column = (int)floor((x - sheetGap) / cell);
+	int row = (int)floor((y + sheet.scroll - sheetGap) / cell);
+	if (sheet.columns == 0 || column < 0 || column >= sheet.columns || row < 0)
+		return -1;
+	int i = row * sheet.columns + column;
+	return i < (int)sheet.instances.size() ? i : -1;
+}
+
+// shows a picture with every effect turned off, as the 1 - 8 keys do
+void OpenPicture(const string &name)
+{
+	sheet.active = false;
+	pictureCenterX = 0;
+	pictureCenterY = 0;
+	colourEffect = edgeEffect = blur = 0;
+	orien = 0;
+	mag = 1;
+	cout << name << endl;
+	picName = name;
+	PicGen(picName);
+}
+
+void DestroySheet()
+{
+	StopThumbnails(&sheet.jobs);
+	if (sheet.shader.program == 0)
+		return;
+	DestroyShaders(&sheet.shader);
+	DeleteTextures(1, &sheet.thumbnails);
+	DeleteBuffers(1, &sheet.cornerBuffer);
+	DeleteBuffers(1, &sheet.instanceBuffer);
+	DeleteVertexArrays(1, &sheet.vertexArray);
+	sheet.shader = MyShader();
+}
+
+// --------------------------------------------------------------------------
+// GLFW callback functions
+
+// reports GLFW errors
+void ErrorCallback(int error, const char* description)
+{
+	cout << "GLFW ERROR " << error << ":" << endl;
+	cout << description << endl;
+}
+
+// the pictures behind keys 1 to 8
+const char *const pictureFiles[8] = {
+	"image1-mandrill.png", "image2-uclogo.png", "image3-aerial.jpg", "image4-thirsk.jpg",
+	"image5-pattern.png", "image6-war.jpg", "image7-mario.jpg", "image8-coolGuy.jpeg"
+};
+
+// names the rank filter the keys selected
+void PrintRankFilter()
+{
+	int side = 2 * rankRadius + 1;
+	cout << "Applying " << side << "x" << side << " ";
+	if (rankPercentile == 50)
+		cout << "Median";
+	else if (rankPercentile == 0)
+		cout << "Minimum";
+	else if (rankPercentile == 100)
+		cout << "Maximum";
+	else
+		cout << rankPercentile << "th Percentile";
+	cout << " Filter" << (rankRadius > maxNetworkRankRadius ? " on the CPU" : "") << endl;
+}
+
+// names the bilateral blur with the sigmas the keys selected
+void PrintBilateralBlur()
+{
+	cout << "Applying Bilateral Grid Blur (keeps edges), sigmas of " << bilateralSpatial
+	     << " texels and " << bilateralRange << " brightness" << endl;
+}
+
+// handles keyboard input events
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+        // Tab switches between the contact sheet and the picture; on the
+        // sheet only the picture keys do anything
+        if (!sheet.files.empty() && key == GLFW_KEY_TAB && action == GLFW_PRESS)
         {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            orien = 0;
-            mag = 1;
-            blur = 0;
-            cout << "Image 7" << endl;
-            picName = "image7-mario.jpg";
-            PicGen(picName);
+            sheet.active = !sheet.active;
+            if (!sheet.active && !picName.empty())
+                PicGen(picName);
+            return;
         }
-       //When 8 is pressed display image 8
-        else if(key == GLFW_KEY_8 && action == GLFW_PRESS)
+        if (sheet.active && key != GLFW_KEY_ESCAPE && (key < GLFW_KEY_1 || key > GLFW_KEY_8))
+            return;
+        if (sheet.active && action == GLFW_PRESS)
+            sheet.active = false;
+
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+		glfwSetWindowShouldClose(window, GL_TRUE);
+
+        //When 1 to 8 is pressed display that image
+        else if(key >= GLFW_KEY_1 && key <= GLFW_KEY_8 && action == GLFW_PRESS)
         {
-			blur = 0;
-			GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
-            oldPictureCenterX = pictureCenterX = 0;
-            oldPictureCenterY = pictureCenterY = 0;
-            colourEffect = 0;
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
-            edgeEffect = 0;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
-            orien = 0;
-            mag = 1;
-            blur = 0;
-            cout << "Image 8" << endl;
-            picName = "image8-coolGuy.jpeg";
-            PicGen(picName);
+            cout << "Image " << key - GLFW_KEY_0 << endl;
+            OpenPicture(pictureFiles[key - GLFW_KEY_1]);
         }
         //When r is pressed rotate with scrolling press again to magnify
          else if(key == GLFW_KEY_R && action == GLFW_PRESS)
@@ -605,15 +1741,10 @@ PicGen(picName);
         else if(key == GLFW_KEY_C && action == GLFW_PRESS)
         {
             colourEffect++;
-            if(colourEffect==6)
+            if(colourEffect==8)
             {
                 colourEffect = 0;
             }
-            GLint locC = glGetUniformLocation(shader.program,"colourEffect");
-            if (locC != -1)
-            {
-              glUniform1i(locC, colourEffect);
-            }
             if(colourEffect==0)
             {
                 cout << "Applying Default Colours" << endl;
@@ -638,53 +1769,41 @@ PicGen(picName);
             {
                 cout << "Applying Negative Tone" << endl;
             }
-            if (!InitializeGeometry(&geometry))
-                                cout << "Program failed to intialize geometry!" << endl;
+            else if(colourEffect==6)
+            {
+                cout << "Applying Auto Levels" << endl;
+            }
+            else if(colourEffect==7)
+            {
+                cout << "Applying Histogram Equalization" << endl;
+            }
             PicGen(picName);
         }
         //When h is pressed apply horizontal sobel
         else if(key == GLFW_KEY_H && action == GLFW_PRESS)
         {
             edgeEffect = 1;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
             float edgeMatrix[9]{
                 -1.0, 0.0, 1.0,
                 -2.0, 0.0, 2.0,
                 -1.0, 0.0, 1.0
             };
-            glUseProgram(shader.program);
-            GLint edgeUniform = glGetUniformLocation(shader.program, "edge");
-            glUniformMatrix3fv(edgeUniform, 1, GL_TRUE, edgeMatrix);
+            copy(edgeMatrix, edgeMatrix + 9, edgeKernel);
 
             cout << "Applying Horizontal Sobel Filter" << endl;
-            if (!InitializeGeometry(&geometry))
-                                cout << "Program failed to intialize geometry!" << endl;
             PicGen(picName);
         }
         //When v is pressed apply vertical sobel
         else if(key == GLFW_KEY_V && action == GLFW_PRESS)
         {
             edgeEffect = 1;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
             float edgeMatrix[9]{
                 1.0, 2.0, 1.0,
                 0.0, 0.0, 0.0,
                 -1.0, -2.0, -1.0,
             };
-            glUseProgram(shader.program);
-            GLint edgeUniform = glGetUniformLocation(shader.program, "edge");
-            glUniformMatrix3fv(edgeUniform, 1, GL_TRUE, edgeMatrix);
+            copy(edgeMatrix, edgeMatrix + 9, edgeKernel);
             cout << "Applying Vertical Sobel Filter" << endl;
-            if (!InitializeGeometry(&geometry))
-                                cout << "Program failed to intialize geometry!" << endl;
             PicGen(picName);
         }
         //When U is pressed apply unsharp mask
@@ -692,46 +1811,35 @@ PicGen(picName);
         {
 			cout << colourEffect << endl;
             edgeEffect = 2;
-            GLint locE = glGetUniformLocation(shader.program,"edgeEffect");
-            if (locE != -1)
-            {
-              glUniform1i(locE, edgeEffect);
-            }
             float edgeMatrix[9]{
                 0.0, -1.0, 0.0,
                 -1.0, 5.0, -1.0,
                 0.0, -1.0, 0.0
             };
-            glUseProgram(shader.program);
-            GLint edgeUniform = glGetUniformLocation(shader.program, "edge");
-            glUniformMatrix3fv(edgeUniform, 1, GL_TRUE, edgeMatrix);
+            copy(edgeMatrix, edgeMatrix + 9, edgeKernel);
             cout << "Applying Unsharp Mask" << endl;
-            if (!InitializeGeometry(&geometry))
-                                cout << "Program failed to intialize geometry!" << endl;
+            PicGen(picName);
+        }
+        //When k is pressed find the edges with the Canny detector
+        else if(key == GLFW_KEY_K && action == GLFW_PRESS)
+        {
+            edgeEffect = 3;
+
+            cout << "Applying Canny Edge Detector" << endl;
             PicGen(picName);
         }
         //When g is pressed apply relevent gaussian blur
         else if(key == GLFW_KEY_G && action == GLFW_PRESS)
         {
             blur++;
-            if(blur==4)
+            if(blur==6)
             {
                 blur = 0;
             }
-            GLint loc = glGetUniformLocation(shader.program,"blur");
-            if (loc != -1)
-            {
-              glUniform1i(loc, blur);
-            }
             if(blur==0)
             {
                 cout << "Applying default level of blur" << endl;
             }
-            GLint locB = glGetUniformLocation(shader.program,"blur");
-            if (locB != -1)
-            {
-              glUniform1i(locB, blur);
-            }
             if(blur==1)
             {
 //                float blur1[9]{
@@ -739,7 +1847,7 @@ PicGen(picName);
 //                    0.12, 0.36, 0.12,
 //                    0.04, 0.12, 0.04
 //                };
-//                glUseProgram(shader.program);
+//                UseProgram(shader.program);
 //                GLint edgeUniform = glGetUniformLocation(shader.program, "blur1");
 //                glUniformMatrix3fv(edgeUniform, 1, GL_TRUE, blur1);
                 cout << "Applying 3x3 Gaussian Blur" << endl;
@@ -752,8 +1860,77 @@ PicGen(picName);
             {
                 cout << "Applying 7x7 Gaussian Blur" << endl;
             }
-            if (!InitializeGeometry(&geometry))
-                                cout << "Program failed to intialize geometry!" << endl;
+            else if(blur==4)
+            {
+                PrintBilateralBlur();
+            }
+            else if(blur==5)
+            {
+                PrintRankFilter();
+            }
+            PicGen(picName);
+        }
+        //When [ or ] is pressed shrink or grow the window of the rank filter
+        else if((key == GLFW_KEY_LEFT_BRACKET || key == GLFW_KEY_RIGHT_BRACKET) && action == GLFW_PRESS)
+        {
+            blur = 5;
+            rankRadius += key == GLFW_KEY_RIGHT_BRACKET ? 1 : -1;
+            rankRadius = min(max(rankRadius, 1), maxRankRadius);
+            PrintRankFilter();
+            PicGen(picName);
+        }
+        //When , or . is pressed halve or double the spatial sigma of the bilateral blur
+        else if((key == GLFW_KEY_COMMA || key == GLFW_KEY_PERIOD) && action == GLFW_PRESS)
+        {
+            blur = 4;
+            bilateralSpatial = key == GLFW_KEY_PERIOD ? bilateralSpatial * 2 : bilateralSpatial / 2;
+            bilateralSpatial = min(max(bilateralSpatial, minBilateralSpatial), maxBilateralSpatial);
+            PrintBilateralBlur();
+            PicGen(picName);
+        }
+        //When - or = is pressed halve or double the range sigma of the bilateral blur
+        else if((key == GLFW_KEY_MINUS || key == GLFW_KEY_EQUAL) && action == GLFW_PRESS)
+        {
+            blur = 4;
+            bilateralRange = key == GLFW_KEY_EQUAL ? bilateralRange * 2.f : bilateralRange / 2.f;
+            bilateralRange = min(max(bilateralRange, minBilateralRange), maxBilateralRange);
+            PrintBilateralBlur();
+            PicGen(picName);
+        }
+        //When m is pressed switch the rank filter between median, minimum, quartiles and maximum
+        else if(key == GLFW_KEY_M && action == GLFW_PRESS)
+        {
+            const int percentiles[5] = { 50, 0, 25, 75, 100 };
+            int i = 0;
+            while (i < 4 && percentiles[i] != rankPercentile)
+                i++;
+            blur = 5;
+            rankPercentile = percentiles[(i + 1) % 5];
+            PrintRankFilter();
+            PicGen(picName);
+        }
+        //When s is pressed print how much memory the pictures take
+        else if(key == GLFW_KEY_S && action == GLFW_PRESS)
+        {
+            PrintMemoryStats();
+        }
+        //When e is pressed export the view as it is on screen
+        else if(key == GLFW_KEY_E && action == GLFW_PRESS)
+        {
+            ExportCurrentView(window);
+        }
+        //When p is pressed switch between filtering on the GPU and on the CPU
+        else if(key == GLFW_KEY_P && action == GLFW_PRESS)
+        {
+            cpuPath = !cpuPath;
+            if(cpuPath)
+            {
+                cout << "Filtering on the CPU" << endl;
+            }
+            else
+            {
+                cout << "Filtering on the GPU" << endl;
+            }
             PicGen(picName);
         }
 }
@@ -773,6 +1950,14 @@ static void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
 //Mouse press
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 {
+    if (sheet.active)
+    {
+        int i = button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS ? PickThumbnail(window) : -1;
+        if (i >= 0)
+            OpenPicture(sheet.files[i]);
+        return;
+    }
+    lastInteraction = glfwGetTime();
     if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
     {
         pressed = true;
@@ -786,17 +1971,18 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
         }
         pressed = false;
     }
-    MyGeometry geometry;
-    if (!InitializeGeometry(&geometry))
-                        cout << "Program failed to intialize geometry!" << endl;
     PicGen(picName);
 }
 
 //Mouse scroll
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    glUseProgram(shader.program);
-    MyGeometry geometry;
+    if (sheet.active)
+    {
+        ScrollSheet(window, yoffset);
+        return;
+    }
+    lastInteraction = glfwGetTime();
     if(rotateFlag==1)
     {
         cout << "Rotating Image" << endl;
@@ -808,8 +1994,6 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
         {
             orien = orien - M_PI/32;
         }
-        if (!InitializeGeometry(&geometry))
-                            cout << "Program failed to intialize geometry!" << endl;
     }
 
     else
@@ -827,14 +2011,21 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
                 mag = 0.0001;
             }
         }
-        if (!InitializeGeometry(&geometry))
-                            cout << "Program failed to intialize geometry!" << endl;
     }
     PicGen(picName);
 }
 
 
 
+// prints the memory stats if --memory-stats asked for them, and passes the
+// exit code of a mode on
+int ReportMemory(int result)
+{
+	if (MemoryStatsRequested())
+		PrintMemoryStats();
+	return result;
+}
+
 // ==========================================================================
 // PROGRAM ENTRY POINT
 
@@ -842,6 +2033,118 @@ int main(int argc, char *argv[])
 {
         cout << "Welcome to Kool Kyle's \"Image Editing Studio\"!" << endl;
         cout << "Please refer to the readMe.txt file to see how the program works" << endl;
+
+        MySequenceOptions sequence;
+        bool sequenceMode = false;
+        bool useGpu = false;
+        const char *serveSocket = nullptr;
+        const char *submitSocket = nullptr;
+        const char *submitInput = nullptr, *submitOutput = nullptr;
+        bool submitByPath = false;
+        int submitRepeat = 1;
+        MyRegressOptions regress;
+        bool regressMode = false;
+        const char *sheetDirectory = nullptr;
+        bool exportMode = false;
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--budget" && i + 1 < argc)
+                frameBudget = atof(argv[++i]);
+            else if (arg == "--precision" && i + 1 < argc)
+                return PrecisionReport(argv[++i]);
+            else if (arg == "--fixed-check")
+                return FixedPointReport();
+            else if (arg == "--rank-check")
+                return RankFilterReport();
+            else if (arg == "--sequence" && i + 2 < argc)
+            {
+                sequenceMode = true;
+                sequence.input = argv[++i];
+                sequence.output = argv[++i];
+            }
+            else if (arg == "--first" && i + 1 < argc)
+                sequence.first = atoi(argv[++i]);
+            else if (arg == "--count" && i + 1 < argc)
+                sequence.count = atoi(argv[++i]);
+            else if (arg == "--gpu")
+                useGpu = true;
+            else if (arg == "--serve" && i + 1 < argc)
+                serveSocket = argv[++i];
+            else if (arg == "--submit" && i + 3 < argc)
+            {
+                submitSocket = argv[++i];
+                submitInput = argv[++i];
+                submitOutput = argv[++i];
+            }
+            else if (arg == "--by-path")
+                submitByPath = true;
+            else if (arg == "--repeat" && i + 1 < argc)
+                submitRepeat = atoi(argv[++i]);
+            else if (arg == "--pixel-cache" && i + 1 < argc)
+                SetPixelCacheDirectory(argv[++i]);
+            else if (arg == "--pixel-cache-limit" && i + 1 < argc)
+                SetPixelCacheLimit(atoll(argv[++i]) * 1024 * 1024);
+            else if (arg == "--regress" && i + 1 < argc)
+            {
+                regressMode = true;
+                regress.goldens = argv[++i];
+            }
+            else if (arg == "--update-goldens")
+                regress.update = true;
+            else if (arg == "--tolerance" && i + 1 < argc)
+                regress.tolerance = atoi(argv[++i]);
+            else if (arg == "--budget-scale" && i + 1 < argc)
+                regress.budgetScale = atof(argv[++i]);
+            else if (arg == "--sheet" && i + 1 < argc)
+                sheetDirectory = argv[++i];
+            else if (arg == "--export" && i + 2 < argc)
+            {
+                exportMode = true;
+                exportOptions.input = argv[++i];
+                exportOptions.output = argv[++i];
+            }
+            else if (arg == "--export-size" && i + 2 < argc)
+            {
+                exportOptions.width = atoi(argv[++i]);
+                exportOptions.height = atoi(argv[++i]);
+            }
+            else if (arg == "--zoom" && i + 1 < argc)
+                exportOptions.view.mag = atof(argv[++i]);
+            else if (arg == "--rotate" && i + 1 < argc)
+                exportOptions.view.orien = atof(argv[++i]) * M_PI / 180.0;
+            else if (arg == "--bicubic")
+                exportOptions.bicubic = true;
+            else if (arg == "--gl-calls")
+                reportGLCalls = true;
+            else if (!ParseEffectOption(argc, argv, &i, &sequence.effects) && !ParseMemoryOption(argc, argv, &i))
+                cout << "Ignoring unknown option " << arg << endl;
+        }
+
+        // clients, and sequences and servers filtering on the CPU, never need a window
+        if (submitSocket)
+            return SubmitJob(submitSocket, submitInput, submitOutput, sequence.effects, submitByPath, submitRepeat);
+        if (sequenceMode && !useGpu)
+            return ReportMemory(RunSequence(sequence, CpuFilterFrame));
+        if (serveSocket && !useGpu)
+            return ReportMemory(RunServer(serveSocket, CpuFilterFrame));
+        if (regressMode && !useGpu)
+        {
+            // 8-bit pictures take the fixed-point kernels on the cpu path, so
+            // the float filters the viewer uses are run on their own as well,
+            // with twice the time as they fit half as many texels in a register
+            MyRegressOptions floats = regress;
+            floats.budgetScale *= 2.0;
+            int cpuResult = RunRegression(regress, CpuFilterFrame, "cpu");
+            int floatResult = RunRegression(floats, FloatFilterFrame, "float", true);
+            return ReportMemory(cpuResult != 0 ? cpuResult : floatResult);
+        }
+        if (exportMode)
+        {
+            exportOptions.effects = sequence.effects;
+            return ReportMemory(RunExport(exportOptions));
+        }
+
 	// initialize the GLFW windowing system
 	if (!glfwInit()) {
 		cout << "ERROR: GLFW failed to initialize, TERMINATING" << endl;
@@ -855,6 +2158,9 @@ int main(int argc, char *argv[])
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	bool headless = sequenceMode || serveSocket || regressMode;
+	if (headless)
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
         window = glfwCreateWindow(512, 512, "Kool Kyle's Assignment 2", 0, 0);
 	if (!window) {
 		cout << "Program failed to create GLFW window, TERMINATING" << endl;
@@ -879,6 +2185,29 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	// filter a sequence, serve jobs or check the goldens off-screen with the
+	// hidden window's context
+	if (headless)
+	{
+		int result = sequenceMode ? RunSequence(sequence, GpuFilterFrame) :
+		             serveSocket ? RunServer(serveSocket, GpuFilterFrame) :
+		             RunRegression(regress, GpuFilterFrame, "gpu");
+		ReportMemory(result);
+		DestroySequenceTargets();
+		DestroyBilateralGrid3D();
+		DestroyCannyEdgesGL();
+		DestroyLevelsGL();
+		DestroyEffectBuffer();
+		DestroyShaders(&shader);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return result;
+	}
+
+	// the viewer gives back what the current picture and effects do not need
+	// when a memory cap is hit
+	RegisterEvictors();
+
         MyTexture texture;  //Moved, was after InitializeGeormety originally*********************
         //if(!InitializeTexture(&texture, "image7-mario.jpg", GL_TEXTURE_RECTANGLE))
             //cout << "Program failed to initialize geometry!" << endl;
@@ -888,11 +2217,21 @@ int main(int argc, char *argv[])
         //if (!InitializeGeometry(&geometry))
           //      cout << "Program failed to intialize geometry!" << endl;
 
-	// run an event-triggered main loop
+        if (sheetDirectory)
+            OpenSheet(sheetDirectory);
+
+	// run an event-triggered main loop; the contact sheet is redrawn every
+	// frame while thumbnails stream in
 
 	while (!glfwWindowShouldClose(window))
 	{
-		
+		if (sheet.active)
+			RenderSheet(window);
+
+		// bring a preview up to full quality once the input has settled
+		if (previewStep > 1 && !Interacting())
+			RefineFrame();
+
 		// call function to draw our scene
        // RenderScene(&geometry, &texture, &shader); //render scene with texture
 
@@ -902,8 +2241,15 @@ int main(int argc, char *argv[])
 	}
 
 	// clean up allocated resources before exit
+        ReportMemory(0);
         DestroyTexture(&texture);
         DestroyGeometry(&geometry);
+        DestroyPictures();
+        DestroySheet();
+        DestroyBilateralGrid3D();
+        DestroyCannyEdgesGL();
+        DestroyLevelsGL();
+        DestroyEffectBuffer();
         DestroyShaders(&shader);
 	glfwDestroyWindow(window);
 	glfwTerminate();
@@ -930,10 +2276,11 @@ void QueryGLVersion()
 		<< "on renderer [ " << renderer << " ]" << endl;
 }
 
+// counted, since the render path checks after every frame
 bool CheckGLErrors()
 {
 	bool error = false;
-	for (GLenum flag = glGetError(); flag != GL_NO_ERROR; flag = glGetError())
+	for (GLenum flag = CountedGL(glGetError); flag != GL_NO_ERROR; flag = CountedGL(glGetError))
 	{
 		cout << "OpenGL ERROR:  ";
 		switch (flag) {
@@ -1006,8 +2353,9 @@ GLuint CompileShader(GLenum shaderType, const string &source)
 	return shaderObject;
 }
 
-// creates and returns a program object linked from vertex and fragment shaders
-GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
+// creates and returns a program object linked from vertex, fragment and,
+// if given, geometry shaders
+GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader, GLuint geometryShader)
 {
 	// allocate program object name
 	GLuint programObject = glCreateProgram();
@@ -1015,6 +2363,7 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 	// attach provided shader objects to this program
 	if (vertexShader)   glAttachShader(programObject, vertexShader);
 	if (fragmentShader) glAttachShader(programObject, fragmentShader);
+	if (geometryShader) glAttachShader(programObject, geometryShader);
 
 	// try linking the program with given attachments
 	glLinkProgram(programObject);
@@ -1035,18 +2384,502 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 	return programObject;
 }
 
+MyTexture pictureTexture;   // the picture on the GPU path, uploaded once
+string pictureTextureName;
+MyGeometry pictureGeometry;
+
 void PicGen(std::string name)
 {
-            MyTexture texture;
-            if(!InitializeTexture(&texture, name.c_str(), GL_TEXTURE_RECTANGLE))
-                cout << "Program failed to initialize geometry!" << endl;
+            if(FilteringOnCpu())
+            {
+                CpuPicGen(name);
+                return;
+            }
+
+            // the picture stays on the GPU until another one is shown
+            MyTexture &texture = pictureTexture;
+            if(pictureTextureName != name || texture.textureID == 0)
+            {
+                if(texture.textureID != 0)
+                    DestroyTexture(&texture);
+                texture = MyTexture();
+                if(!InitializeTexture(&texture, name.c_str(), GL_TEXTURE_RECTANGLE))
+                    cout << "Program failed to initialize geometry!" << endl;
+                pictureTextureName = name;
+            }
 
-            // call function to create and fill buffers with geometry data
-            MyGeometry geometry;
-            if (!InitializeGeometry(&geometry))
+            // the bilateral grid and the Canny edges only change with the
+            // picture, and the grid with its sigmas
+            if(blur==4 && (bilateralGrid.source != name || bilateralGrid.spatial != bilateralSpatial ||
+                           bilateralGrid.range != bilateralRange))
+            {
+                if (!BuildBilateralGrid3D(&texture, name, CurrentEffects()))
+                    cout << "Program failed to build the bilateral grid!" << endl;
+            }
+            if(edgeEffect==3 && blur==0 && cannyEdges.source != name)
+            {
+                if (!BuildCannyEdgesGL(&texture, name))
+                    cout << "Program failed to find the Canny edges!" << endl;
+            }
+            if(UsesLevels(CurrentEffects()) && levelsCurves.source != name)
+            {
+                if (!BuildLevelsGL(&texture, nullptr, name))
+                    cout << "Program failed to build the levels curves!" << endl;
+            }
+
+            // the geometry is made once and only uploaded again when the
+            // view changes
+            if (!InitializeGeometry(&pictureGeometry))
                     cout << "Program failed to intialize geometry!" << endl;
 //            MyShader shader;
 //            if (!InitializeShaders(&shader))
 //                cout << "Program could not initialize shaders, TERMINATING" << endl;
-            RenderScene(&geometry, &texture, &shader);
+            UploadEffects(CurrentEffects(), false);
+            RenderFrame(&pictureGeometry, &texture);
+}
+
+// --------------------------------------------------------------------------
+// GPU filter stage for image sequences
+
+struct MySequenceTargets
+{
+	// frame N+1 is uploaded into one texture while frame N is drawn from the
+	// other, and frame N is read back from one pack buffer while frame N+1
+	// is drawn, so neither upload nor read back waits for the GPU
+	MyTexture textures[2];
+	GLuint packBuffers[2];
+	MyFramebuffer target;
+	MyGeometry quad;
+
+	MyFrame pending;        // drawn and being read back, without pixels
+	int pendingSlot;        // -1 when there is no such frame
+	int count;
+
+	MySequenceTargets() : pendingSlot(-1), count(0)
+	{
+		packBuffers[0] = packBuffers[1] = 0;
+	}
+};
+
+MySequenceTargets sequenceTargets;
+
+// uploads a decoded frame into a texture of its own
+void UploadFrame(MyTexture *texture, const MyImage &image)
+{
+	if (texture->textureID == 0)
+	{
+		texture->target = GL_TEXTURE_RECTANGLE;
+		glGenTextures(1, &texture->textureID);
+	}
+	texture->width = image.width;
+	texture->height = image.height;
+
+	// grey images are spread over RGB by the swizzle, like the CPU path does
+	const GLenum formats[4] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+	const GLint grey[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	const GLint greyAlpha[4] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
+	const GLint colour[4] = { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA };
+	const GLint *swizzle = image.numComponents == 1 ? grey : image.numComponents == 2 ? greyAlpha : colour;
+	bool sixteenBit = image.bytesPerComponent == 2;
+
+	GLenum internalFormat = sixteenBit ? GL_RGBA16 : GL_RGBA8;
+	ReserveTexture(texture->textureID, internalFormat, image.width, image.height);
+	BindTexture(texture->target, texture->textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(texture->target, 0, internalFormat, image.width, image.height, 0,
+	             formats[image.numComponents - 1], sixteenBit ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE,
+	             &image.pixels[0]);
+	CountTexture(texture->textureID, sourceMemory, internalFormat, image.width, image.height);
+	glTexParameteriv(texture->target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+
+	// fragments sit on whole texels, so nearest sampling reads them exactly
+	glTexParameteri(texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(texture->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(texture->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	BindTexture(texture->target, 0);
+}
+
+bool GpuFilterFrame(MyFrame *frame, MyFrame *done)
+{
+	MySequenceTargets &gpu = sequenceTargets;
+	int slot = gpu.count % 2;
+
+	if (frame != nullptr)
+	{
+		// rank filters too wide for the sorting network are done on the CPU
+		MyFrame ranked;
+		bool cpuFiltered = RanksOnCpu(frame->effects) && CpuFilterFrame(frame, &ranked);
+		const MyImage &image = cpuFiltered ? ranked.image : frame->image;
+		UploadEffects(frame->effects, cpuFiltered);
+		if (gpu.target.width != image.width || gpu.target.height != image.height)
+		{
+			DestroyFramebuffer(&gpu.target);
+			DestroyGeometry(&gpu.quad);
+			gpu.quad = MyGeometry();
+			if (!InitializeFramebuffer(&gpu.target, image.width, image.height, GL_RGBA8) ||
+			    !InitializeQuad(&gpu.quad, image.width, image.height))
+				cout << "Program failed to initialize the sequence targets!" << endl;
+		}
+		if (gpu.packBuffers[0] == 0)
+			glGenBuffers(2, gpu.packBuffers);
+
+		UploadFrame(&gpu.textures[slot], image);
+		if (frame->effects.blur == 4 && !BuildBilateralGrid3D(&gpu.textures[slot], "", frame->effects))
+			cout << "Program failed to build the bilateral grid!" << endl;
+		if (frame->effects.edgeEffect == 3 && frame->effects.blur == 0 &&
+		    !BuildCannyEdgesGL(&gpu.textures[slot], ""))
+			cout << "Program failed to find the Canny edges!" << endl;
+		if (UsesLevels(frame->effects) && !BuildLevelsGL(&gpu.textures[slot], &image, ""))
+			cout << "Program failed to build the levels curves!" << endl;
+
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		BindFramebuffer(GL_FRAMEBUFFER, gpu.target.framebuffer);
+		glViewport(0, 0, image.width, image.height);
+		RenderScene(&gpu.quad, &gpu.textures[slot], &shader);
+
+		// start the read back, it completes while the next frame is drawn
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.packBuffers[slot]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)image.width * image.height * 4, nullptr, GL_STREAM_READ);
+		CountBuffer(gpu.packBuffers[slot], intermediateMemory, (long long)image.width * image.height * 4);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, image.width, image.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		BindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	}
+
+	// hand out the frame drawn on the previous call
+	bool finished = false;
+	if (gpu.pendingSlot >= 0)
+	{
+		MyImage &result = done->image;
+		result = gpu.pending.image;
+		int texels = result.width * result.height;
+		result.pixels.resize((size_t)texels * result.numComponents);
+		done->index = gpu.pending.index;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, gpu.packBuffers[gpu.pendingSlot]);
+		const unsigned char *rgba = (const unsigned char *)glMapBufferRange(
+			GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)texels * 4, GL_MAP_READ_BIT);
+		if (rgba != nullptr)
+		{
+			for (int i = 0; i < texels; i++)
+				for (int c = 0; c < result.numComponents; c++)
+					result.pixels[i * result.numComponents + c] = rgba[i * 4 + c];
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		gpu.pendingSlot = -1;
+		finished = rgba != nullptr && !CheckGLErrors();
+	}
+
+	if (frame != nullptr)
+	{
+		MyImage &pending = gpu.pending.image;
+		pending.width = frame->image.width;
+		pending.height = frame->image.height;
+		pending.numComponents = frame->image.numComponents % 2 == 0 ? 4 : 3;
+		pending.bytesPerComponent = 1;
+		gpu.pending.index = frame->index;
+		gpu.pendingSlot = slot;
+		gpu.count++;
+	}
+	return finished;
+}
+
+// deallocate the textures, buffers and framebuffer of the sequence stage
+void DestroySequenceTargets()
+{
+	MySequenceTargets &gpu = sequenceTargets;
+	for (int i = 0; i < 2; i++)
+		if (gpu.textures[i].textureID != 0)
+			DestroyTexture(&gpu.textures[i]);
+	DeleteBuffers(2, gpu.packBuffers);
+	DestroyFramebuffer(&gpu.target);
+	DestroyGeometry(&gpu.quad);
+	gpu = MySequenceTargets();
+}
+
+// --------------------------------------------------------------------------
+// CPU filter path
+
+MyPlanarImage source;   // decoded pixels of the current picture
+string sourceName;
+MyMemoryCount sourceBytes(hostMemory, sourceMemory);
+MyTexture filtered;     // filtered picture, uploaded tile by tile
+MyGeometry cpuGeometry;
+MyTileCache tileCache;
+int cpuPreviewStep = 4; // subsampling of tiles filtered during interaction
+
+// gathers the effect uniforms into the parameters of the CPU filters
+EffectState CurrentEffects()
+{
+	EffectState state;
+	state.colourEffect = colourEffect;
+	state.edgeEffect = edgeEffect;
+	state.blur = blur;
+	copy(edgeKernel, edgeKernel + 9, state.edge);
+	state.rankRadius = rankRadius;
+	state.rankPercentile = rankPercentile;
+	state.bilateralSpatial = bilateralSpatial;
+	state.bilateralRange = bilateralRange;
+	return state;
+}
+
+// the CPU path was picked, or the rank filter is too wide for the GPU
+bool FilteringOnCpu()
+{
+	return cpuPath || RanksOnCpu(CurrentEffects());
+}
+
+// texels of the current picture that end up inside the window, found by
+// running the window corners back through the transform InitializeGeometry()
+// applied, grown by halo texels on each side and clamped to the picture
+PixelRect VisibleRect(int halo)
+{
+	float heightRatio = 1;
+	float widthRatio = 1;
+	if(picWidth>picHeight)
+		widthRatio = picWidth/picHeight;
+	else if(picHeight>picWidth)
+		heightRatio = picHeight/picWidth;
+
+	const float corners[4][2] = { {-1.f,-1.f}, {1.f,-1.f}, {1.f,1.f}, {-1.f,1.f} };
+	float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+	for (int i = 0; i < 4; i++)
+	{
+		// undo the translation, magnification and rotation
+		float dx = (corners[i][0] - pictureCenterX) / mag;
+		float dy = (corners[i][1] - pictureCenterY) / mag;
+		float lx = dx*cos(orien) + dy*sin(orien);
+		float ly = -dx*sin(orien) + dy*cos(orien);
+
+		// and map the quad back onto texel coordinates
+		float tx = (lx*heightRatio + 1.f) * 0.5f * picWidth;
+		float ty = (ly*widthRatio + 1.f) * 0.5f * picHeight;
+		minX = min(minX, tx);
+		minY = min(minY, ty);
+		maxX = max(maxX, tx);
+		maxY = max(maxY, ty);
+	}
+
+	PixelRect rect((int)floor(minX) - halo, (int)floor(minY) - halo,
+	               (int)ceil(maxX) + halo, (int)ceil(maxY) + halo);
+	rect.x0 = max(rect.x0, 0);
+	rect.y0 = max(rect.y0, 0);
+	rect.x1 = min(rect.x1, (int)picWidth);
+	rect.y1 = min(rect.y1, (int)picHeight);
+	return rect;
+}
+
+// filters only the visible part of the picture on the CPU, reusing the tiles
+// that are still cached from earlier frames, and draws the result
+void CpuPicGen(std::string name)
+{
+	if (name.empty())
+		return;
+
+	if (sourceName != name)
+	{
+		MyImage image;
+		if (!LoadCachedImage(&image, name.c_str()))
+		{
+			cout << "Unable to load image: " << name << endl;
+			return;
+		}
+		ReserveMemory(hostMemory, (long long)image.width * image.height * 4 * sizeof(float));
+		Deinterleave(image, &source);
+		sourceBytes.Set(source.storage.size() * sizeof(float));
+		sourceName = name;
+		picWidth = source.width;
+		picHeight = source.height;
+		ClearTiles(&tileCache);
+	}
+
+	// allocate storage for the whole picture, tiles are filled in as they
+	// become visible; half floats keep the signed results of the filters.
+	// The storage is made again after an eviction, and the tiles with it
+	if (filtered.textureID == 0 || filtered.width != source.width || filtered.height != source.height)
+	{
+		if (filtered.textureID == 0)
+		{
+			filtered.target = GL_TEXTURE_RECTANGLE;
+			glGenTextures(1, &filtered.textureID);
+		}
+		filtered.width = source.width;
+		filtered.height = source.height;
+		ReserveTexture(filtered.textureID, GL_RGBA16F, filtered.width, filtered.height);
+		BindTexture(filtered.target, filtered.textureID);
+		glTexImage2D(filtered.target, 0, GL_RGBA16F, filtered.width, filtered.height, 0, GL_RGBA, GL_HALF_FLOAT, nullptr);
+		CountTexture(filtered.textureID, tileMemory, GL_RGBA16F, filtered.width, filtered.height);
+		glTexParameteri(filtered.target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(filtered.target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(filtered.target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(filtered.target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		BindTexture(filtered.target, 0);
+		ClearTiles(&tileCache);
+	}
+
+	// the geometry is made once and only uploaded again when the view
+	// changes
+	if (!InitializeGeometry(&cpuGeometry))
+		cout << "Program failed to intialize geometry!" << endl;
+
+	UploadVisibleTiles();
+
+	UploadEffects(CurrentEffects(), true);
+	RenderFrame(&cpuGeometry, &filtered);
+}
+
+// filters the tiles of the picture that the current transform makes visible
+// and uploads them; during interaction only as many as fit in the frame
+// budget are filtered at full quality, the others get a preview
+void UploadVisibleTiles()
+{
+	bool interacting = Interacting();
+	EffectState state = CurrentEffects();
+	vector<const MyTile *> fresh;
+	UpdateTiles(&tileCache, sourceName, source, state, VisibleRect(EffectHalo(state)), &fresh,
+	            interacting ? cpuPreviewStep : 1, frameBudget / 1000.0);
+	previewStep = interacting ? cpuPreviewStep : 1;
+
+	BindTexture(filtered.target, filtered.textureID);
+	for (size_t i = 0; i < fresh.size(); i++)
+	{
+		const PixelRect &rect = fresh[i]->rect;
+		CountedGL(glTexSubImage2D, filtered.target, 0, rect.x0, rect.y0, rect.Width(), rect.Height(),
+		          GL_RGBA, GL_HALF_FLOAT, &fresh[i]->pixels[0]);
+	}
+	BindTexture(filtered.target, 0);
+	if (!fresh.empty())
+		cout << "Filtered " << fresh.size() << " new tiles, " << tileCache.tiles.size() << " cached" << endl;
+}
+
+// redraws what is on screen at full quality once the input has settled
+void RefineFrame()
+{
+	if (FilteringOnCpu())
+		UploadVisibleTiles();
+	RenderFrame(&shownGeometry, &shownTexture);
+}
+
+// --------------------------------------------------------------------------
+// Eviction under the memory caps
+//
+// Only what the current effects and path do not use is given back, and only
+// until the bytes asked for are released; all of it is made again when it is
+// needed
+
+// the decoded picture of the CPU path while the GPU path is in use; it is a
+// single allocation, so it goes whole
+long long EvictIdleSource(long long bytes)
+{
+	if (bytes <= 0 || FilteringOnCpu() || source.storage.empty())
+		return 0;
+	long long used = MemoryUsed(hostMemory);
+	source = MyPlanarImage();
+	sourceName = "";
+	sourceBytes.Set(0);
+	ClearTiles(&tileCache);
+	return used - MemoryUsed(hostMemory);
+}
+
+// the texture the CPU path uploads its tiles into, while the GPU path is in
+// use; like the source it goes whole
+long long EvictIdleTiles(long long bytes)
+{
+	if (bytes <= 0 || FilteringOnCpu() || filtered.textureID == 0)
+		return 0;
+	long long used = MemoryUsed(deviceMemory);
+	DestroyTexture(&filtered);
+	filtered = MyTexture();
+	return used - MemoryUsed(deviceMemory);
+}
+
+// the Canny edges, the preview framebuffer, the bilateral grid and the levels
+// curves, largest first, when the current effects do not read them and, for
+// the preview, when the input has settled
+long long EvictIdleIntermediates(long long bytes)
+{
+	long long used = MemoryUsed(deviceMemory);
+	EffectState state = CurrentEffects();
+	if (used - MemoryUsed(deviceMemory) < bytes && !(state.edgeEffect == 3 && state.blur == 0))
+		DestroyCannyEdgesGL();
+	if (used - MemoryUsed(deviceMemory) < bytes && preview.framebuffer != 0 && !Interacting())
+		DestroyFramebuffer(&preview);
+	if (used - MemoryUsed(deviceMemory) < bytes && state.blur != 4)
+		DestroyBilateralGrid3D();
+	if (used - MemoryUsed(deviceMemory) < bytes && !UsesLevels(state))
+		DestroyLevelsGL();
+	return used - MemoryUsed(deviceMemory);
+}
+
+void RegisterEvictors()
+{
+	// the tiles on screen are only kept while the CPU path shows them
+	RegisterEvictor(hostMemory, tileMemory, [](long long bytes) {
+		return EvictTiles(&tileCache, bytes, FilteringOnCpu());
+	});
+	RegisterEvictor(hostMemory, intermediateMemory, [](long long bytes) {
+		return EvictBuiltEffects(&tileCache, bytes);
+	});
+	RegisterEvictor(hostMemory, sourceMemory, EvictIdleSource);
+	RegisterEvictor(deviceMemory, tileMemory, EvictIdleTiles);
+	RegisterEvictor(deviceMemory, intermediateMemory, EvictIdleIntermediates);
+}
+
+// deallocate the picture's textures and geometry on both paths
+void DestroyPictures()
+{
+	DestroyTexture(&pictureTexture);
+	DestroyGeometry(&pictureGeometry);
+	DestroyTexture(&filtered);
+	DestroyGeometry(&cpuGeometry);
+	DestroyFramebuffer(&preview);
+}
+
+// --------------------------------------------------------------------------
+// Export of the view
+
+int exportCount = 0;
+
+// resamples the picture with its effects as the window shows it into
+// export<n>.png, by default at four times the size of the window
+void ExportCurrentView(GLFWwindow *window)
+{
+	if (picName.empty())
+		return;
+
+	// the CPU path already holds the decoded picture
+	MyPlanarImage decoded;
+	const MyPlanarImage *picture = &source;
+	if (sourceName != picName)
+	{
+		MyImage image;
+		if (!LoadCachedImage(&image, picName.c_str()))
+		{
+			cout << "Unable to load image: " << picName << endl;
+			return;
+		}
+		Deinterleave(image, &decoded);
+		picture = &decoded;
+	}
+
+	MyExportOptions options = exportOptions;
+	if (options.width <= 0 || options.height <= 0)
+	{
+		glfwGetFramebufferSize(window, &options.width, &options.height);
+		options.width *= 4;
+		options.height *= 4;
+	}
+	options.view.centerX = pictureCenterX;
+	options.view.centerY = pictureCenterY;
+	options.view.mag = mag;
+	options.view.orien = orien;
+	options.effects = CurrentEffects();
+	options.output = "export" + to_string(++exportCount) + ".png";
+	ExportView(*picture, options);
 }
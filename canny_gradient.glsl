@@ -0,0 +1,59 @@
+// ==========================================================================
+// Gradient pass of the Canny detector (edge effect 3)
+//
+// Smooths the second grey with the 0.2 0.6 0.2 kernel of blur level 1 and
+// applies both Sobel kernels in one pass, writing the gradient magnitude and
+// its direction rounded to a sector, the same as BuildCannyEdges() on the CPU.
+// ==========================================================================
+#version 410
+
+// first output is mapped to the framebuffer's colour index by default
+out vec4 FragmentColour;
+
+uniform sampler2DRect tex;
+uniform ivec2 size;       //of the picture
+
+float Grey(ivec2 p)
+{
+    return dot(texelFetch(tex, clamp(p, ivec2(0), size - 1)).rgb, vec3(0.299, 0.587, 0.114));
+}
+
+//smoothed grey, texels past the picture repeat its edge
+float Smoothed(ivec2 p)
+{
+    p = clamp(p, ivec2(0), size - 1);
+    vec3 w = vec3(0.2, 0.6, 0.2);
+    float sum = 0.0;
+    for(int j=-1;j<=1;j++)
+    {
+      float row = 0.0;
+      for(int i=-1;i<=1;i++)
+      {
+        row += w[i+1]*Grey(p + ivec2(i, j));
+      }
+      sum += w[j+1]*row;
+    }
+    return sum;
+}
+
+void main(void)
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float s[9];
+    for(int j=-1;j<=1;j++)
+    {
+      for(int i=-1;i<=1;i++)
+      {
+        s[(j+1)*3+i+1] = Smoothed(p + ivec2(i, j));
+      }
+    }
+    float gx = (s[2] + 2.0*s[5] + s[8]) - (s[0] + 2.0*s[3] + s[6]);
+    float gy = (s[6] + 2.0*s[7] + s[8]) - (s[0] + 2.0*s[1] + s[2]);
+
+    //0 along x, 1 along x = y, 2 along y, 3 along x = -y
+    float tan22 = 0.41421356;
+    float ax = abs(gx);
+    float ay = abs(gy);
+    float sector = ay <= ax*tan22 ? 0.0 : ax <= ay*tan22 ? 2.0 : gx*gy > 0.0 ? 1.0 : 3.0;
+    FragmentColour = vec4(length(vec2(gx, gy))*0.25, sector, 0.0, 0.0);
+}
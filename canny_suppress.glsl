@@ -0,0 +1,38 @@
+// ==========================================================================
+// Non-maximum suppression and double threshold of the Canny detector
+//
+// Keeps the texels whose gradient magnitude is the largest along their
+// gradient and writes their class as a byte: 2 for strong, 1 for weak and 0
+// for other texels.
+// ==========================================================================
+#version 410
+
+// first output is mapped to the framebuffer's colour index by default
+out vec4 FragmentColour;
+
+uniform sampler2DRect gradient;
+uniform ivec2 size;
+uniform float low;
+uniform float high;
+
+//texels past the picture have no gradient
+float Magnitude(ivec2 p)
+{
+    if(any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))
+    {
+      return 0.0;
+    }
+    return texelFetch(gradient, p).r;
+}
+
+void main(void)
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec2 g = texelFetch(gradient, p).rg;
+    ivec2 offsets[4] = ivec2[4](ivec2(1, 0), ivec2(1, 1), ivec2(0, 1), ivec2(1, -1));
+    ivec2 d = offsets[int(g.y + 0.5)];
+    bool peak = g.x > Magnitude(p + d) && g.x >= Magnitude(p - d);
+
+    float state = !peak || g.x < low ? 0.0 : g.x < high ? 1.0 : 2.0;
+    FragmentColour = vec4(state / 255.0, 0.0, 0.0, 1.0);
+}
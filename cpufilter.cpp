@@ -0,0 +1,1564 @@
+// ==========================================================================
+// CPU implementation of the fragment.glsl effect stack
+// ==========================================================================
+
+#include "cpufilter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <iostream>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_F16C_DISPATCH
+#endif
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Half-float storage
+
+// round to nearest even, overflowing to infinity like the hardware does
+static unsigned short FloatToHalfScalar(float value)
+{
+	unsigned int f;
+	memcpy(&f, &value, 4);
+	unsigned int sign = (f >> 16) & 0x8000;
+	unsigned int exponent = (f >> 23) & 0xff;
+	unsigned int mantissa = f & 0x7fffff;
+
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	int e = (int)exponent - 127 + 15;
+	if (e >= 0x1f)
+		return sign | 0x7c00;
+
+	if (e <= 0)
+	{
+		// subnormal half, or too small for one
+		if (e < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - e;
+		unsigned int half = mantissa >> shift;
+		unsigned int rest = mantissa & ((1u << shift) - 1);
+		unsigned int halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return sign | half;
+	}
+
+	// a carry out of the mantissa correctly bumps the exponent
+	unsigned int half = (e << 10) | (mantissa >> 13);
+	unsigned int rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return sign | half;
+}
+
+static float HalfToFloatScalar(unsigned short value)
+{
+	unsigned int sign = (value & 0x8000) << 16;
+	unsigned int exponent = (value >> 10) & 0x1f;
+	unsigned int mantissa = value & 0x3ff;
+	unsigned int f;
+
+	if (exponent == 0x1f)
+		f = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent != 0)
+		f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	else if (mantissa == 0)
+		f = sign;
+	else
+	{
+		// renormalize a subnormal half
+		exponent = 127 - 15 + 1;
+		while (!(mantissa & 0x400))
+		{
+			mantissa <<= 1;
+			exponent--;
+		}
+		f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float result;
+	memcpy(&result, &f, 4);
+	return result;
+}
+
+#ifdef HAVE_F16C_DISPATCH
+__attribute__((target("avx,f16c")))
+static void FloatToHalfF16C(const float *in, unsigned short *out, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128((__m128i *)(out + i), half);
+	}
+	for (; i < count; i++)
+		out[i] = FloatToHalfScalar(in[i]);
+}
+
+__attribute__((target("avx,f16c")))
+static void HalfToFloatF16C(const unsigned short *in, float *out, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i half = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm256_storeu_ps(out + i, _mm256_cvtph_ps(half));
+	}
+	for (; i < count; i++)
+		out[i] = HalfToFloatScalar(in[i]);
+}
+
+static bool HasF16C()
+{
+	static const bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+	return supported;
+}
+#endif
+
+void FloatToHalf(const float *in, unsigned short *out, int count)
+{
+#ifdef HAVE_F16C_DISPATCH
+	if (HasF16C())
+	{
+		FloatToHalfF16C(in, out, count);
+		return;
+	}
+#endif
+	for (int i = 0; i < count; i++)
+		out[i] = FloatToHalfScalar(in[i]);
+}
+
+void HalfToFloat(const unsigned short *in, float *out, int count)
+{
+#ifdef HAVE_F16C_DISPATCH
+	if (HasF16C())
+	{
+		HalfToFloatF16C(in, out, count);
+		return;
+	}
+#endif
+	for (int i = 0; i < count; i++)
+		out[i] = HalfToFloatScalar(in[i]);
+}
+
+// --------------------------------------------------------------------------
+// Effect parameters
+
+const float horizontalSobel[9] = {
+	-1.0, 0.0, 1.0,
+	-2.0, 0.0, 2.0,
+	-1.0, 0.0, 1.0
+};
+const float verticalSobel[9] = {
+	1.0, 2.0, 1.0,
+	0.0, 0.0, 0.0,
+	-1.0, -2.0, -1.0
+};
+const float unsharpMask[9] = {
+	0.0, -1.0, 0.0,
+	-1.0, 5.0, -1.0,
+	0.0, -1.0, 0.0
+};
+
+bool ParseEffectOption(int argc, char *argv[], int *i, EffectState *state)
+{
+	string option = argv[*i];
+	if (*i + 1 >= argc)
+		return false;
+	string value = argv[*i + 1];
+
+	if (option == "--colour")
+		state->colourEffect = atoi(value.c_str());
+	else if (option == "--blur")
+		state->blur = atoi(value.c_str());
+	else if (option == "--rank")
+		state->rankPercentile = min(max(atoi(value.c_str()), 0), 100);
+	else if (option == "--rank-radius")
+		state->rankRadius = min(max(atoi(value.c_str()), 1), maxRankRadius);
+	else if (option == "--bilateral-spatial")
+		state->bilateralSpatial = min(max(atoi(value.c_str()), minBilateralSpatial), maxBilateralSpatial);
+	else if (option == "--bilateral-range")
+		state->bilateralRange = min(max((float)atof(value.c_str()), minBilateralRange), maxBilateralRange);
+	else if (option == "--edge" && value == "c")
+	{
+		fill(state->edge, state->edge + 9, 0.f);
+		state->edgeEffect = 3;
+	}
+	else if (option == "--edge")
+	{
+		const float *kernel = value == "h" ? horizontalSobel : value == "v" ? verticalSobel : unsharpMask;
+		copy(kernel, kernel + 9, state->edge);
+		state->edgeEffect = value == "u" ? 2 : 1;
+	}
+	else
+		return false;
+
+	*i += 1;
+	return true;
+}
+
+bool operator==(const EffectState &a, const EffectState &b)
+{
+	if (a.colourEffect != b.colourEffect || a.edgeEffect != b.edgeEffect || a.blur != b.blur)
+		return false;
+	if (a.rankRadius != b.rankRadius || a.rankPercentile != b.rankPercentile)
+		return false;
+	if (a.bilateralSpatial != b.bilateralSpatial || a.bilateralRange != b.bilateralRange)
+		return false;
+	return equal(a.edge, a.edge + 9, b.edge);
+}
+
+bool operator!=(const EffectState &a, const EffectState &b)
+{
+	return !(a == b);
+}
+
+int EffectHalo(const EffectState &state)
+{
+	// the blur replaces the edge result in the fragment program, so only the
+	// widest kernel that actually runs matters; the bilateral blur gets its
+	// neighbourhood from the grid and needs none, nor does the Canny detector
+	if (state.blur >= 1 && state.blur <= 3)
+		return state.blur;
+	if (state.blur == 4)
+		return 0;
+	if (state.blur == 5)
+		return state.rankRadius;
+	if (state.edgeEffect == 1 || state.edgeEffect == 2)
+		return 1;
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+// Row operations, every filter is built from these so that all channels of
+// all texels go through the same vector code
+
+// out[x] = w * in[x]
+static void ScaleRow(float *out, const float *in, float w, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128 weight = _mm_set1_ps(w);
+	for (; x + 4 <= count; x += 4)
+		_mm_storeu_ps(out + x, _mm_mul_ps(weight, _mm_loadu_ps(in + x)));
+#endif
+	for (; x < count; x++)
+		out[x] = w * in[x];
+}
+
+// out[x] += w * in[x]
+static void MulAddRow(float *out, const float *in, float w, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128 weight = _mm_set1_ps(w);
+	for (; x + 4 <= count; x += 4)
+		_mm_storeu_ps(out + x, _mm_add_ps(_mm_loadu_ps(out + x), _mm_mul_ps(weight, _mm_loadu_ps(in + x))));
+#endif
+	for (; x < count; x++)
+		out[x] += w * in[x];
+}
+
+// out[x] = 1 - in[x]
+static void InvertRow(float *out, const float *in, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128 one = _mm_set1_ps(1.f);
+	for (; x + 4 <= count; x += 4)
+		_mm_storeu_ps(out + x, _mm_sub_ps(one, _mm_loadu_ps(in + x)));
+#endif
+	for (; x < count; x++)
+		out[x] = 1.f - in[x];
+}
+
+// row[x] = |row[x]|
+static void AbsRow(float *row, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	__m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for (; x + 4 <= count; x += 4)
+		_mm_storeu_ps(row + x, _mm_and_ps(mask, _mm_loadu_ps(row + x)));
+#endif
+	for (; x < count; x++)
+		row[x] = fabsf(row[x]);
+}
+
+static inline unsigned char ToByte(float v)
+{
+	return (unsigned char)(min(max(v, 0.f), 1.f) * 255.f + 0.5f);
+}
+
+// out = wr * r + wg * g + wb * b
+static void WeightRows(float *out, const float *r, const float *g, const float *b,
+                       float wr, float wg, float wb, int count)
+{
+	ScaleRow(out, r, wr, count);
+	MulAddRow(out, g, wg, count);
+	MulAddRow(out, b, wb, count);
+}
+
+// --------------------------------------------------------------------------
+// Filtering
+
+// same weights as the gaussRow arrays of fragment.glsl
+static const float blur1Row[3] = { 0.2f, 0.6f, 0.2f };
+static const float blur2Row[5] = { 0.06f, 0.24f, 0.4f, 0.24f, 0.06f };
+static const float blur3Row[7] = { 0.004f, 0.054f, 0.242f, 0.4f, 0.242f, 0.054f, 0.004f };
+
+// the fragment program applies the colour effect, replaces it with the edge
+// effect if there is one, and replaces that with the blur if there is one
+static void ColourRow(const MyPlanarImage &src, const EffectState &state, const MyLevels *levels,
+                      int x0, int y, int width, float *const out[4])
+{
+	const float *in[4];
+	for (int c = 0; c < 4; c++)
+		in[c] = src.Row(c, y) + x0;
+
+	float *r = out[0], *g = out[1], *b = out[2];
+	switch (state.colourEffect)
+	{
+	case 1:
+		WeightRows(r, in[0], in[1], in[2], 0.333f, 0.333f, 0.333f, width);
+		break;
+	case 2:
+		WeightRows(r, in[0], in[1], in[2], 0.299f, 0.587f, 0.114f, width);
+		break;
+	case 3:
+		WeightRows(r, in[0], in[1], in[2], 0.213f, 0.715f, 0.072f, width);
+		break;
+	case 4:
+		// each channel uses the already updated ones, like the shader does
+		WeightRows(r, in[0], in[1], in[2], 0.393f, 0.769f, 0.189f, width);
+		WeightRows(g, r, in[1], in[2], 0.349f, 0.686f, 0.168f, width);
+		WeightRows(b, r, g, in[2], 0.272f, 0.534f, 0.131f, width);
+		break;
+	case 5:
+		InvertRow(r, in[0], width);
+		InvertRow(g, in[1], width);
+		InvertRow(b, in[2], width);
+		break;
+	case 6:
+	case 7:
+	{
+		// auto levels looks up every channel in its own curve, equalization
+		// in the one curve held in all of them
+		const float *curves = &levels->curves[state.colourEffect == 6 ? 0 : histogramBins * 4];
+		for (int c = 0; c < 3; c++)
+			for (int x = 0; x < width; x++)
+				out[c][x] = curves[ToByte(in[c][x]) * 4 + c];
+		break;
+	}
+	default:
+		copy(in[0], in[0] + width, r);
+		copy(in[1], in[1] + width, g);
+		copy(in[2], in[2] + width, b);
+	}
+
+	// the greys are computed into red and copied to the other two
+	if (state.colourEffect >= 1 && state.colourEffect <= 3)
+	{
+		copy(r, r + width, g);
+		copy(r, r + width, b);
+	}
+	copy(in[3], in[3] + width, out[3]);
+}
+
+static void EdgeRow(const MyPlanarImage &src, const EffectState &state,
+                    int x0, int y, int width, float *const out[4])
+{
+	for (int c = 0; c < 4; c++)
+	{
+		fill(out[c], out[c] + width, 0.f);
+
+		// edge[h][k] in the shader weighs the texel k-1 across, 1-h up
+		for (int k = 0; k < 3; k++)
+			for (int h = 0; h < 3; h++)
+				MulAddRow(out[c], src.Row(c, y + 1 - h) + x0 + k - 1, state.edge[k * 3 + h], width);
+
+		if (state.edgeEffect == 1)
+			AbsRow(out[c], width);
+	}
+}
+
+// separable, so each row is a vertical pass over the neighbouring rows into
+// scratch followed by a horizontal pass over scratch
+static void BlurRow(const MyPlanarImage &src, int blur,
+                    int x0, int y, int width, float *const out[4], float *scratch)
+{
+	const float *weights = blur == 1 ? blur1Row : blur == 2 ? blur2Row : blur3Row;
+	int r = blur;
+	int span = width + 2 * r;
+	for (int c = 0; c < 4; c++)
+	{
+		ScaleRow(scratch, src.Row(c, y - r) + x0 - r, weights[0], span);
+		for (int i = 1; i <= 2 * r; i++)
+			MulAddRow(scratch, src.Row(c, y - r + i) + x0 - r, weights[i], span);
+
+		ScaleRow(out[c], scratch, weights[0], width);
+		for (int i = 1; i <= 2 * r; i++)
+			MulAddRow(out[c], scratch + i, weights[i], width);
+	}
+}
+
+// --------------------------------------------------------------------------
+// Histogram and levels
+
+bool UsesLevels(const EffectState &state)
+{
+	return (state.colourEffect == 6 || state.colourEffect == 7) &&
+	       !(state.edgeEffect >= 1 && state.edgeEffect <= 3) && !(state.blur >= 1 && state.blur <= 5);
+}
+
+void BuildHistogram(const MyPlanarImage &src, MyHistogram *histogram)
+{
+	fill(histogram->counts.begin(), histogram->counts.end(), 0);
+	mutex merging;
+	ForEachStrip(src.height, [&](int y0, int y1)
+	{
+		vector<unsigned int> counts(4 * histogramBins, 0);
+		unsigned int *red = &counts[0], *green = red + histogramBins;
+		unsigned int *blue = green + histogramBins, *grey = blue + histogramBins;
+		for (int y = y0; y < y1; y++)
+		{
+			const float *r = src.Row(0, y), *g = src.Row(1, y), *b = src.Row(2, y);
+			for (int x = 0; x < src.width; x++)
+			{
+				int R = ToByte(r[x]), G = ToByte(g[x]), B = ToByte(b[x]);
+				red[R]++;
+				green[G]++;
+				blue[B]++;
+				grey[(299 * R + 587 * G + 114 * B + 500) / 1000]++;
+			}
+		}
+
+		lock_guard<mutex> lock(merging);
+		for (int i = 0; i < 4 * histogramBins; i++)
+			histogram->counts[i] += counts[i];
+	});
+}
+
+// levels_curves.glsl computes the same curves on the GPU, bin by bin
+void BuildLevels(const MyHistogram &histogram, MyLevels *levels)
+{
+	levels->curves.assign(2 * histogramBins * 4, 1.f);
+	float *stretch = &levels->curves[0];
+	float *equalize = &levels->curves[histogramBins * 4];
+
+	// auto levels: black is the first bin past the clipped darkest texels,
+	// white the first one that takes in all but the clipped brightest
+	unsigned int total = 0;
+	for (int i = 0; i < histogramBins; i++)
+		total += histogram.counts[i];
+	unsigned int clip = total / levelsClip;
+	for (int c = 0; c < 3; c++)
+	{
+		const unsigned int *counts = &histogram.counts[c * histogramBins];
+		int low = 0, high = histogramBins - 1;
+		unsigned int sum = 0;
+		for (int i = 0; i < histogramBins; i++)
+		{
+			unsigned int previous = sum;
+			sum += counts[i];
+			if (sum > clip && (i == 0 || previous <= clip))
+				low = i;
+			if (sum >= total - clip && (i == 0 || previous < total - clip))
+				high = i;
+		}
+		for (int i = 0; i < histogramBins; i++)
+			stretch[i * 4 + c] = min(max((i - low) / (float)max(high - low, 1), 0.f), 1.f);
+	}
+
+	// equalization: the share of the texels darker than or as dark as the
+	// bin, counted from the darkest bin that has any
+	const unsigned int *grey = &histogram.counts[3 * histogramBins];
+	unsigned int sum = 0, darkest = 0;
+	for (int i = 0; i < histogramBins; i++)
+	{
+		if (grey[i] > 0 && sum == 0)
+			darkest = grey[i];
+		sum += grey[i];
+		float value = total > darkest ? ((float)sum - (float)darkest) / (float)(total - darkest) : i / 255.f;
+		fill(equalize + i * 4, equalize + i * 4 + 4, min(max(value, 0.f), 1.f));
+	}
+}
+
+// --------------------------------------------------------------------------
+// Bilateral grid
+
+// intensity the grid is indexed by, the same as the second grey
+static inline float GridIntensity(float r, float g, float b)
+{
+	return min(max(0.299f * r + 0.587f * g + 0.114f * b, 0.f), 1.f);
+}
+
+void BilateralGridSize(int width, int height, int spatial, float range,
+                       int *gridWidth, int *gridHeight, int *gridDepth)
+{
+	// room for the nearest cell of every texel and the cell after it, which
+	// trilinear lookups also read
+	*gridWidth = (width - 1) / spatial + 2 + 2 * bilateralPad;
+	*gridHeight = (height - 1) / spatial + 2 + 2 * bilateralPad;
+	*gridDepth = (int)(1.f / range) + 2 + 2 * bilateralPad;
+}
+
+// convolves the grid with 1 4 6 4 1 / 16 along one axis, cells beyond the
+// grid count as empty
+static void BlurGridAxis(const MyBilateralGrid &grid, int axis, const float *in, float *out)
+{
+	static const float weights[5] = { 1.f / 16.f, 4.f / 16.f, 6.f / 16.f, 4.f / 16.f, 1.f / 16.f };
+	const int size[3] = { grid.width, grid.height, grid.depth };
+	const int stride[3] = { 1, grid.width, grid.width * grid.height };
+
+	for (int z = 0; z < grid.depth; z++)
+		for (int y = 0; y < grid.height; y++)
+			for (int x = 0; x < grid.width; x++)
+			{
+				const int position[3] = { x, y, z };
+				int cell = x + y * stride[1] + z * stride[2];
+				float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+				for (int i = -2; i <= 2; i++)
+				{
+					int p = position[axis] + i;
+					if (p < 0 || p >= size[axis])
+						continue;
+					const float *neighbour = in + (size_t)(cell + i * stride[axis]) * 4;
+					for (int c = 0; c < 4; c++)
+						sum[c] += weights[i + 2] * neighbour[c];
+				}
+				copy(sum, sum + 4, out + (size_t)cell * 4);
+			}
+}
+
+void BuildBilateralGrid(const MyPlanarImage &src, const EffectState &state, MyBilateralGrid *grid)
+{
+	int spatial = state.bilateralSpatial;
+	float range = state.bilateralRange;
+	grid->spatial = spatial;
+	grid->range = range;
+	BilateralGridSize(src.width, src.height, spatial, range, &grid->width, &grid->height, &grid->depth);
+	size_t count = (size_t)grid->width * grid->height * grid->depth * 4;
+	grid->cells.assign(count, 0.f);
+
+	// every texel goes to its nearest cell
+	for (int y = 0; y < src.height; y++)
+	{
+		const float *r = src.Row(0, y), *g = src.Row(1, y), *b = src.Row(2, y);
+		int gy = (y + spatial / 2) / spatial + bilateralPad;
+		for (int x = 0; x < src.width; x++)
+		{
+			int gx = (x + spatial / 2) / spatial + bilateralPad;
+			int gz = (int)(GridIntensity(r[x], g[x], b[x]) / range + 0.5f) + bilateralPad;
+			float *cell = &grid->cells[(((size_t)gz * grid->height + gy) * grid->width + gx) * 4];
+			cell[0] += r[x];
+			cell[1] += g[x];
+			cell[2] += b[x];
+			cell[3] += 1.f;
+		}
+	}
+
+	vector<float> scratch(count);
+	BlurGridAxis(*grid, 0, &grid->cells[0], &scratch[0]);
+	BlurGridAxis(*grid, 1, &scratch[0], &grid->cells[0]);
+	BlurGridAxis(*grid, 2, &grid->cells[0], &scratch[0]);
+	grid->cells.swap(scratch);
+}
+
+// reads every texel's result back from the grid at its position and intensity
+static void BilateralRow(const MyPlanarImage &src, const MyBilateralGrid &grid,
+                         int x0, int y, int width, float *const out[4])
+{
+	const float *in[4];
+	for (int c = 0; c < 4; c++)
+		in[c] = src.Row(c, y) + x0;
+
+	size_t strideY = (size_t)grid.width * 4, strideZ = strideY * grid.height;
+	float fy = (float)y / grid.spatial + bilateralPad;
+	int iy = (int)fy;
+	float ty = fy - iy;
+	for (int x = 0; x < width; x++)
+	{
+		float fx = (float)(x0 + x) / grid.spatial + bilateralPad;
+		float fz = GridIntensity(in[0][x], in[1][x], in[2][x]) / grid.range + bilateralPad;
+		int ix = (int)fx, iz = (int)fz;
+		float tx = fx - ix, tz = fz - iz;
+
+		float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+		const float *base = &grid.cells[iz * strideZ + iy * strideY + (size_t)ix * 4];
+		for (int corner = 0; corner < 8; corner++)
+		{
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+			float w = (dx ? tx : 1.f - tx) * (dy ? ty : 1.f - ty) * (dz ? tz : 1.f - tz);
+			const float *cell = base + dz * strideZ + dy * strideY + dx * 4;
+			for (int c = 0; c < 4; c++)
+				sum[c] += w * cell[c];
+		}
+
+		// the texel itself is in the grid, so the weight is never zero
+		float norm = 1.f / max(sum[3], 1e-6f);
+		out[0][x] = sum[0] * norm;
+		out[1][x] = sum[1] * norm;
+		out[2][x] = sum[2] * norm;
+		out[3][x] = in[3][x];
+	}
+}
+
+// --------------------------------------------------------------------------
+// Canny edge detector
+
+// the second grey of row y smoothed with blur1Row in both directions;
+// lum and scratch hold width + 2 floats
+static void SmoothRow(const MyPlanarImage &src, int y, float *out, float *lum, float *scratch)
+{
+	int span = src.width + 2;
+	fill(scratch, scratch + span, 0.f);
+	for (int j = -1; j <= 1; j++)
+	{
+		WeightRows(lum, src.Row(0, y + j) - 1, src.Row(1, y + j) - 1, src.Row(2, y + j) - 1,
+		           0.299f, 0.587f, 0.114f, span);
+		MulAddRow(scratch, lum, blur1Row[j + 1], span);
+	}
+	ScaleRow(out, scratch, blur1Row[0], src.width);
+	MulAddRow(out, scratch + 1, blur1Row[1], src.width);
+	MulAddRow(out, scratch + 2, blur1Row[2], src.width);
+}
+
+// applies a kernel of the h, v and u keys to the smoothed rows, weighing
+// the texel k-1 across and 1-h up with kernel[k * 3 + h] like EdgeRow; the
+// rows are padded with one clamped texel on either side
+static void SobelRow(const float *const rows[3], const float *kernel, float *out, int width)
+{
+	fill(out, out + width, 0.f);
+	for (int k = 0; k < 3; k++)
+		for (int h = 0; h < 3; h++)
+			if (kernel[k * 3 + h] != 0.f)
+				MulAddRow(out, rows[2 - h] + k, kernel[k * 3 + h], width);
+}
+
+// gradient direction rounded to 0 (along x), 1 (along x = y), 2 (along y)
+// or 3 (along x = -y); the same as canny_gradient.glsl. Negating both
+// components, as the Sobel kernels do, gives the same direction
+static inline unsigned char GradientSector(float gx, float gy)
+{
+	const float tan22 = 0.41421356f;
+	float ax = fabsf(gx), ay = fabsf(gy);
+	if (ay <= ax * tan22)
+		return 0;
+	if (ax <= ay * tan22)
+		return 2;
+	return gx * gy > 0.f ? 1 : 3;
+}
+
+// follows the links without shortening them, safe to run concurrently
+static int FindRoot(const int *parent, int i)
+{
+	while (parent[i] != i)
+		i = parent[i];
+	return i;
+}
+
+// halves the path on the way up
+static int FindRootHalving(int *parent, int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// joins the sets of a and b under the lower root, which remembers whether
+// the set holds a strong texel
+static void Unite(int *parent, unsigned char *classes, int a, int b)
+{
+	a = FindRootHalving(parent, a);
+	b = FindRootHalving(parent, b);
+	if (a == b)
+		return;
+	if (a < b)
+		swap(a, b);
+	parent[a] = b;
+	classes[b] = max(classes[b], classes[a]);
+}
+
+void ClassifyCannyEdges(const MyPlanarImage &src, MyCannyEdges *canny)
+{
+	const int width = src.width, height = src.height;
+	const size_t count = (size_t)width * height;
+	canny->width = width;
+	canny->height = height;
+	canny->edges.assign(count, 0);
+	if (count == 0)
+		return;
+
+	// each strip streams its rows through the smoothing, the gradient and the
+	// suppression, keeping three rows of each, so nothing but the classes is
+	// stored for the whole picture; the rows just outside the strip are
+	// computed by both strips that need them
+	ForEachStrip(height, [&](int y0, int y1)
+	{
+		// a chunk of a row at a time keeps the row operations in L1
+		const int chunk = 1024;
+		const int stride = width + 2;
+		vector<float> lum(stride), scratch(stride), gh(chunk), gv(chunk);
+
+		// smoothed rows with one clamped texel on either side, and gradient
+		// magnitudes with a border of zeros so the suppression can read
+		// past the picture; slot r % 3 holds row r
+		vector<float> smooth(3 * stride), magnitude(4 * stride, 0.f);
+		vector<unsigned char> sector(3 * width);
+		int smoothRow[3] = { -1, -1, -1 }, magnitudeRow[3] = { -1, -1, -1 };
+		const float *zeros = &magnitude[3 * stride];
+
+		auto Smoothed = [&](int y) -> const float *
+		{
+			y = min(max(y, 0), height - 1);
+			float *row = &smooth[(y % 3) * stride];
+			if (smoothRow[y % 3] != y)
+			{
+				SmoothRow(src, y, row + 1, &lum[0], &scratch[0]);
+				row[0] = row[1];
+				row[width + 1] = row[width];
+				smoothRow[y % 3] = y;
+			}
+			return row;
+		};
+		auto Magnitude = [&](int y) -> const float *
+		{
+			if (y < 0 || y >= height)
+				return zeros;
+			float *row = &magnitude[(y % 3) * stride];
+			if (magnitudeRow[y % 3] != y)
+			{
+				const float *rows[3] = { Smoothed(y - 1), Smoothed(y), Smoothed(y + 1) };
+				for (int x0 = 0; x0 < width; x0 += chunk)
+				{
+					int span = min(chunk, width - x0);
+					const float *part[3] = { rows[0] + x0, rows[1] + x0, rows[2] + x0 };
+					SobelRow(part, horizontalSobel, &gh[0], span);
+					SobelRow(part, verticalSobel, &gv[0], span);
+
+					// h responds to changes along y and v to changes along x
+					float *m = row + 1 + x0;
+					unsigned char *d = &sector[(y % 3) * width + x0];
+					for (int x = 0; x < span; x++)
+						m[x] = sqrtf(gv[x] * gv[x] + gh[x] * gh[x]) * 0.25f;
+					for (int x = 0; x < span; x++)
+						d[x] = GradientSector(gv[x], gh[x]);
+				}
+				magnitudeRow[y % 3] = y;
+			}
+			return row;
+		};
+
+		// non-maximum suppression along the sector's direction (+x, +x+y,
+		// +y or +x-y) and the thresholds
+		for (int y = y0; y < y1; y++)
+		{
+			const float *below = Magnitude(y - 1) + 1, *m = Magnitude(y) + 1, *above = Magnitude(y + 1) + 1;
+			const unsigned char *d = &sector[(y % 3) * width];
+			const float *ahead[4] = { m + 1, above + 1, above, below + 1 };
+			const float *behind[4] = { m - 1, below - 1, below, above - 1 };
+			unsigned char *c = &canny->edges[(size_t)y * width];
+			for (int x = 0; x < width; x++)
+			{
+				bool peak = m[x] > ahead[d[x]][x] && m[x] >= behind[d[x]][x];
+				c[x] = peak * ((m[x] >= cannyLow) + (m[x] >= cannyHigh));
+			}
+		}
+	});
+}
+
+void TraceCannyEdges(MyCannyEdges *canny)
+{
+	const int width = canny->width, height = canny->height;
+	const size_t count = (size_t)width * height;
+	vector<unsigned char> classes(count);
+	classes.swap(canny->edges);
+	canny->edges.assign(count, 0);
+	if (count == 0)
+		return;
+	vector<int> parent(count);
+
+	ForEachStrip(height, [&](int y0, int y1)
+	{
+		for (int i = y0 * width; i < y1 * width; i++)
+			parent[i] = i;
+
+		// union-find over the weak and strong texels of the strip, 8-connected
+		for (int y = y0; y < y1; y++)
+			for (int x = 0; x < width; x++)
+			{
+				int i = y * width + x;
+				if (classes[i] == 0)
+					continue;
+				if (x > 0 && classes[i - 1])
+					Unite(&parent[0], &classes[0], i, i - 1);
+				for (int dx = -1; y > y0 && dx <= 1; dx++)
+					if (x + dx >= 0 && x + dx < width && classes[i - width + dx])
+						Unite(&parent[0], &classes[0], i, i - width + dx);
+			}
+
+		// every texel of the strip then points straight at its root
+		for (int i = y0 * width; i < y1 * width; i++)
+			parent[i] = FindRootHalving(&parent[0], i);
+	});
+
+	// the strips are joined along their first rows, one after the other
+	int strips = StripCount(height);
+	for (int s = 1; s < strips; s++)
+	{
+		int y = height * s / strips;
+		for (int x = 0; x < width; x++)
+		{
+			int i = y * width + x;
+			if (classes[i] == 0)
+				continue;
+			for (int dx = -1; dx <= 1; dx++)
+				if (x + dx >= 0 && x + dx < width && classes[i - width + dx])
+					Unite(&parent[0], &classes[0], i, i - width + dx);
+		}
+	}
+
+	// a texel is an edge when the root of its set saw a strong texel
+	ForEachStrip(height, [&](int y0, int y1)
+	{
+		for (int i = y0 * width; i < y1 * width; i++)
+			canny->edges[i] = classes[i] != 0 && classes[FindRoot(&parent[0], i)] == 2;
+	});
+}
+
+void BuildCannyEdges(const MyPlanarImage &src, MyCannyEdges *canny)
+{
+	ClassifyCannyEdges(src, canny);
+	TraceCannyEdges(canny);
+}
+
+// the detector only runs when no blur replaces its result
+static bool RunsCanny(const EffectState &state)
+{
+	return state.edgeEffect == 3 && !(state.blur >= 1 && state.blur <= 5);
+}
+
+static void CannyRow(const MyPlanarImage &src, const MyCannyEdges &canny,
+                     int x0, int y, int width, float *const out[4])
+{
+	const unsigned char *edges = &canny.edges[(size_t)y * canny.width + x0];
+	for (int x = 0; x < width; x++)
+		out[0][x] = out[1][x] = out[2][x] = edges[x];
+	const float *alpha = src.Row(3, y) + x0;
+	copy(alpha, alpha + width, out[3]);
+}
+
+// --------------------------------------------------------------------------
+// Rank filters
+
+const int rankCoarseBins = 16;      // of 16 fine bins each
+const int rankFineBins = 256;
+
+// columns a rank filter covers at once, so that their histograms stay in the
+// cache
+const int rankBand = 128;
+
+int RankIndex(const EffectState &state)
+{
+	int side = 2 * state.rankRadius + 1;
+	return ((side * side - 1) * state.rankPercentile + 50) / 100;
+}
+
+bool RanksOnCpu(const EffectState &state)
+{
+	return state.blur == 5 && state.rankRadius > maxNetworkRankRadius;
+}
+
+// to[i] += from[i], count a multiple of 8
+static void AddCounts(unsigned short *to, const unsigned short *from, int count)
+{
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(to + i)),
+		                            _mm_loadu_si128((const __m128i *)(from + i)));
+		_mm_storeu_si128((__m128i *)(to + i), sum);
+	}
+#endif
+	for (; i < count; i++)
+		to[i] += from[i];
+}
+
+// to[i] += plus[i] - minus[i], count a multiple of 8
+static void SlideCounts(unsigned short *to, const unsigned short *plus, const unsigned short *minus, int count)
+{
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(to + i)),
+		                            _mm_loadu_si128((const __m128i *)(plus + i)));
+		sum = _mm_sub_epi16(sum, _mm_loadu_si128((const __m128i *)(minus + i)));
+		_mm_storeu_si128((__m128i *)(to + i), sum);
+	}
+#endif
+	for (; i < count; i++)
+		to[i] += plus[i] - minus[i];
+}
+
+// the bin of 16 counts that entry *rank of their sorted values falls in,
+// leaving in *rank its position within the bin
+static int FindBin(const unsigned short *counts, int *rank)
+{
+#ifdef __SSE2__
+	// prefix sums of both halves, counts stay below 32768 so they compare
+	// as signed
+	__m128i low = _mm_loadu_si128((const __m128i *)counts);
+	__m128i high = _mm_loadu_si128((const __m128i *)(counts + 8));
+	low = _mm_add_epi16(low, _mm_slli_si128(low, 2));
+	high = _mm_add_epi16(high, _mm_slli_si128(high, 2));
+	low = _mm_add_epi16(low, _mm_slli_si128(low, 4));
+	high = _mm_add_epi16(high, _mm_slli_si128(high, 4));
+	low = _mm_add_epi16(low, _mm_slli_si128(low, 8));
+	high = _mm_add_epi16(high, _mm_slli_si128(high, 8));
+	__m128i lowTotal = _mm_shufflehi_epi16(low, 0xff);
+	high = _mm_add_epi16(high, _mm_unpackhi_epi64(lowTotal, lowTotal));
+
+	// the sums grow, so the bin is the first one whose sum is above the
+	// rank; the last one always is
+	__m128i target = _mm_set1_epi16((short)*rank);
+	int above = _mm_movemask_epi8(_mm_cmpgt_epi16(low, target)) |
+	            _mm_movemask_epi8(_mm_cmpgt_epi16(high, target)) << 16;
+	int bin = __builtin_ctz(above) / 2;
+	if (bin > 0)
+	{
+		unsigned short sums[16];
+		_mm_storeu_si128((__m128i *)sums, low);
+		_mm_storeu_si128((__m128i *)(sums + 8), high);
+		*rank -= sums[bin - 1];
+	}
+	return bin;
+#else
+	int bin = 0;
+	while (*rank >= counts[bin])
+		*rank -= counts[bin++];
+	return bin;
+#endif
+}
+
+// the histograms of a rank filter moving down the texels [x0, x0 + width) of
+// a picture, one row at a time
+struct MyRankWindow
+{
+	int radius;
+	int index;              // RankIndex()
+	int x0;
+	int width;
+	int columns;            // x0 - radius to x0 + width + radius - 1
+	int y;                  // row the column histograms are centred on
+
+	// histograms of the columns: the coarse bins of the four channels column
+	// after column, and the fine bins ordered by channel, then coarse bin,
+	// then column, so that sliding the window along a row reads both in order
+	vector<unsigned short, AlignedAllocator<unsigned short> > coarseColumns;
+	vector<unsigned short, AlignedAllocator<unsigned short> > fineColumns;
+
+	// histogram of the window around the current texel; the coarse bins are
+	// kept up to date, the fine bins under a coarse bin only when the rank
+	// falls in it, and fineColumn holds the texel they were last valid for
+	unsigned short coarse[4][rankCoarseBins];
+	unsigned short fine[4][rankFineBins];
+	int fineColumn[4][rankCoarseBins];
+
+	MyRankWindow() : radius(0), index(0), x0(0), width(0), columns(0), y(INT_MIN)
+	{}
+
+	// the 4 x 16 coarse bins of column j, and the 16 fine bins under coarse
+	// bin b of channel c in column j
+	unsigned short *Coarse(int j)
+	{
+		return &coarseColumns[(size_t)j * 4 * rankCoarseBins];
+	}
+	unsigned short *Fine(int c, int b, int j)
+	{
+		return &fineColumns[(((size_t)c * rankCoarseBins + b) * columns + j) * 16];
+	}
+};
+
+static void StartRankWindow(MyRankWindow *window, const EffectState &state, int x0, int width)
+{
+	window->radius = state.rankRadius;
+	window->index = RankIndex(state);
+	window->x0 = x0;
+	window->width = width;
+	window->columns = width + 2 * state.rankRadius;
+	window->y = INT_MIN;
+	window->coarseColumns.assign((size_t)window->columns * 4 * rankCoarseBins, 0);
+	window->fineColumns.assign((size_t)window->columns * 4 * rankFineBins, 0);
+}
+
+// adds row y of the picture to the column histograms and removes row
+// leaving from them, or only adds row y when leaving is INT_MIN
+static void CountRow(const MyPlanarImage &src, MyRankWindow *window, int y, int leaving)
+{
+	int r = window->radius;
+	for (int c = 0; c < 4; c++)
+	{
+		const float *entered = src.Row(c, y);
+		const float *left = src.Row(c, leaving);
+		for (int j = 0; j < window->columns; j++)
+		{
+			int x = min(max(window->x0 - r + j, 0), src.width - 1);
+			unsigned short *coarse = window->Coarse(j) + c * rankCoarseBins;
+			int v = ToByte(entered[x]);
+			coarse[v >> 4]++;
+			window->Fine(c, v >> 4, j)[v & 15]++;
+			if (leaving == INT_MIN)
+				continue;
+			v = ToByte(left[x]);
+			coarse[v >> 4]--;
+			window->Fine(c, v >> 4, j)[v & 15]--;
+		}
+	}
+}
+
+// centres the column histograms on row y, sliding them down when they are
+// centred on a row a little above and counting them afresh otherwise
+static void MoveRankWindow(const MyPlanarImage &src, MyRankWindow *window, int y)
+{
+	int r = window->radius;
+	if (window->y != INT_MIN && y > window->y && y - window->y <= 2 * r)
+	{
+		for (int row = window->y + 1; row <= y; row++)
+			CountRow(src, window, row + r, row - r - 1);
+	}
+	else
+	{
+		fill(window->coarseColumns.begin(), window->coarseColumns.end(), 0);
+		fill(window->fineColumns.begin(), window->fineColumns.end(), 0);
+		for (int row = y - r; row <= y + r; row++)
+			CountRow(src, window, row, INT_MIN);
+	}
+	window->y = y;
+}
+
+static void RankRow(const MyPlanarImage &src, MyRankWindow *window, int y, float *const out[4])
+{
+	MoveRankWindow(src, window, y);
+
+	int side = 2 * window->radius + 1;
+	memset(window->coarse, 0, sizeof(window->coarse));
+	for (int j = 0; j < side; j++)
+		AddCounts(window->coarse[0], window->Coarse(j), 4 * rankCoarseBins);
+	for (int c = 0; c < 4; c++)
+		fill(window->fineColumn[c], window->fineColumn[c] + rankCoarseBins, -side);
+
+	for (int x = 0; x < window->width; x++)
+	{
+		// column x + side - 1 enters the window, column x - 1 leaves it
+		if (x > 0)
+			SlideCounts(window->coarse[0], window->Coarse(x + side - 1), window->Coarse(x - 1),
+			            4 * rankCoarseBins);
+
+		for (int c = 0; c < 4; c++)
+		{
+			int rank = window->index;
+			int bin = FindBin(window->coarse[c], &rank);
+
+			// bring the fine bins under the coarse one up to date, from the
+			// texel they were valid for or from scratch
+			unsigned short *fine = window->fine[c] + bin * 16;
+			int last = window->fineColumn[c][bin];
+			if (x - last >= side)
+			{
+				memset(fine, 0, 16 * sizeof(unsigned short));
+				for (int j = x; j < x + side; j++)
+					AddCounts(fine, window->Fine(c, bin, j), 16);
+			}
+			else
+			{
+				for (int j = last + 1; j <= x; j++)
+					SlideCounts(fine, window->Fine(c, bin, j + side - 1), window->Fine(c, bin, j - 1), 16);
+			}
+			window->fineColumn[c][bin] = x;
+
+			out[c][x] = (bin * 16 + FindBin(fine, &rank)) / 255.f;
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Effect stack
+
+// evaluates the fragment program for texels [x0, x0 + width) of row y
+static void FilterRow(const MyPlanarImage &src, const EffectState &state, const MyBilateralGrid *grid,
+                      const MyCannyEdges *canny, const MyLevels *levels, MyRankWindow *rank,
+                      int x0, int y, int width, float *const out[4], float *scratch)
+{
+	if (state.blur == 5)
+		RankRow(src, rank, y, out);
+	else if (state.blur == 4)
+		BilateralRow(src, *grid, x0, y, width, out);
+	else if (state.blur >= 1 && state.blur <= 3)
+		BlurRow(src, state.blur, x0, y, width, out, scratch);
+	else if (state.edgeEffect == 1 || state.edgeEffect == 2)
+		EdgeRow(src, state, x0, y, width, out);
+	else if (state.edgeEffect == 3)
+		CannyRow(src, *canny, x0, y, width, out);
+	else
+		ColourRow(src, state, levels, x0, y, width, out);
+}
+
+void ApplyEffects(const MyPlanarImage &src, const EffectState &state,
+                  const PixelRect &rect, float *out, int step,
+                  const MyBilateralGrid *grid, const MyCannyEdges *canny,
+                  const MyLevels *levels)
+{
+	MyBilateralGrid ownGrid;
+	if (state.blur == 4 && grid == nullptr)
+	{
+		BuildBilateralGrid(src, state, &ownGrid);
+		grid = &ownGrid;
+	}
+	MyCannyEdges ownCanny;
+	if (RunsCanny(state) && canny == nullptr)
+	{
+		BuildCannyEdges(src, &ownCanny);
+		canny = &ownCanny;
+	}
+	MyLevels ownLevels;
+	if (UsesLevels(state) && levels == nullptr)
+	{
+		MyHistogram histogram;
+		BuildHistogram(src, &histogram);
+		BuildLevels(histogram, &ownLevels);
+		levels = &ownLevels;
+	}
+
+	// the rank filter goes down bands of columns whose histograms fit in the
+	// cache, as many whole preview blocks wide as fit in rankBand
+	int band = state.blur == 5 ? rankBand - rankBand % step : rect.Width();
+	vector<float> rows(4 * band);
+	vector<float> scratch(band + 2 * planarBorder);
+	float *const planes[4] = { &rows[0], &rows[band], &rows[2 * band], &rows[3 * band] };
+
+	for (int x0 = rect.x0; x0 < rect.x1; x0 += band)
+	{
+		int width = min(band, rect.x1 - x0);
+		MyRankWindow rank;
+		if (state.blur == 5)
+			StartRankWindow(&rank, state, x0, width);
+
+		for (int y = rect.y0; y < rect.y1; y += step)
+		{
+			FilterRow(src, state, grid, canny, levels, &rank, x0, y, width, planes, &scratch[0]);
+
+			// previews hold every step-th texel over its block
+			if (step > 1)
+				for (int c = 0; c < 4; c++)
+					for (int x = 0; x < width; x++)
+						planes[c][x] = planes[c][x - x % step];
+
+			for (int by = y; by < min(y + step, rect.y1); by++)
+				InterleaveRGBA(planes, width, out + ((size_t)(by - rect.y0) * rect.Width() + x0 - rect.x0) * 4);
+		}
+	}
+}
+
+void FilterImage(const MyPlanarImage &src, const EffectState &state, MyPlanarImage *dst)
+{
+	MyBilateralGrid grid;
+	if (state.blur == 4)
+		BuildBilateralGrid(src, state, &grid);
+	MyCannyEdges canny;
+	if (RunsCanny(state))
+		BuildCannyEdges(src, &canny);
+	MyLevels levels;
+	if (UsesLevels(state))
+	{
+		MyHistogram histogram;
+		BuildHistogram(src, &histogram);
+		BuildLevels(histogram, &levels);
+	}
+
+	ResizePlanar(dst, src.width, src.height);
+	ForEachStrip(src.height, [&](int y0, int y1)
+	{
+		vector<float> scratch(src.width + 2 * planarBorder);
+
+		// the rank filter goes down bands of columns whose histograms fit in
+		// the cache
+		int band = state.blur == 5 ? rankBand : src.width;
+		for (int x0 = 0; x0 < src.width; x0 += band)
+		{
+			int width = min(band, src.width - x0);
+			MyRankWindow rank;
+			if (state.blur == 5)
+				StartRankWindow(&rank, state, x0, width);
+			for (int y = y0; y < y1; y++)
+			{
+				float *const planes[4] = { dst->Row(0, y) + x0, dst->Row(1, y) + x0, dst->Row(2, y) + x0, dst->Row(3, y) + x0 };
+				FilterRow(src, state, &grid, &canny, &levels, &rank, x0, y, width, planes, &scratch[0]);
+			}
+		}
+	});
+	ExtendBorders(dst);
+}
+
+// --------------------------------------------------------------------------
+// Tile cache of filtered texels
+
+// reports the bytes the cache holds to the memory accountant
+static void CountTileCache(MyTileCache *cache)
+{
+	long long tiles = 0;
+	for (map<pair<int, int>, MyTile>::const_iterator it = cache->tiles.begin(); it != cache->tiles.end(); ++it)
+		tiles += it->second.pixels.size() * sizeof(unsigned short);
+	cache->tileBytes.Set(tiles);
+	cache->builtBytes.Set(cache->grid.cells.size() * sizeof(float) + cache->canny.edges.size() +
+	                      cache->levels.curves.size() * sizeof(float));
+}
+
+void ClearTiles(MyTileCache *cache)
+{
+	cache->tiles.clear();
+	cache->grid = MyBilateralGrid();
+	cache->canny = MyCannyEdges();
+	cache->levels = MyLevels();
+	CountTileCache(cache);
+}
+
+long long EvictTiles(MyTileCache *cache, long long bytes, bool keepVisible)
+{
+	// oldest first, the same as the server's image cache
+	vector<pair<unsigned long, pair<int, int> > > unused;
+	for (map<pair<int, int>, MyTile>::const_iterator it = cache->tiles.begin(); it != cache->tiles.end(); ++it)
+		if (it->second.lastUse < cache->clock || !keepVisible)
+			unused.push_back(make_pair(it->second.lastUse, it->first));
+	sort(unused.begin(), unused.end());
+
+	long long released = 0;
+	for (size_t i = 0; i < unused.size() && released < bytes; i++)
+	{
+		map<pair<int, int>, MyTile>::iterator tile = cache->tiles.find(unused[i].second);
+		released += tile->second.pixels.size() * sizeof(unsigned short);
+		cache->tiles.erase(tile);
+	}
+	CountTileCache(cache);
+	return released;
+}
+
+long long EvictBuiltEffects(MyTileCache *cache, long long bytes)
+{
+	for (map<pair<int, int>, MyTile>::const_iterator it = cache->tiles.begin(); it != cache->tiles.end(); ++it)
+		if (it->second.lastUse == cache->clock && it->second.step > 1)
+			return 0;
+
+	long long released = 0;
+	if (released < bytes)
+	{
+		released += cache->canny.edges.size();
+		cache->canny = MyCannyEdges();
+	}
+	if (released < bytes)
+	{
+		released += cache->grid.cells.size() * sizeof(float);
+		cache->grid = MyBilateralGrid();
+	}
+	if (released < bytes)
+	{
+		released += cache->levels.curves.size() * sizeof(float);
+		cache->levels = MyLevels();
+	}
+	CountTileCache(cache);
+	return released;
+}
+
+int UpdateTiles(MyTileCache *cache, const string &imageName,
+                const MyPlanarImage &src, const EffectState &state,
+                const PixelRect &visible, vector<const MyTile *> *fresh,
+                int previewStep, double budget)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// cached tiles are only valid for the image and effects they were made with
+	if (cache->imageName != imageName || cache->state != state)
+	{
+		ClearTiles(cache);
+		cache->imageName = imageName;
+		cache->state = state;
+	}
+
+	PixelRect rect(max(visible.x0, 0), max(visible.y0, 0),
+	               min(visible.x1, src.width), min(visible.y1, src.height));
+	if (rect.Empty())
+		return 0;
+
+	// mark the tiles on screen as used, so that making room for the missing
+	// ones only evicts tiles off screen
+	int size = cache->tileSize;
+	cache->clock++;
+	long long missing = 0;
+	for (int ty = rect.y0 / size; ty <= (rect.y1 - 1) / size; ty++)
+	{
+		for (int tx = rect.x0 / size; tx <= (rect.x1 - 1) / size; tx++)
+		{
+			map<pair<int, int>, MyTile>::iterator cached = cache->tiles.find(make_pair(tx, ty));
+			if (cached != cache->tiles.end())
+				cached->second.lastUse = cache->clock;
+			else
+				missing += (long long)size * size * 4 * sizeof(unsigned short);
+		}
+	}
+	if (missing > 0)
+		ReserveMemory(hostMemory, missing);
+
+	// the grid, the edges and the levels cover the whole picture, so they are
+	// built once for all tiles
+	if (state.blur == 4 && cache->grid.cells.empty())
+		BuildBilateralGrid(src, state, &cache->grid);
+	if (RunsCanny(state) && cache->canny.edges.empty())
+		BuildCannyEdges(src, &cache->canny);
+	if (UsesLevels(state) && cache->levels.curves.empty())
+	{
+		MyHistogram histogram;
+		BuildHistogram(src, &histogram);
+		BuildLevels(histogram, &cache->levels);
+	}
+
+	int count = 0;
+	for (int ty = rect.y0 / size; ty <= (rect.y1 - 1) / size; ty++)
+	{
+		for (int tx = rect.x0 / size; tx <= (rect.x1 - 1) / size; tx++)
+		{
+			// once the budget is used up, missing tiles only get a preview
+			// and existing previews stay as they are
+			bool outOfTime = previewStep > 1 &&
+				chrono::duration<double>(chrono::steady_clock::now() - start).count() >= budget;
+
+			pair<int, int> key(tx, ty);
+			map<pair<int, int>, MyTile>::iterator cached = cache->tiles.find(key);
+			if (cached != cache->tiles.end() && (cached->second.step == 1 || outOfTime))
+				continue;
+
+			MyTile &tile = cache->tiles[key];
+			tile.rect = PixelRect(tx * size, ty * size,
+			                      min((tx + 1) * size, src.width),
+			                      min((ty + 1) * size, src.height));
+			tile.step = outOfTime ? previewStep : 1;
+			tile.lastUse = cache->clock;
+
+			// filter in floats, keep the result at half the bytes
+			int values = tile.rect.Width() * tile.rect.Height() * 4;
+			vector<float> colours(values);
+			ApplyEffects(src, state, tile.rect, &colours[0], tile.step, &cache->grid, &cache->canny, &cache->levels);
+			tile.pixels.resize(values);
+			FloatToHalf(&colours[0], &tile.pixels[0], values);
+
+			if (fresh) fresh->push_back(&tile);
+			count++;
+		}
+	}
+	CountTileCache(cache);
+	return count;
+}
+
+// --------------------------------------------------------------------------
+// Precision of the storage formats
+
+static volatile double readSink;
+
+// seconds spent summing a buffer of floats, to measure read bandwidth
+static double TimeFloatRead(const vector<float> &values, double *sum)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (size_t i = 0; i < values.size(); i++)
+		*sum += values[i];
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// same for half floats, widened back to floats a block at a time
+static double TimeHalfRead(const vector<unsigned short> &values, double *sum)
+{
+	const int block = 4096;
+	float widened[block];
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (size_t i = 0; i < values.size(); i += block)
+	{
+		int count = (int)min(values.size() - i, (size_t)block);
+		HalfToFloat(&values[i], widened, count);
+		for (int j = 0; j < count; j++)
+			*sum += widened[j];
+	}
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int PrecisionReport(const char *filename)
+{
+	MyImage image;
+	if (!LoadImage(&image, filename))
+	{
+		cout << "Unable to load image: " << filename << endl;
+		return -1;
+	}
+	MyPlanarImage planes;
+	Deinterleave(image, &planes);
+
+	EffectState state;
+	state.edgeEffect = 2;
+	copy(unsharpMask, unsharpMask + 9, state.edge);
+
+	PixelRect all(0, 0, image.width, image.height);
+	int count = image.width * image.height * 4;
+	vector<float> full(count);
+	ApplyEffects(planes, state, all, &full[0]);
+
+	vector<unsigned short> half(count);
+	vector<float> widened(count);
+	FloatToHalf(&full[0], &half[0], count);
+	HalfToFloat(&half[0], &widened[0], count);
+
+	double halfError = 0.0, byteError = 0.0;
+	int outOfRange = 0;
+	for (int i = 0; i < count; i++)
+	{
+		float value = full[i];
+		halfError = max(halfError, (double)fabsf(widened[i] - value));
+		byteError = max(byteError, (double)fabsf(ToByte(value) / 255.f - value));
+		if (value < 0.f || value > 1.f)
+			outOfRange++;
+	}
+
+	double sum = 0.0;
+	double floatTime = TimeFloatRead(full, &sum);
+	double halfTime = TimeHalfRead(half, &sum);
+	double megabytes = count / (1024.0 * 1024.0);
+
+	cout << "Unsharp mask of " << filename << " (" << image.width << "x" << image.height << ", "
+	     << 8 * image.bytesPerComponent << " bits per component)" << endl;
+	cout << "  " << outOfRange << " of " << count << " values fall outside [0,1]" << endl;
+	cout << "  32-bit float: " << megabytes * 4 << " MB, read at "
+	     << megabytes * 4 / 1024.0 / floatTime << " GB/s, exact" << endl;
+	cout << "  16-bit half:  " << megabytes * 2 << " MB, read at "
+	     << megabytes * 2 / 1024.0 / halfTime << " GB/s, max error " << halfError << endl;
+	cout << "  8-bit:        " << megabytes << " MB, max error " << byteError
+	     << " (out of range values clamped)" << endl;
+
+	// keeps the timed loops from being optimized away
+	readSink = sum;
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+// Rank filter against sorting
+
+struct MyRankCase
+{
+	int radius;
+	int percentile;
+	int step;
+};
+
+// value the rank filter should give channel c of texel (x, y): the texels of
+// the window, clamped to the picture like CountRow, partially sorted
+static int SortedRank(const MyPlanarImage &src, const EffectState &state, int c, int x, int y, vector<unsigned char> *window)
+{
+	int r = state.rankRadius;
+	window->clear();
+	for (int wy = y - r; wy <= y + r; wy++)
+	{
+		const float *row = src.Row(c, min(max(wy, 0), src.height - 1));
+		for (int wx = x - r; wx <= x + r; wx++)
+			window->push_back(ToByte(row[min(max(wx, 0), src.width - 1)]));
+	}
+	vector<unsigned char>::iterator picked = window->begin() + RankIndex(state);
+	nth_element(window->begin(), picked, window->end());
+	return *picked;
+}
+
+int RankFilterReport()
+{
+	// several bands of columns and a narrow one at the end, and noise over a
+	// ramp so that the rank moves between coarse bins along the rows
+	MyImage image;
+	image.width = 301;
+	image.height = 97;
+	image.numComponents = 4;
+	image.pixels.resize((size_t)image.width * image.height * 4);
+	srand(1);
+	for (int y = 0; y < image.height; y++)
+		for (int x = 0; x < image.width; x++)
+			for (int c = 0; c < 4; c++)
+				image.pixels[((size_t)y * image.width + x) * 4 + c] = (unsigned char)(x + 2 * y + 40 * c + rand() % 96);
+	MyPlanarImage planes;
+	Deinterleave(image, &planes);
+
+	// previews start away from the corner, so their bands and blocks do not
+	// line up with the picture's
+	const MyRankCase cases[] = {
+		{ 1, 50, 1 }, { 2, 50, 1 }, { 3, 0, 1 }, { 3, 50, 1 }, { 7, 25, 1 }, { 7, 100, 1 },
+		{ 16, 10, 1 }, { 16, 75, 1 }, { 50, 50, 1 }, { 50, 90, 1 }, { 16, 50, 3 }, { 50, 25, 4 }
+	};
+
+	cout << "Rank filter against sorting every window, " << image.width << "x" << image.height << " RGBA" << endl;
+	int failures = 0;
+	vector<unsigned char> window;
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		const MyRankCase &test = cases[i];
+		EffectState state;
+		state.blur = 5;
+		state.rankRadius = test.radius;
+		state.rankPercentile = test.percentile;
+		PixelRect rect = test.step == 1 ? PixelRect(0, 0, image.width, image.height) :
+			PixelRect(17, 5, image.width, image.height);
+
+		vector<float> out((size_t)rect.Width() * rect.Height() * 4);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		ApplyEffects(planes, state, rect, &out[0], test.step);
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		// the wide windows are sorted on every seventh row only, and every
+		// row still goes through the histograms before it
+		int every = test.radius > 7 ? 7 : 1;
+		int checked = 0, differing = 0;
+		for (int y = rect.y0; y < rect.y1; y++)
+		{
+			if ((y - rect.y0) % every != 0 && y != rect.y1 - 1)
+				continue;
+			for (int x = rect.x0; x < rect.x1; x++)
+			{
+				int sx = rect.x0 + (x - rect.x0) / test.step * test.step;
+				int sy = rect.y0 + (y - rect.y0) / test.step * test.step;
+				for (int c = 0; c < 4; c++)
+				{
+					float value = out[((size_t)(y - rect.y0) * rect.Width() + x - rect.x0) * 4 + c];
+					differing += value != SortedRank(planes, state, c, sx, sy, &window) / 255.f;
+					checked++;
+				}
+			}
+		}
+		failures += differing != 0;
+
+		cout << "  radius " << test.radius << ", percentile " << test.percentile;
+		if (test.step > 1)
+			cout << ", preview step " << test.step;
+		cout << ": " << differing << " of " << checked << " values differ, "
+		     << (double)rect.Width() * rect.Height() / 1e6 / seconds << " Mpix/s"
+		     << (differing == 0 ? "" : "  FAILED") << endl;
+	}
+	return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,365 @@
+// ==========================================================================
+// CPU implementation of the fragment.glsl effect stack
+//
+// Mirrors the colourEffect / edgeEffect / blur uniforms of the fragment
+// program so that images can be filtered without a round trip through the
+// GPU, and caches the filtered result in tiles so that only the part of the
+// image that is visible on screen has to be processed.
+// ==========================================================================
+
+#ifndef CPUFILTER_H
+#define CPUFILTER_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+#include "memory.h"
+
+// --------------------------------------------------------------------------
+// Half-float storage
+
+// converts count values between 32-bit floats and IEEE half floats, using
+// the F16C instructions when the processor has them
+void FloatToHalf(const float *in, unsigned short *out, int count);
+void HalfToFloat(const unsigned short *in, float *out, int count);
+
+// filters an image with the unsharp mask, whose signed results do not fit 8
+// bits, and prints the size, read bandwidth and error of storing the result
+// as 32-bit floats, half floats and bytes; returns 0 if successful
+int PrecisionReport(const char *filename);
+
+// --------------------------------------------------------------------------
+// Strips of rows
+
+// one strip of rows per core, at least 32 rows each
+inline int StripCount(int height)
+{
+	int cores = std::max((int)std::thread::hardware_concurrency(), 1);
+	return std::min(cores, std::max(height / 32, 1));
+}
+
+// runs work(y0, y1) for the strips of rows, each on its own thread
+template <class Work>
+void ForEachStrip(int height, Work work)
+{
+	int strips = StripCount(height);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < strips; i++)
+		threads.push_back(std::thread(work, height * i / strips, height * (i + 1) / strips));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+// --------------------------------------------------------------------------
+// Effect parameters, matching the uniforms of fragment.glsl
+
+struct EffectState
+{
+	int colourEffect;
+	int edgeEffect;
+	int blur;
+
+	// edge kernel in row-major order, as handed to glUniformMatrix3fv with
+	// transpose set to GL_TRUE
+	float edge[9];
+
+	// window radius and percentile of the rank filter behind blur level 5
+	int rankRadius;
+	int rankPercentile;
+
+	// spatial sigma in texels and range sigma in intensity of the bilateral
+	// blur behind blur level 4
+	int bilateralSpatial;
+	float bilateralRange;
+
+	EffectState() : colourEffect(0), edgeEffect(0), blur(0), rankRadius(1), rankPercentile(50),
+	                bilateralSpatial(16), bilateralRange(0.1f)
+	{
+		for (int i = 0; i < 9; i++) edge[i] = 0.f;
+	}
+};
+
+// the kernels behind the h, v and u keys; edge effect 3 (the k key) runs the
+// Canny detector instead and ignores the kernel
+extern const float horizontalSobel[9];
+extern const float verticalSobel[9];
+extern const float unsharpMask[9];
+
+// parses the effect options shared by the batch modes:
+//   --colour <0-7>  --blur <0-5>  --edge <h|v|u|c>
+//   --rank <0-100>  --rank-radius <1-50>
+//   --bilateral-spatial <4-64>  --bilateral-range <0.05-0.8>
+// returns true and advances *i past the option if argv[*i] is one of them
+bool ParseEffectOption(int argc, char *argv[], int *i, EffectState *state);
+
+bool operator==(const EffectState &a, const EffectState &b);
+bool operator!=(const EffectState &a, const EffectState &b);
+
+// number of neighbouring texels an effect reads on each side of a texel
+int EffectHalo(const EffectState &state);
+
+// --------------------------------------------------------------------------
+// Histogram behind colour effects 6 and 7
+//
+// Auto levels (colour effect 6) stretches red, green and blue each so that
+// the darkest and the brightest half percent of the picture become black and
+// white. Equalization (colour effect 7) maps all three through the cumulative
+// histogram of the second grey, which spreads the brightness evenly over the
+// whole range. Both need the histogram of the whole picture; every core
+// counts its strip of rows into a histogram of its own and the histograms are
+// added up at the end, so the threads never touch the same counts.
+
+const int histogramBins = 256;
+const int levelsClip = 200;         // auto levels clips 1/levelsClip of the texels at either end
+
+struct MyHistogram
+{
+	// red, green, blue and the second grey of the bytes of the picture, the
+	// grey rounded from (299 r + 587 g + 114 b) / 1000 so that the GPU counts
+	// exactly the same
+	std::vector<unsigned int> counts;   // 4 x histogramBins
+
+	MyHistogram() : counts(4 * histogramBins, 0)
+	{}
+};
+
+struct MyLevels
+{
+	// two rows of histogramBins RGBA texels, laid out like the levels texture
+	// of fragment.glsl: the auto levels curve of each channel, then the
+	// equalization curve in every channel
+	std::vector<float> curves;
+};
+
+// true when the colour effect of state needs the levels, which it does
+// unless an edge effect or a blur replaces it
+bool UsesLevels(const EffectState &state);
+
+// counts the histogram of the picture, a strip of rows per core
+void BuildHistogram(const MyPlanarImage &src, MyHistogram *histogram);
+
+// turns a histogram into the curves of both effects
+void BuildLevels(const MyHistogram &histogram, MyLevels *levels);
+
+// --------------------------------------------------------------------------
+// Bilateral grid behind blur level 4
+//
+// An edge-preserving blur: every texel is splatted into a coarse 3D grid over
+// x, y and intensity, the grid is blurred, and each texel reads its result
+// back by trilinear interpolation at its own position and intensity. Texels
+// on either side of an edge land in different intensity cells and do not mix.
+// The cost is one splat and one lookup per texel plus blurring the small
+// grid, so it hardly depends on the spatial radius. The grid is blurred with
+// a Gaussian one cell wide, so a cell is one sigma across: bilateralSpatial
+// texels along x and y and bilateralRange of intensity.
+
+const int minBilateralSpatial = 4;      // smaller cells make the grid too big
+const int maxBilateralSpatial = 64;
+const float minBilateralRange = 0.05f;
+const float maxBilateralRange = 0.8f;
+const int bilateralPad = 2;             // empty cells around the picture for the blur
+
+struct MyBilateralGrid
+{
+	int width;
+	int height;
+	int depth;
+	int spatial;            // texels per cell along x and y
+	float range;            // intensity per cell
+
+	// summed RGB and number of texels per cell, x varying fastest, then y
+	std::vector<float> cells;
+
+	MyBilateralGrid() : width(0), height(0), depth(0), spatial(0), range(0.f)
+	{}
+};
+
+// cells the grid of a picture of the given size needs along each axis, for
+// cells of the given texels and intensity
+void BilateralGridSize(int width, int height, int spatial, float range,
+                       int *gridWidth, int *gridHeight, int *gridDepth);
+
+// splats the picture into the grid with the sigmas of state and blurs it
+void BuildBilateralGrid(const MyPlanarImage &src, const EffectState &state, MyBilateralGrid *grid);
+
+// --------------------------------------------------------------------------
+// Canny edge detector behind edge effect 3
+//
+// The second grey of the picture is smoothed with the 0.2 0.6 0.2 kernel of
+// blur level 1 and run through the h and v Sobel kernels in the same pass,
+// giving the gradient magnitude together with its orientation, rounded to
+// one of four directions. Texels that are not the largest along their
+// gradient are suppressed, the rest are weak above cannyLow and strong above
+// cannyHigh, and a weak texel is kept only when it is connected to a strong
+// one (hysteresis). Connectivity is global, so like the bilateral grid the
+// result is computed for the whole picture at once.
+
+const float cannyLow = 0.05f;   // gradient magnitude, a black to white step is 1
+const float cannyHigh = 0.15f;
+
+struct MyCannyEdges
+{
+	int width;
+	int height;
+
+	// 1 on an edge and 0 elsewhere, x varying fastest, rows bottom-up; between
+	// the two steps below 0 suppressed, 1 weak and 2 strong
+	std::vector<unsigned char> edges;
+
+	MyCannyEdges() : width(0), height(0)
+	{}
+};
+
+// finds the edges of the picture, on a strip of rows per core
+void BuildCannyEdges(const MyPlanarImage &src, MyCannyEdges *canny);
+
+// the two steps of BuildCannyEdges: the gradient, suppression and thresholds,
+// then the hysteresis, which labels each strip with union-find and joins the
+// labels across the strip boundaries. The GPU computes the first step itself
+// and hands its result to the second
+void ClassifyCannyEdges(const MyPlanarImage &src, MyCannyEdges *canny);
+void TraceCannyEdges(MyCannyEdges *canny);
+
+// --------------------------------------------------------------------------
+// Rank filters behind blur level 5
+//
+// Every channel of every texel is replaced by the rankPercentile-th
+// percentile of the (2 rankRadius + 1)^2 texels around it: 0 is the darkest
+// texel, 50 the median, which removes salt and pepper noise without blurring
+// edges, and 100 the brightest. The CPU quantizes to 8 bits and keeps a
+// histogram of every column of the window, moving down a row by adding the
+// texel that enters each column and removing the one that leaves it, and
+// moving along a row by adding the column that enters the window and
+// subtracting the one that leaves it (Perreault and Hebert). The histograms
+// have 16 coarse bins over 256 fine ones, and the fine bins of the window are
+// only brought up to date for the coarse bin the rank falls in, so the cost
+// per texel does not depend on the radius. The fragment program sorts the
+// window with a sorting network instead, which is only affordable for the
+// smallest windows; wider ones are filtered on the CPU on either path.
+
+const int maxRankRadius = 50;
+const int maxNetworkRankRadius = 2;     // widest window fragment.glsl sorts
+
+// position in the sorted window of the texel the rank filter picks
+int RankIndex(const EffectState &state);
+
+// true when the rank filter of state is too wide for fragment.glsl
+bool RanksOnCpu(const EffectState &state);
+
+// filters an image with a range of radii and percentiles, also as previews,
+// and compares every texel with sorting its window; prints the speeds and
+// returns 0 if all of them match
+int RankFilterReport();
+
+// --------------------------------------------------------------------------
+// Filtering
+
+// half-open texel rectangle [x0, x1) x [y0, y1)
+struct PixelRect
+{
+	int x0, y0, x1, y1;
+
+	PixelRect() : x0(0), y0(0), x1(0), y1(0)
+	{}
+	PixelRect(int left, int bottom, int right, int top)
+		: x0(left), y0(bottom), x1(right), y1(top)
+	{}
+
+	int Width() const { return x1 - x0; }
+	int Height() const { return y1 - y0; }
+	bool Empty() const { return x1 <= x0 || y1 <= y0; }
+};
+
+// runs the effect stack over the texels in rect, writing tightly packed RGBA
+// float rows of rect.Width() texels to out, without clamping so that signed
+// edge responses survive; texels outside the image are clamped to the edge
+// like GL_CLAMP_TO_EDGE. With step > 1 only every step-th row and column is
+// evaluated and held over its step x step block, for previews. The bilateral
+// blur reads grid, the Canny detector reads canny and auto levels and
+// equalization read levels, which are built from the whole of src when not
+// given.
+void ApplyEffects(const MyPlanarImage &src, const EffectState &state,
+                  const PixelRect &rect, float *out, int step = 1,
+                  const MyBilateralGrid *grid = nullptr,
+                  const MyCannyEdges *canny = nullptr,
+                  const MyLevels *levels = nullptr);
+
+// runs the effect stack over the whole of src into dst, a strip of rows per
+// core; dst gets the size of src and replicated borders
+void FilterImage(const MyPlanarImage &src, const EffectState &state, MyPlanarImage *dst);
+
+// --------------------------------------------------------------------------
+// Tile cache of filtered texels
+
+struct MyTile
+{
+	PixelRect rect;
+	int step;                           // 1 once filtered at full quality
+	std::vector<unsigned short> pixels; // RGBA half floats, rect.Width() per row
+	unsigned long lastUse;              // UpdateTiles() call that last needed it
+
+	MyTile() : step(1), lastUse(0)
+	{}
+};
+
+struct MyTileCache
+{
+	int tileSize;
+
+	// the image and effects the cached tiles were filtered with
+	std::string imageName;
+	EffectState state;
+
+	std::map<std::pair<int, int>, MyTile> tiles;
+	unsigned long clock;                // UpdateTiles() calls so far
+
+	// built on first use for the bilateral blur, the Canny detector and the
+	// levels, which are not local
+	MyBilateralGrid grid;
+	MyCannyEdges canny;
+	MyLevels levels;
+
+	// host bytes of the tiles, and of the grid, the edges and the levels
+	MyMemoryCount tileBytes;
+	MyMemoryCount builtBytes;
+
+	MyTileCache() : tileSize(128), clock(0),
+		tileBytes(hostMemory, tileMemory), builtBytes(hostMemory, intermediateMemory)
+	{}
+};
+
+// discards every cached tile, the bilateral grid, the Canny edges and the
+// levels
+void ClearTiles(MyTileCache *cache);
+
+// discards the least recently used tiles that the last UpdateTiles() call
+// did not need until at least bytes are released, and returns the bytes
+// released; tiles on screen are kept so that they are not filtered again
+// every frame, unless keepVisible is false because nothing shows them
+long long EvictTiles(MyTileCache *cache, long long bytes, bool keepVisible = true);
+
+// discards the Canny edges, the bilateral grid and the levels, largest first,
+// until at least bytes are released, and returns the bytes released. They are
+// built again with the next tile that needs them, so nothing is discarded
+// while tiles on screen still wait to be refined
+long long EvictBuiltEffects(MyTileCache *cache, long long bytes);
+
+// makes sure every tile overlapping visible is filtered, computing only the
+// tiles that are not cached yet; the newly filtered tiles are appended to
+// fresh so the caller can upload them, and their number is returned. Room
+// for the new tiles is reserved first, which may evict older ones.
+//
+// With previewStep > 1 tiles are filtered at full quality only until budget
+// seconds have been spent, the rest are filtered at previewStep and left to
+// be refined by a later call with previewStep == 1.
+int UpdateTiles(MyTileCache *cache, const std::string &imageName,
+                const MyPlanarImage &src, const EffectState &state,
+                const PixelRect &visible, std::vector<const MyTile *> *fresh,
+                int previewStep = 1, double budget = 0.0);
+
+#endif
@@ -0,0 +1,562 @@
+// ==========================================================================
+// Fixed-point filters for 8-bit images
+// ==========================================================================
+
+#include "fixedpoint.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_DISPATCH
+#endif
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Fixed-point planes
+
+// texels of an 8-bit image as 16-bit lanes holding 0..255, one plane per
+// channel, with a replicated border like MyPlanarImage
+struct MyFixedPlanes
+{
+	int width;
+	int height;
+	int stride;     // shorts from one row to the next, a multiple of 8
+
+	std::vector<short, AlignedAllocator<short> > storage;
+
+	MyFixedPlanes() : width(0), height(0), stride(0)
+	{}
+
+	// texel 0 of row y of channel c, with y clamped to the image
+	short *Row(int c, int y)
+	{
+		y = y < 0 ? 0 : y >= height ? height - 1 : y;
+		return &storage[((size_t)c * height + y) * stride + planarBorder];
+	}
+	const short *Row(int c, int y) const
+	{
+		y = y < 0 ? 0 : y >= height ? height - 1 : y;
+		return &storage[((size_t)c * height + y) * stride + planarBorder];
+	}
+};
+
+// set by FixedPointReport() to compare the vector code with the fallback
+static bool forceScalar = false;
+
+#ifdef HAVE_SSSE3_DISPATCH
+static bool HasSSSE3()
+{
+	static const bool supported = __builtin_cpu_supports("ssse3");
+	return supported;
+}
+#endif
+
+#ifdef __SSE2__
+// splits eight RGBA8 texels, four in each register, into the planes
+static inline void StoreWidened(__m128i a, __m128i b, short *const planes[4], int x, bool opaque)
+{
+	// three rounds of byte interleaving gather each channel
+	__m128i t0 = _mm_unpacklo_epi8(a, b), t1 = _mm_unpackhi_epi8(a, b);
+	__m128i u0 = _mm_unpacklo_epi8(t0, t1), u1 = _mm_unpackhi_epi8(t0, t1);
+	__m128i rg = _mm_unpacklo_epi8(u0, u1), ba = _mm_unpackhi_epi8(u0, u1);
+
+	const __m128i zero = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i *)(planes[0] + x), _mm_unpacklo_epi8(rg, zero));
+	_mm_storeu_si128((__m128i *)(planes[1] + x), _mm_unpackhi_epi8(rg, zero));
+	_mm_storeu_si128((__m128i *)(planes[2] + x), _mm_unpacklo_epi8(ba, zero));
+	_mm_storeu_si128((__m128i *)(planes[3] + x), opaque ? _mm_set1_epi16(255) : _mm_unpackhi_epi8(ba, zero));
+}
+
+// returns the number of texels widened, a multiple of 8
+static int WidenRGBA8(const unsigned char *in, int count, short *const planes[4])
+{
+	int x = 0;
+	for (; x + 8 <= count; x += 8)
+		StoreWidened(_mm_loadu_si128((const __m128i *)(in + x * 4)),
+		             _mm_loadu_si128((const __m128i *)(in + x * 4 + 16)), planes, x, false);
+	return x;
+}
+#endif
+
+#ifdef HAVE_SSSE3_DISPATCH
+// spreads RGB8 to RGBA8 with a byte shuffle first; the second load reads 4
+// bytes past the 24 it uses, so it stops while that still fits in the row
+__attribute__((target("ssse3")))
+static int WidenRGB8(const unsigned char *in, int count, short *const planes[4])
+{
+	const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	int x = 0;
+	for (; (x + 8) * 3 + 4 <= count * 3; x += 8)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + x * 3)), spread);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + x * 3 + 12)), spread);
+		StoreWidened(a, b, planes, x, true);
+	}
+	return x;
+}
+#endif
+
+// spreads grey images over RGB and gives images without alpha an opaque one,
+// the same as Deinterleave()
+static void Widen(const MyImage &src, MyFixedPlanes *dst)
+{
+	dst->width = src.width;
+	dst->height = src.height;
+	dst->stride = (src.width + 2 * planarBorder + 7) / 8 * 8;
+	dst->storage.assign((size_t)dst->stride * src.height * 4, 0);
+
+	int n = src.numComponents;
+	int g = n >= 3 ? 1 : 0;
+	int b = n >= 3 ? 2 : 0;
+	int a = n == 2 ? 1 : n == 4 ? 3 : -1;
+	int right = dst->stride - planarBorder - src.width;
+	for (int y = 0; y < src.height; y++)
+	{
+		const unsigned char *in = &src.pixels[(size_t)y * src.width * n];
+		short *const planes[4] = { dst->Row(0, y), dst->Row(1, y), dst->Row(2, y), dst->Row(3, y) };
+		int x = 0;
+#ifdef __SSE2__
+		if (n == 4 && !forceScalar)
+			x = WidenRGBA8(in, src.width, planes);
+#endif
+#ifdef HAVE_SSSE3_DISPATCH
+		if (n == 3 && !forceScalar && HasSSSE3())
+			x = WidenRGB8(in, src.width, planes);
+#endif
+		for (; x < src.width; x++)
+		{
+			const unsigned char *p = in + x * n;
+			planes[0][x] = p[0];
+			planes[1][x] = p[g];
+			planes[2][x] = p[b];
+			planes[3][x] = a >= 0 ? p[a] : 255;
+		}
+		for (int c = 0; c < 4; c++)
+		{
+			fill(planes[c] - planarBorder, planes[c], planes[c][0]);
+			fill(planes[c] + src.width, planes[c] + src.width + right, planes[c][src.width - 1]);
+		}
+	}
+}
+
+// interleaves count texels of byte planes into 3 or 4 components per texel
+static void InterleaveBytes(const unsigned char *const planes[4], int count, int numComponents, unsigned char *out)
+{
+	int x = 0;
+#ifdef __SSE2__
+	if (numComponents == 4 && !forceScalar)
+	{
+		for (; x + 8 <= count; x += 8)
+		{
+			__m128i rg = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(planes[0] + x)),
+			                               _mm_loadl_epi64((const __m128i *)(planes[1] + x)));
+			__m128i ba = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(planes[2] + x)),
+			                               _mm_loadl_epi64((const __m128i *)(planes[3] + x)));
+			_mm_storeu_si128((__m128i *)(out + x * 4), _mm_unpacklo_epi16(rg, ba));
+			_mm_storeu_si128((__m128i *)(out + x * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+		}
+	}
+#endif
+	for (; x < count; x++)
+		for (int c = 0; c < numComponents; c++)
+			out[x * numComponents + c] = planes[c][x];
+}
+
+// --------------------------------------------------------------------------
+// Row operations on 16-bit lanes
+
+// a weight in Q15, every weight used here is below 1
+static short Q15(float w)
+{
+	return (short)lrintf(w * 32768.f);
+}
+
+// rounds like pmulhrsw
+static inline short MulHRS(int a, int b)
+{
+	return (short)((a * b + 0x4000) >> 15);
+}
+
+#ifdef HAVE_SSSE3_DISPATCH
+__attribute__((target("ssse3")))
+static int MulRowQ15SSSE3(short *out, const short *in, short w, int shift, bool add, int count)
+{
+	__m128i weight = _mm_set1_epi16(w);
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	int x = 0;
+	for (; x + 8 <= count; x += 8)
+	{
+		__m128i v = _mm_sll_epi16(_mm_loadu_si128((const __m128i *)(in + x)), bits);
+		v = _mm_mulhrs_epi16(v, weight);
+		if (add)
+			v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i *)(out + x)));
+		_mm_storeu_si128((__m128i *)(out + x), v);
+	}
+	return x;
+}
+#endif
+
+// out[x] = w * (in[x] << shift), or out[x] += that, with w in Q15
+static void MulRowQ15(short *out, const short *in, short w, int shift, bool add, int count)
+{
+	int x = 0;
+#ifdef HAVE_SSSE3_DISPATCH
+	if (!forceScalar && HasSSSE3())
+		x = MulRowQ15SSSE3(out, in, w, shift, add, count);
+#endif
+	for (; x < count; x++)
+	{
+		short v = MulHRS(in[x] << shift, w);
+		out[x] = add ? (short)(out[x] + v) : v;
+	}
+}
+
+// out[x] += w * in[x] for whole weights
+static void MulAddRowInt(short *out, const short *in, short w, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	if (!forceScalar)
+	{
+		__m128i weight = _mm_set1_epi16(w);
+		for (; x + 8 <= count; x += 8)
+		{
+			__m128i v = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(in + x)), weight);
+			_mm_storeu_si128((__m128i *)(out + x), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(out + x)), v));
+		}
+	}
+#endif
+	for (; x < count; x++)
+		out[x] += w * in[x];
+}
+
+// row[x] = |row[x]|
+static void AbsRowInt(short *row, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	if (!forceScalar)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		for (; x + 8 <= count; x += 8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+			_mm_storeu_si128((__m128i *)(row + x), _mm_max_epi16(v, _mm_sub_epi16(zero, v)));
+		}
+	}
+#endif
+	for (; x < count; x++)
+		row[x] = row[x] < 0 ? -row[x] : row[x];
+}
+
+// rounds away the fraction bits and clamps to bytes
+static void NarrowRow(const short *in, int shift, int count, unsigned char *out)
+{
+	int x = 0;
+	short round = shift ? 1 << (shift - 1) : 0;
+#ifdef __SSE2__
+	if (!forceScalar)
+	{
+		__m128i bias = _mm_set1_epi16(round);
+		__m128i bits = _mm_cvtsi32_si128(shift);
+		for (; x + 8 <= count; x += 8)
+		{
+			__m128i v = _mm_sra_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(in + x)), bias), bits);
+			_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(v, v));
+		}
+	}
+#endif
+	for (; x < count; x++)
+	{
+		int v = (in[x] + round) >> shift;
+		out[x] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+	}
+}
+
+// --------------------------------------------------------------------------
+// Effect stack
+
+// fraction bits of the texels the Q15 kernels work on; with 6 bits even
+// sepia, whose red weights add up to 1.35, stays below 32768
+const int fractionBits = 6;
+
+// edge kernels run exactly in 16 bits when their weights are whole and
+// their magnitudes add up to at most 128
+static bool IntegerKernel(const float edge[9])
+{
+	float total = 0.f;
+	for (int i = 0; i < 9; i++)
+	{
+		if (edge[i] != floorf(edge[i]))
+			return false;
+		total += fabsf(edge[i]);
+	}
+	return total <= 128.f;
+}
+
+bool FixedSupported(const EffectState &state)
+{
+	if (state.blur == 4 || state.blur == 5 || UsesLevels(state))
+		return false;
+	if (state.blur >= 1 && state.blur <= 3)
+		return true;
+	if (state.edgeEffect == 1 || state.edgeEffect == 2)
+		return IntegerKernel(state.edge);
+	return state.edgeEffect != 3;
+}
+
+// evaluates the fragment program for row y into out, returning the number of
+// fraction bits the results carry
+static int FilterRowFixed(const MyFixedPlanes &src, const EffectState &state, int y,
+                          short *const out[4], short *scratch)
+{
+	int width = src.width;
+	const short *in[4];
+	for (int c = 0; c < 4; c++)
+		in[c] = src.Row(c, y);
+
+	if (state.blur >= 1 && state.blur <= 3)
+	{
+		// same weights as the gaussRow arrays of fragment.glsl
+		static const float rows[3][7] = {
+			{ 0.2f, 0.6f, 0.2f },
+			{ 0.06f, 0.24f, 0.4f, 0.24f, 0.06f },
+			{ 0.004f, 0.054f, 0.242f, 0.4f, 0.242f, 0.054f, 0.004f }
+		};
+		int r = state.blur;
+		short weights[7];
+		for (int i = 0; i <= 2 * r; i++)
+			weights[i] = Q15(rows[r - 1][i]);
+
+		// vertical pass into scratch, horizontal pass over it
+		int span = width + 2 * r;
+		for (int c = 0; c < 4; c++)
+		{
+			for (int i = 0; i <= 2 * r; i++)
+				MulRowQ15(scratch, src.Row(c, y - r + i) - r, weights[i], fractionBits, i > 0, span);
+			for (int i = 0; i <= 2 * r; i++)
+				MulRowQ15(out[c], scratch + i, weights[i], 0, i > 0, width);
+		}
+		return fractionBits;
+	}
+
+	if (state.edgeEffect == 1 || state.edgeEffect == 2)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			fill(out[c], out[c] + width, 0);
+
+			// edge[h][k] in the shader weighs the texel k-1 across, 1-h up
+			for (int k = 0; k < 3; k++)
+				for (int h = 0; h < 3; h++)
+					if (state.edge[k * 3 + h] != 0.f)
+						MulAddRowInt(out[c], src.Row(c, y + 1 - h) + k - 1, (short)state.edge[k * 3 + h], width);
+
+			if (state.edgeEffect == 1)
+				AbsRowInt(out[c], width);
+		}
+		return 0;
+	}
+
+	const int bits = fractionBits;
+	switch (state.colourEffect)
+	{
+	case 1:
+	case 2:
+	case 3:
+	{
+		static const float greys[3][3] = {
+			{ 0.333f, 0.333f, 0.333f }, { 0.299f, 0.587f, 0.114f }, { 0.213f, 0.715f, 0.072f }
+		};
+		const float *w = greys[state.colourEffect - 1];
+		MulRowQ15(out[0], in[0], Q15(w[0]), bits, false, width);
+		MulRowQ15(out[0], in[1], Q15(w[1]), bits, true, width);
+		MulRowQ15(out[0], in[2], Q15(w[2]), bits, true, width);
+		copy(out[0], out[0] + width, out[1]);
+		copy(out[0], out[0] + width, out[2]);
+		break;
+	}
+	case 4:
+		// each channel uses the already updated ones, like the shader does
+		MulRowQ15(out[0], in[0], Q15(0.393f), bits, false, width);
+		MulRowQ15(out[0], in[1], Q15(0.769f), bits, true, width);
+		MulRowQ15(out[0], in[2], Q15(0.189f), bits, true, width);
+		MulRowQ15(out[1], out[0], Q15(0.349f), 0, false, width);
+		MulRowQ15(out[1], in[1], Q15(0.686f), bits, true, width);
+		MulRowQ15(out[1], in[2], Q15(0.168f), bits, true, width);
+		MulRowQ15(out[2], out[0], Q15(0.272f), 0, false, width);
+		MulRowQ15(out[2], out[1], Q15(0.534f), 0, true, width);
+		MulRowQ15(out[2], in[2], Q15(0.131f), bits, true, width);
+		break;
+	case 5:
+		for (int c = 0; c < 3; c++)
+			for (int x = 0; x < width; x++)
+				out[c][x] = 255 - in[c][x];
+		copy(in[3], in[3] + width, out[3]);
+		return 0;
+	default:
+		for (int c = 0; c < 4; c++)
+			copy(in[c], in[c] + width, out[c]);
+		return 0;
+	}
+	for (int x = 0; x < width; x++)
+		out[3][x] = in[3][x] << bits;
+	return bits;
+}
+
+bool ApplyEffectsFixed(const MyImage &src, const EffectState &state, MyImage *dst)
+{
+	if (src.bytesPerComponent != 1 || src.width <= 0 || src.height <= 0 || !FixedSupported(state))
+		return false;
+
+	MyFixedPlanes planes;
+	Widen(src, &planes);
+
+	int width = src.width;
+	int numComponents = src.numComponents % 2 == 0 ? 4 : 3;
+	dst->width = width;
+	dst->height = src.height;
+	dst->numComponents = numComponents;
+	dst->bytesPerComponent = 1;
+	dst->pixels.resize((size_t)width * src.height * numComponents);
+
+	vector<short> rows(4 * width), scratch(width + 2 * planarBorder);
+	short *const out[4] = { &rows[0], &rows[width], &rows[2 * width], &rows[3 * width] };
+	vector<unsigned char> bytes(4 * width);
+	const unsigned char *const narrowed[4] = { &bytes[0], &bytes[width], &bytes[2 * width], &bytes[3 * width] };
+	for (int y = 0; y < src.height; y++)
+	{
+		int bits = FilterRowFixed(planes, state, y, out, &scratch[0]);
+		for (int c = 0; c < numComponents; c++)
+			NarrowRow(out[c], bits, width, &bytes[c * width]);
+		InterleaveBytes(narrowed, width, numComponents, &dst->pixels[(size_t)y * width * numComponents]);
+	}
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Error bounds
+
+struct MyFixedCase
+{
+	const char *name;
+	EffectState state;
+	double bound;       // of the error before the final rounding, in levels
+};
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int FixedPointReport()
+{
+	// odd sizes so the scalar tails of the vector loops get exercised
+	MyImage image;
+	image.width = 509;
+	image.height = 331;
+	image.numComponents = 4;
+	image.pixels.resize((size_t)image.width * image.height * 4);
+	srand(1);
+	for (size_t i = 0; i < image.pixels.size(); i++)
+		image.pixels[i] = (unsigned char)(rand() & 255);
+
+	MyPlanarImage floatPlanes;
+	Deinterleave(image, &floatPlanes);
+	MyFixedPlanes fixedPlanes;
+	Widen(image, &fixedPlanes);
+
+	vector<MyFixedCase> cases;
+	const char *colourNames[5] = { "grey 1", "grey 2", "grey 3", "sepia", "invert" };
+	const double colourBounds[5] = { 0.05, 0.05, 0.05, 0.1, 0.0 };
+	for (int i = 0; i < 5; i++)
+	{
+		MyFixedCase test = { colourNames[i], EffectState(), colourBounds[i] };
+		test.state.colourEffect = i + 1;
+		cases.push_back(test);
+	}
+	const char *edgeNames[4] = { "horizontal Sobel", "vertical Sobel", "unsharp mask", "|unsharp mask|" };
+	const float *kernels[4] = { horizontalSobel, verticalSobel, unsharpMask, unsharpMask };
+	for (int i = 0; i < 4; i++)
+	{
+		MyFixedCase test = { edgeNames[i], EffectState(), 0.0 };
+		test.state.edgeEffect = i == 2 ? 2 : 1;
+		copy(kernels[i], kernels[i] + 9, test.state.edge);
+		cases.push_back(test);
+	}
+	const char *blurNames[3] = { "3x3 Gaussian", "5x5 Gaussian", "7x7 Gaussian" };
+	for (int i = 0; i < 3; i++)
+	{
+		MyFixedCase test = { blurNames[i], EffectState(), 0.2 };
+		test.state.blur = i + 1;
+		cases.push_back(test);
+	}
+
+	int width = image.width;
+	vector<float> reference((size_t)width * image.height * 4);
+	vector<unsigned char> quantized((size_t)width * image.height * 4);
+	vector<short> rows(4 * width), scratch(width + 2 * planarBorder);
+	short *const out[4] = { &rows[0], &rows[width], &rows[2 * width], &rows[3 * width] };
+	double texels = (double)width * image.height;
+
+	cout << "Fixed-point kernels against the float path, " << width << "x" << image.height << " random RGBA" << endl;
+	int failures = 0;
+	for (size_t i = 0; i < cases.size(); i++)
+	{
+		const MyFixedCase &test = cases[i];
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		ApplyEffects(floatPlanes, test.state, PixelRect(0, 0, width, image.height), &reference[0]);
+		QuantizeRGBA(&reference[0], (int)texels, 4, &quantized[0]);
+		double floatTime = Seconds(start);
+
+		MyImage fixed, scalar;
+		start = chrono::steady_clock::now();
+		ApplyEffectsFixed(image, test.state, &fixed);
+		double fixedTime = Seconds(start);
+		forceScalar = true;
+		ApplyEffectsFixed(image, test.state, &scalar);
+		forceScalar = false;
+
+		// error before rounding, against the exact values clamped to the
+		// range the bytes can hold
+		double error = 0.0;
+		for (int y = 0; y < image.height; y++)
+		{
+			int bits = FilterRowFixed(fixedPlanes, test.state, y, out, &scratch[0]);
+			for (int x = 0; x < width; x++)
+				for (int c = 0; c < 4; c++)
+				{
+					double exact = min(max(reference[((size_t)y * width + x) * 4 + c] * 255.0, 0.0), 255.0);
+					double value = min(max(out[c][x] / (double)(1 << bits), 0.0), 255.0);
+					error = max(error, fabs(value - exact));
+				}
+		}
+
+		int differing = 0, largest = 0;
+		for (size_t j = 0; j < quantized.size(); j++)
+		{
+			int difference = abs((int)fixed.pixels[j] - (int)quantized[j]);
+			differing += difference != 0;
+			largest = max(largest, difference);
+		}
+		bool identical = fixed.pixels == scalar.pixels;
+		bool passed = error <= test.bound + 1e-3 && largest <= (test.bound > 0.0 ? 1 : 0) && identical;
+		failures += !passed;
+
+		cout << "  " << test.name << ": error " << error << " of a level (bound " << test.bound << "), "
+		     << differing << " bytes off by up to " << largest << ", "
+		     << (identical ? "scalar identical" : "scalar DIFFERS") << ", "
+		     << texels / 1e6 / fixedTime << " Mpix/s vs " << texels / 1e6 / floatTime << " Mpix/s float"
+		     << (passed ? "" : "  FAILED") << endl;
+	}
+	return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,49 @@
+// ==========================================================================
+// Fixed-point filters for 8-bit images
+//
+// When an 8-bit image is filtered straight back to 8 bits there is no need
+// to widen every texel to a float. These kernels keep each channel in a
+// 16-bit lane, so a vector register holds eight texels instead of four, and
+// evaluate the effect stack with integer arithmetic:
+//
+//   - the greys, sepia and the Gaussians multiply texels held as value * 64
+//     by weights in Q15 with pmulhrsw, which rounds every product
+//   - the Sobel and unsharp kernels have integer weights and are exact
+//
+// Error bounds against the float path (ApplyEffects then QuantizeRGBA):
+//
+//   - Sobel, unsharp, inversion: identical results
+//   - everything else: each rounded product is off by at most 1/128 of a
+//     level and each Q15 weight by 2^-16, so before the final rounding the
+//     fixed-point value is within 0.05 of a level of the exact one for the
+//     greys (3 products), 0.1 for sepia (9, partly chained) and 0.2 for the
+//     Gaussians (up to 14). The output then differs from the float path by
+//     at most one level, and only where the exact value lies that close to
+//     a rounding boundary
+//
+// The vector code uses SSSE3 when the processor has it; the scalar fallback
+// rounds the same way, so both give bit-identical results. --fixed-check
+// verifies all of the above.
+// ==========================================================================
+
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include "cpufilter.h"
+
+// filters an 8-bit image into an 8-bit image with 3 components, or 4 when
+// the source has alpha; returns false, leaving dst alone, when the source is
+// 16-bit or an effect is not covered (the bilateral blur, the Canny detector,
+// or edge kernels that are not small integers), so the caller can use the
+// float path
+bool ApplyEffectsFixed(const MyImage &src, const EffectState &state, MyImage *dst);
+
+// true when the fixed-point kernels cover the effects of state
+bool FixedSupported(const EffectState &state);
+
+// compares every fixed-point kernel with the float path and with the scalar
+// fallback on a random image, and prints the errors and speeds; returns 0 if
+// every kernel is within its bound
+int FixedPointReport();
+
+#endif
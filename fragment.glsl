@@ -17,15 +17,98 @@ out vec4 FragmentColour;
 
 //Our texture to read from
 uniform sampler2DRect tex;
-uniform int colourEffect;
-uniform mat3 edge;
-uniform int edgeEffect;
 
-uniform int blur;
+//every effect parameter, filled by UploadEffects() in one go
+layout(std140) uniform Effects
+{
+  mat3 edge;
+  int colourEffect;
+  int edgeEffect;
+  int blur;
+  int cpuFiltered;        //set when tex already holds the picture filtered on the CPU
+  vec3 gridScale;         //cells per texel along x and y, per intensity along z
+  int gridPad;
+  int rankRadius;         //rank filter window, 2*rankRadius+1 texels across
+  int rankIndex;          //texel of the sorted window the rank filter picks
+};
+
+//edges of the picture found by the Canny passes, see canny_gradient.glsl
+uniform sampler2DRect canny;
+
+//blurred bilateral grid of the picture, see bilateral_splat.glsl
+uniform sampler3D grid;
+
+//curves of auto levels in row 0 and equalization in row 1, indexed by the
+//byte of each channel, see levels_curves.glsl
+uniform sampler2DRect levels;
 //uniform mat3 blur1;
 //uniform mat5 blur2;
 //uniform mat7 blur3;
 
+//Rank filter, sorts the window around coords with Batcher's odd-even merge
+//network, which min/max sorts every channel on its own, and picks the
+//rankIndex-th texel; the window size is a constant so that the network
+//unrolls, and windows wider than 5x5 are filtered on the CPU
+vec4 Rank3x3(vec2 coords)
+{
+  const int side = 3;
+  const int n = side*side;
+  vec4 v[n];
+  for(int i=0;i<n;i++)
+  {
+    v[i] = texture(tex, coords + vec2(i%side-side/2, i/side-side/2));
+  }
+  for(int p=1;p<n;p*=2)
+  {
+    for(int k=p;k>=1;k/=2)
+    {
+      for(int j=k%p;j+k<n;j+=2*k)
+      {
+        for(int i=0;i<min(k,n-j-k);i++)
+        {
+          if((i+j)/(2*p)==(i+j+k)/(2*p))
+          {
+            vec4 a = v[i+j];
+            v[i+j] = min(a, v[i+j+k]);
+            v[i+j+k] = max(a, v[i+j+k]);
+          }
+        }
+      }
+    }
+  }
+  return v[rankIndex];
+}
+
+vec4 Rank5x5(vec2 coords)
+{
+  const int side = 5;
+  const int n = side*side;
+  vec4 v[n];
+  for(int i=0;i<n;i++)
+  {
+    v[i] = texture(tex, coords + vec2(i%side-side/2, i/side-side/2));
+  }
+  for(int p=1;p<n;p*=2)
+  {
+    for(int k=p;k>=1;k/=2)
+    {
+      for(int j=k%p;j+k<n;j+=2*k)
+      {
+        for(int i=0;i<min(k,n-j-k);i++)
+        {
+          if((i+j)/(2*p)==(i+j+k)/(2*p))
+          {
+            vec4 a = v[i+j];
+            v[i+j] = min(a, v[i+j+k]);
+            v[i+j+k] = max(a, v[i+j+k]);
+          }
+        }
+      }
+    }
+  }
+  return v[rankIndex];
+}
+
 
 void main(void)
 {
@@ -36,6 +119,12 @@ void main(void)
     newCoords.y = res * (int(textureCoords.y)/res);
     vec4 colour = texture(tex, newCoords);          //Current Coordinates
 
+    if(cpuFiltered==1)
+    {
+      FragmentColour = colour;
+      return;
+    }
+
 
 	//Colour Effects
     if(colourEffect==1)
@@ -71,6 +160,14 @@ void main(void)
       colour.g = 1-colour.g;
       colour.b = 1-colour.b;
     }
+    else if((colourEffect==6)||(colourEffect==7))   //Auto levels, equalization
+    {
+      int row = colourEffect - 6;
+      ivec3 bins = ivec3(clamp(colour.rgb, 0.0, 1.0)*255.0 + 0.5);
+      colour.r = texelFetch(levels, ivec2(bins.r, row)).r;
+      colour.g = texelFetch(levels, ivec2(bins.g, row)).g;
+      colour.b = texelFetch(levels, ivec2(bins.b, row)).b;
+    }
 
 
     if((edgeEffect==1)||(edgeEffect==2))
@@ -104,6 +201,11 @@ void main(void)
         colour = finalPixel;
       }
     }
+    else if(edgeEffect==3)  //Canny, the edges hold the byte 1
+    {
+      float edgeTexel = texture(canny, newCoords).r > 0.0 ? 1.0 : 0.0;
+      colour = vec4(edgeTexel, edgeTexel, edgeTexel, texture(tex, newCoords).a);
+    }
 
 
 
@@ -183,5 +285,19 @@ void main(void)
   colour = finalPixel;
   }
 
+	else if(blur==4)  //Bilateral grid, keeps the edges
+	{
+    vec4 texel = texture(tex, newCoords);
+    float L = clamp(dot(texel.rgb, vec3(0.299, 0.587, 0.114)), 0.0, 1.0);
+    vec3 cell = vec3(newCoords, L) * gridScale + vec3(gridPad) + 0.5;
+    vec4 sum = texture(grid, cell / vec3(textureSize(grid, 0)));
+    colour = vec4(sum.rgb / max(sum.a, 1e-6), texel.a);
+  }
+
+	else if(blur==5)  //Rank filter, the median by default
+	{
+    colour = rankRadius==1 ? Rank3x3(newCoords) : Rank5x5(newCoords);
+  }
+
   FragmentColour = vec4(colour);
 }
@@ -0,0 +1,248 @@
+// ==========================================================================
+// Image storage for the CPU path
+// ==========================================================================
+
+#include "image.h"
+
+#include <algorithm>
+
+#include <stb_image.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_DISPATCH
+#endif
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Decoded image data
+
+bool LoadImage(MyImage *image, const char *filename)
+{
+	int numComponents;
+	int bytesPerComponent = stbi_is_16_bit(filename) ? 2 : 1;
+	// per thread, the thumbnail workers decode at the same time
+	stbi_set_flip_vertically_on_load_thread(true);
+	void *data;
+	if (bytesPerComponent == 2)
+		data = stbi_load_16(filename, &image->width, &image->height, &numComponents, 0);
+	else
+		data = stbi_load(filename, &image->width, &image->height, &numComponents, 0);
+	if (data == nullptr)
+		return false;
+
+	image->numComponents = numComponents;
+	image->bytesPerComponent = bytesPerComponent;
+	const unsigned char *bytes = (const unsigned char *)data;
+	image->pixels.assign(bytes, bytes + image->width * image->height * numComponents * bytesPerComponent);
+	stbi_image_free(data);
+	return true;
+}
+
+void Downscale(const MyImage &src, int size, MyImage *dst)
+{
+	int longest = max(src.width, src.height);
+	dst->width = longest > size ? max(src.width * size / longest, 1) : src.width;
+	dst->height = longest > size ? max(src.height * size / longest, 1) : src.height;
+	dst->numComponents = 4;
+	dst->bytesPerComponent = 1;
+	dst->pixels.resize((size_t)dst->width * dst->height * 4);
+
+	// grey images are spread over RGB, images without alpha get an opaque one
+	int n = src.numComponents;
+	const int channels[4] = { 0, n >= 3 ? 1 : 0, n >= 3 ? 2 : 0, n == 2 ? 1 : n == 4 ? 3 : -1 };
+	const unsigned short *wide = (const unsigned short *)&src.pixels[0];
+	for (int y = 0; y < dst->height; y++)
+	{
+		int y0 = (int)((long long)y * src.height / dst->height);
+		int y1 = max((int)((long long)(y + 1) * src.height / dst->height), y0 + 1);
+		for (int x = 0; x < dst->width; x++)
+		{
+			int x0 = (int)((long long)x * src.width / dst->width);
+			int x1 = max((int)((long long)(x + 1) * src.width / dst->width), x0 + 1);
+			unsigned long long sums[4] = { 0, 0, 0, 0 };
+			for (int sy = y0; sy < y1; sy++)
+			{
+				size_t row = (size_t)sy * src.width;
+				for (int sx = x0; sx < x1; sx++)
+					for (int c = 0; c < 4; c++)
+					{
+						size_t i = (row + sx) * n + channels[c];
+						unsigned int v = channels[c] < 0 ? 255 :
+							src.bytesPerComponent == 2 ? wide[i] >> 8 : src.pixels[i];
+						sums[c] += v;
+					}
+			}
+			unsigned long long count = (unsigned long long)(x1 - x0) * (y1 - y0);
+			for (int c = 0; c < 4; c++)
+				dst->pixels[((size_t)y * dst->width + x) * 4 + c] = (unsigned char)((sums[c] + count / 2) / count);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+// Planar image data
+
+void ResizePlanar(MyPlanarImage *image, int width, int height)
+{
+	image->width = width;
+	image->height = height;
+	image->stride = (width + 2 * planarBorder + 7) / 8 * 8;
+	image->storage.assign((size_t)image->stride * height * 4, 0.f);
+}
+
+void ExtendBorders(MyPlanarImage *image)
+{
+	int right = image->stride - planarBorder - image->width;
+	for (int c = 0; c < 4; c++)
+	{
+		for (int y = 0; y < image->height; y++)
+		{
+			float *row = image->Row(c, y);
+			fill(row - planarBorder, row, row[0]);
+			fill(row + image->width, row + image->width + right, row[image->width - 1]);
+		}
+	}
+}
+
+// handles the texels from x on, for any component count and depth
+template <typename T>
+static void DeinterleaveScalar(const T *in, int numComponents, float scale,
+                               int x, int count, float *const planes[4])
+{
+	// grey and grey-alpha images spread their first component over RGB
+	int g = numComponents >= 3 ? 1 : 0;
+	int b = numComponents >= 3 ? 2 : 0;
+	int a = numComponents == 2 ? 1 : numComponents == 4 ? 3 : -1;
+	for (; x < count; x++)
+	{
+		const T *p = in + x * numComponents;
+		planes[0][x] = p[0] * scale;
+		planes[1][x] = p[g] * scale;
+		planes[2][x] = p[b] * scale;
+		planes[3][x] = a >= 0 ? p[a] * scale : 1.f;
+	}
+}
+
+#ifdef __SSE2__
+// widens four RGBA8 texels held in a register and stores them to the planes
+static inline void StoreTexels8(__m128i bytes, float *const planes[4], int x, bool opaque)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 scale = _mm_set1_ps(1.f / 255.f);
+	__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+	__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+	__m128 t0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+	__m128 t1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+	__m128 t2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+	__m128 t3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+
+	// texel per register to channel per register
+	_MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+	_mm_store_ps(planes[0] + x, _mm_mul_ps(t0, scale));
+	_mm_store_ps(planes[1] + x, _mm_mul_ps(t1, scale));
+	_mm_store_ps(planes[2] + x, _mm_mul_ps(t2, scale));
+	_mm_store_ps(planes[3] + x, opaque ? _mm_set1_ps(1.f) : _mm_mul_ps(t3, scale));
+}
+
+// returns the number of texels converted, always a multiple of 4
+static int DeinterleaveRGBA8(const unsigned char *in, int count, float *const planes[4])
+{
+	int x = 0;
+	for (; x + 4 <= count; x += 4)
+		StoreTexels8(_mm_loadu_si128((const __m128i *)(in + x * 4)), planes, x, false);
+	return x;
+}
+#endif
+
+#ifdef HAVE_SSSE3_DISPATCH
+// spreads four RGB8 texels to RGBA with a byte shuffle; reads 16 bytes for
+// every 12 it uses, so it stops while a full load still fits in the row
+__attribute__((target("ssse3")))
+static int DeinterleaveRGB8(const unsigned char *in, int count, float *const planes[4])
+{
+	const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	int x = 0;
+	for (; (x + 4) * 3 + 4 <= count * 3; x += 4)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(in + x * 3));
+		StoreTexels8(_mm_shuffle_epi8(bytes, spread), planes, x, true);
+	}
+	return x;
+}
+
+static bool HasSSSE3()
+{
+	static const bool supported = __builtin_cpu_supports("ssse3");
+	return supported;
+}
+#endif
+
+static void DeinterleaveRow8(const unsigned char *in, int numComponents, int count, float *const planes[4])
+{
+	int x = 0;
+#ifdef __SSE2__
+	if (numComponents == 4)
+		x = DeinterleaveRGBA8(in, count, planes);
+#endif
+#ifdef HAVE_SSSE3_DISPATCH
+	if (numComponents == 3 && HasSSSE3())
+		x = DeinterleaveRGB8(in, count, planes);
+#endif
+	DeinterleaveScalar(in, numComponents, 1.f / 255.f, x, count, planes);
+}
+
+void Deinterleave(const MyImage &src, MyPlanarImage *dst)
+{
+	ResizePlanar(dst, src.width, src.height);
+	for (int y = 0; y < src.height; y++)
+	{
+		float *const planes[4] = { dst->Row(0, y), dst->Row(1, y), dst->Row(2, y), dst->Row(3, y) };
+		size_t start = (size_t)y * src.width * src.numComponents;
+		if (src.bytesPerComponent == 2)
+			DeinterleaveScalar((const unsigned short *)&src.pixels[0] + start, src.numComponents,
+			                   1.f / 65535.f, 0, src.width, planes);
+		else
+			DeinterleaveRow8(&src.pixels[start], src.numComponents, src.width, planes);
+	}
+	ExtendBorders(dst);
+}
+
+void InterleaveRGBA(const float *const planes[4], int count, float *out)
+{
+	int x = 0;
+#ifdef __SSE2__
+	for (; x + 4 <= count; x += 4)
+	{
+		__m128 r = _mm_loadu_ps(planes[0] + x);
+		__m128 g = _mm_loadu_ps(planes[1] + x);
+		__m128 b = _mm_loadu_ps(planes[2] + x);
+		__m128 a = _mm_loadu_ps(planes[3] + x);
+		_MM_TRANSPOSE4_PS(r, g, b, a);
+		_mm_storeu_ps(out + x * 4, r);
+		_mm_storeu_ps(out + x * 4 + 4, g);
+		_mm_storeu_ps(out + x * 4 + 8, b);
+		_mm_storeu_ps(out + x * 4 + 12, a);
+	}
+#endif
+	for (; x < count; x++)
+		for (int c = 0; c < 4; c++)
+			out[x * 4 + c] = planes[c][x];
+}
+
+void QuantizeRGBA(const float *rgba, int count, int numComponents, unsigned char *out)
+{
+	for (int x = 0; x < count; x++)
+	{
+		for (int c = 0; c < numComponents; c++)
+		{
+			float v = min(max(rgba[x * 4 + c], 0.f), 1.f);
+			out[x * numComponents + c] = (unsigned char)(v * 255.f + 0.5f);
+		}
+	}
+}
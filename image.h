@@ -0,0 +1,123 @@
+// ==========================================================================
+// Image storage for the CPU path
+//
+// stb_image hands out interleaved texels whose component count varies from
+// file to file. The CPU filters work on MyPlanarImage instead: always RGBA,
+// one float plane per channel, every row aligned to a vector boundary and
+// padded by a replicated border so that kernels can read past either end of
+// a row without branching.
+// ==========================================================================
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+// --------------------------------------------------------------------------
+// Decoded image data
+
+struct MyImage
+{
+	int width;
+	int height;
+	int numComponents;
+	int bytesPerComponent;  // 1, or 2 for 16-bit sources
+
+	// interleaved texels, rows stored bottom-up as stb_image returns them
+	// with stbi_set_flip_vertically_on_load(true)
+	std::vector<unsigned char> pixels;
+
+	MyImage() : width(0), height(0), numComponents(0), bytesPerComponent(1)
+	{}
+};
+
+// decodes an image file into memory, keeping 16 bits per component for
+// 16-bit sources, returning true if successful
+bool LoadImage(MyImage *image, const char *filename);
+
+// shrinks an image to fit in size x size texels by averaging the texels each
+// one covers, never enlarging it; the result is RGBA with 8 bits
+void Downscale(const MyImage &src, int size, MyImage *dst);
+
+// --------------------------------------------------------------------------
+// Planar image data
+
+// std::vector allocator handing out 32-byte aligned storage
+template <typename T>
+struct AlignedAllocator
+{
+	typedef T value_type;
+
+	AlignedAllocator()
+	{}
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U> &)
+	{}
+
+	T *allocate(size_t n)
+	{
+		void *memory = nullptr;
+		if (posix_memalign(&memory, 32, n * sizeof(T)) != 0)
+			throw std::bad_alloc();
+		return static_cast<T *>(memory);
+	}
+	void deallocate(T *memory, size_t)
+	{
+		free(memory);
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T> &, const AlignedAllocator<U> &) { return false; }
+
+// texels of border on each side of a planar row, keeps texel 0 aligned
+const int planarBorder = 8;
+
+struct MyPlanarImage
+{
+	int width;
+	int height;
+	int stride;     // floats from one row to the next, a multiple of 8
+
+	// red, green, blue and alpha planes one after the other
+	std::vector<float, AlignedAllocator<float> > storage;
+
+	MyPlanarImage() : width(0), height(0), stride(0)
+	{}
+
+	// texel 0 of row y of channel c, with y clamped to the image like
+	// GL_CLAMP_TO_EDGE; planarBorder texels can be read past either end
+	float *Row(int c, int y)
+	{
+		y = y < 0 ? 0 : y >= height ? height - 1 : y;
+		return &storage[((size_t)c * height + y) * stride + planarBorder];
+	}
+	const float *Row(int c, int y) const
+	{
+		y = y < 0 ? 0 : y >= height ? height - 1 : y;
+		return &storage[((size_t)c * height + y) * stride + planarBorder];
+	}
+};
+
+// allocates zeroed planes for an image of the given size
+void ResizePlanar(MyPlanarImage *image, int width, int height);
+
+// copies the edge texels of every row into its border
+void ExtendBorders(MyPlanarImage *image);
+
+// converts interleaved 8 or 16-bit texels with any number of components to
+// normalized RGBA planes; grey images are spread over red, green and blue,
+// and images without alpha get an opaque alpha plane
+void Deinterleave(const MyImage &src, MyPlanarImage *dst);
+
+// interleaves count texels of four planar rows into RGBA floats
+void InterleaveRGBA(const float *const planes[4], int count, float *out);
+
+// clamps count RGBA float texels to bytes with 3 or 4 components per texel
+void QuantizeRGBA(const float *rgba, int count, int numComponents, unsigned char *out);
+
+#endif
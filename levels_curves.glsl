@@ -0,0 +1,94 @@
+// ==========================================================================
+// Curves pass of auto levels and equalization (colour effects 6 and 7)
+//
+// One workgroup of 256 invocations, one per bin, turns the histogram into
+// cumulative counts with a Hillis-Steele scan in shared memory and writes
+// the curves fragment.glsl looks up, the same as BuildLevels() on the CPU:
+// row 0 stretches every channel from its clipped darkest to its clipped
+// brightest bin, row 1 equalizes the grey.
+// ==========================================================================
+#version 430
+
+layout(local_size_x = 256) in;
+
+layout(std430, binding = 0) readonly buffer Histogram
+{
+    uint counts[1024];
+};
+
+layout(rgba32f, binding = 0) uniform writeonly image2DRect curves;
+
+//share of the texels clipped at either end by auto levels, see levelsClip
+const uint clipDivisor = 200u;
+
+shared uint cdf[1024];
+shared int low[3];
+shared int high[3];
+shared uint darkest;
+
+void main(void)
+{
+    int i = int(gl_LocalInvocationIndex);
+    for(int c=0;c<4;c++)
+    {
+      cdf[c*256 + i] = counts[c*256 + i];
+    }
+    if(i < 3)
+    {
+      low[i] = 0;
+      high[i] = 255;
+    }
+    if(i == 0)
+    {
+      darkest = 0u;
+    }
+
+    //log2(256) steps, each adds the sum offset bins back
+    for(int offset=1;offset<256;offset*=2)
+    {
+      barrier();
+      uint add[4];
+      for(int c=0;c<4;c++)
+      {
+        add[c] = i >= offset ? cdf[c*256 + i - offset] : 0u;
+      }
+      barrier();
+      for(int c=0;c<4;c++)
+      {
+        cdf[c*256 + i] += add[c];
+      }
+    }
+    barrier();
+
+    //the first bins past the clipped texels at either end
+    uint total = cdf[3*256 + 255];
+    uint clip = total/clipDivisor;
+    for(int c=0;c<3;c++)
+    {
+      uint sum = cdf[c*256 + i];
+      uint previous = i > 0 ? cdf[c*256 + i - 1] : 0u;
+      if(sum > clip && (i == 0 || previous <= clip))
+      {
+        low[c] = i;
+      }
+      if(sum >= total - clip && (i == 0 || previous < total - clip))
+      {
+        high[c] = i;
+      }
+    }
+    uint grey = cdf[3*256 + i];
+    if(counts[3*256 + i] > 0u && (i == 0 || cdf[3*256 + i - 1] == 0u))
+    {
+      darkest = grey;
+    }
+    barrier();
+
+    vec4 stretch = vec4(1.0);
+    for(int c=0;c<3;c++)
+    {
+      stretch[c] = clamp(float(i - low[c])/float(max(high[c] - low[c], 1)), 0.0, 1.0);
+    }
+    float equalize = total > darkest ? (float(grey) - float(darkest))/float(total - darkest) : float(i)/255.0;
+    imageStore(curves, ivec2(i, 0), stretch);
+    imageStore(curves, ivec2(i, 1), vec4(clamp(equalize, 0.0, 1.0)));
+}
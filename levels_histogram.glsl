@@ -0,0 +1,60 @@
+// ==========================================================================
+// Histogram pass of auto levels and equalization (colour effects 6 and 7)
+//
+// Every workgroup counts a 64 x 64 tile of the picture into a histogram in
+// shared memory, then adds its bins into the buffer, so the atomics on the
+// buffer are one per bin and tile rather than one per texel. The bins are
+// the bytes of red, green, blue and the integer second grey, the same as
+// BuildHistogram() on the CPU.
+// ==========================================================================
+#version 430
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+uniform sampler2DRect tex;
+
+//4 x 256 counts: red, green, blue and grey
+layout(std430, binding = 0) buffer Histogram
+{
+    uint counts[1024];
+};
+
+shared uint bins[1024];
+
+void main(void)
+{
+    uint index = gl_LocalInvocationIndex;
+    for(uint i=index;i<1024u;i+=256u)
+    {
+      bins[i] = 0u;
+    }
+    barrier();
+
+    //4 x 4 texels per invocation, neighbouring invocations read neighbouring texels
+    ivec2 size = textureSize(tex);
+    ivec2 corner = ivec2(gl_WorkGroupID.xy)*64 + ivec2(gl_LocalInvocationID.xy);
+    for(int j=0;j<64;j+=16)
+    {
+      for(int i=0;i<64;i+=16)
+      {
+        ivec2 p = corner + ivec2(i, j);
+        if(p.x < size.x && p.y < size.y)
+        {
+          ivec3 b = ivec3(clamp(texelFetch(tex, p).rgb, 0.0, 1.0)*255.0 + 0.5);
+          atomicAdd(bins[b.r], 1u);
+          atomicAdd(bins[256 + b.g], 1u);
+          atomicAdd(bins[512 + b.b], 1u);
+          atomicAdd(bins[768 + (299*b.r + 587*b.g + 114*b.b + 500)/1000], 1u);
+        }
+      }
+    }
+    barrier();
+
+    for(uint i=index;i<1024u;i+=256u)
+    {
+      if(bins[i] > 0u)
+      {
+        atomicAdd(counts[i], bins[i]);
+      }
+    }
+}
@@ -0,0 +1,208 @@
+// ==========================================================================
+// Accounting of the memory held by pictures on the host and the GPU
+// ==========================================================================
+
+#include "memory.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Counts
+
+struct MyMemoryLedger
+{
+	long long used[memorySides][memoryCategories];
+	long long peak[memorySides][memoryCategories];
+	long long totalPeak[memorySides];
+	long long cap[memorySides];
+
+	long long evicted[memorySides];     // bytes the evictors released
+	int evictions[memorySides];         // reservations that had to evict
+	int overruns[memorySides];          // reservations that stayed over the cap
+
+	MyMemoryLedger()
+	{
+		for (int s = 0; s < memorySides; s++)
+		{
+			for (int c = 0; c < memoryCategories; c++)
+				used[s][c] = peak[s][c] = 0;
+			totalPeak[s] = cap[s] = evicted[s] = 0;
+			evictions[s] = overruns[s] = 0;
+		}
+	}
+};
+
+// the sequence stages and the thumbnail workers count on their own threads
+static MyMemoryLedger ledger;
+static mutex ledgerLock;
+
+static bool printStats = false;
+
+void CountMemory(MemorySide side, MemoryCategory category, long long bytes)
+{
+	lock_guard<mutex> guard(ledgerLock);
+	long long &used = ledger.used[side][category];
+	used += bytes;
+	ledger.peak[side][category] = max(ledger.peak[side][category], used);
+
+	long long total = 0;
+	for (int c = 0; c < memoryCategories; c++)
+		total += ledger.used[side][c];
+	ledger.totalPeak[side] = max(ledger.totalPeak[side], total);
+}
+
+long long MemoryUsed(MemorySide side, MemoryCategory category)
+{
+	lock_guard<mutex> guard(ledgerLock);
+	return ledger.used[side][category];
+}
+
+long long MemoryUsed(MemorySide side)
+{
+	lock_guard<mutex> guard(ledgerLock);
+	long long total = 0;
+	for (int c = 0; c < memoryCategories; c++)
+		total += ledger.used[side][c];
+	return total;
+}
+
+void SetMemoryCap(MemorySide side, long long bytes)
+{
+	lock_guard<mutex> guard(ledgerLock);
+	ledger.cap[side] = max(bytes, 0LL);
+}
+
+// --------------------------------------------------------------------------
+// Eviction
+
+struct MyEvictor
+{
+	MemoryCategory category;
+	MemoryEvictor evict;
+};
+
+// registered once at start-up, before any thread reserves
+static vector<MyEvictor> evictors[memorySides];
+
+void RegisterEvictor(MemorySide side, MemoryCategory category, MemoryEvictor evictor)
+{
+	MyEvictor entry = { category, evictor };
+	evictors[side].push_back(entry);
+}
+
+bool MemoryFits(MemorySide side, long long bytes)
+{
+	long long cap;
+	{
+		lock_guard<mutex> guard(ledgerLock);
+		cap = ledger.cap[side];
+	}
+	return cap == 0 || MemoryUsed(side) + bytes <= cap;
+}
+
+bool ReserveMemory(MemorySide side, long long bytes)
+{
+	if (MemoryFits(side, bytes))
+		return true;
+	long long cap;
+	{
+		lock_guard<mutex> guard(ledgerLock);
+		cap = ledger.cap[side];
+	}
+
+	// the cheapest to rebuild goes first; the evictors count what they
+	// release themselves, so the lock is not held while they run
+	const MemoryCategory order[memoryCategories] = { cacheMemory, tileMemory, intermediateMemory, sourceMemory };
+	long long released = 0;
+	for (int i = 0; i < memoryCategories; i++)
+	{
+		for (size_t j = 0; j < evictors[side].size(); j++)
+		{
+			long long over = MemoryUsed(side) + bytes - cap;
+			if (over <= 0)
+				break;
+			if (evictors[side][j].category == order[i])
+				released += evictors[side][j].evict(over);
+		}
+	}
+
+	bool fits = MemoryUsed(side) + bytes <= cap;
+	lock_guard<mutex> guard(ledgerLock);
+	ledger.evicted[side] += released;
+	ledger.evictions[side] += released > 0;
+	if (!fits && ledger.overruns[side]++ == 0)
+		cout << "Over the " << (side == hostMemory ? "host" : "GPU") << " memory cap of "
+		     << cap / (1024.0 * 1024.0) << " MB with nothing left to evict" << endl;
+	return fits;
+}
+
+// --------------------------------------------------------------------------
+// Stats and options
+
+static string Megabytes(long long bytes)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.1f MB", bytes / (1024.0 * 1024.0));
+	return text;
+}
+
+void PrintMemoryStats()
+{
+	lock_guard<mutex> guard(ledgerLock);
+	const char *names[memoryCategories] = { "source", "intermediate", "cache", "tile" };
+	cout << "Memory            host        peak         GPU        peak" << endl;
+	long long totals[memorySides] = { 0, 0 };
+	for (int c = 0; c < memoryCategories; c++)
+	{
+		cout << "  " << left << setw(14) << names[c] << right;
+		for (int s = 0; s < memorySides; s++)
+		{
+			cout << setw(10) << Megabytes(ledger.used[s][c]) << setw(12) << Megabytes(ledger.peak[s][c]);
+			totals[s] += ledger.used[s][c];
+		}
+		cout << endl;
+	}
+	cout << "  " << left << setw(14) << "total" << right;
+	for (int s = 0; s < memorySides; s++)
+		cout << setw(10) << Megabytes(totals[s]) << setw(12) << Megabytes(ledger.totalPeak[s]);
+	cout << endl;
+	cout << "  " << left << setw(14) << "cap" << right;
+	for (int s = 0; s < memorySides; s++)
+		cout << setw(10) << (ledger.cap[s] > 0 ? Megabytes(ledger.cap[s]) : "none") << setw(12) << "";
+	cout << endl;
+	for (int s = 0; s < memorySides; s++)
+		if (ledger.evictions[s] > 0 || ledger.overruns[s] > 0)
+			cout << "  " << (s == hostMemory ? "host" : "GPU") << ": " << Megabytes(ledger.evicted[s])
+			     << " evicted by " << ledger.evictions[s] << " reservations, "
+			     << ledger.overruns[s] << " stayed over the cap" << endl;
+}
+
+bool ParseMemoryOption(int argc, char *argv[], int *i)
+{
+	string option = argv[*i];
+	if (option == "--memory-stats")
+	{
+		printStats = true;
+		return true;
+	}
+	if ((option != "--host-memory-cap" && option != "--gpu-memory-cap") || *i + 1 >= argc)
+		return false;
+
+	long long megabytes = atoll(argv[++*i]);
+	SetMemoryCap(option == "--host-memory-cap" ? hostMemory : deviceMemory, megabytes * 1024 * 1024);
+	return true;
+}
+
+bool MemoryStatsRequested()
+{
+	return printStats;
+}
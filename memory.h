@@ -0,0 +1,94 @@
+// ==========================================================================
+// Accounting of the memory held by pictures on the host and the GPU
+//
+// Decoded pictures, their textures, filtered tiles, cached images and the
+// intermediate results of the filters are allocated all over the program.
+// Every owner reports the bytes it holds here, on the host or the GPU and in
+// one of four categories:
+//
+//   - source: decoded pictures and frames, and their textures
+//   - intermediate: results the filters build and throw away again (the
+//     bilateral grid, the Canny edges, the levels curves, framebuffers,
+//     frames waiting in the sequence queues)
+//   - cache: what is kept only to make the next request faster (the server's
+//     decoded images, the contact sheet thumbnails, pixel cache files while
+//     they are mapped)
+//   - tile: the filtered tiles of the CPU path and the texture they go into
+//
+// Each side can be capped. Before allocating, an owner calls ReserveMemory(),
+// which asks the evictors registered for that side to give memory back,
+// caches first and sources last, until the allocation fits under the cap.
+// Owners that cannot shrink allocate anyway and the overrun is counted, so a
+// cap slows things down rather than failing them. Threads other than the one
+// that registered the evictors only count, and wait with MemoryFits() for
+// their own memory to be released instead. PrintMemoryStats() dumps
+// the current and peak figures for sizing deployments.
+// ==========================================================================
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <functional>
+
+enum MemorySide { hostMemory, deviceMemory };
+const int memorySides = 2;
+
+enum MemoryCategory { sourceMemory, intermediateMemory, cacheMemory, tileMemory };
+const int memoryCategories = 4;
+
+// adds bytes, negative when they are released, to what side holds in category
+void CountMemory(MemorySide side, MemoryCategory category, long long bytes);
+
+// bytes side holds in category, and in all categories
+long long MemoryUsed(MemorySide side, MemoryCategory category);
+long long MemoryUsed(MemorySide side);
+
+// caps what side may hold; 0, the default, leaves it unbounded
+void SetMemoryCap(MemorySide side, long long bytes);
+
+// releases at least bytes of what it owns if it can, and returns the number
+// of bytes it released; called on the thread that reserves
+typedef std::function<long long(long long bytes)> MemoryEvictor;
+
+// evictors are asked in the order cache, tile, intermediate, source, and in
+// the order they were registered within a category
+void RegisterEvictor(MemorySide side, MemoryCategory category, MemoryEvictor evictor);
+
+// makes room for bytes more on side by evicting, and returns true if they fit
+// under the cap afterwards (always without a cap)
+bool ReserveMemory(MemorySide side, long long bytes);
+
+// true if bytes more fit under the cap of side as it is, without evicting
+bool MemoryFits(MemorySide side, long long bytes);
+
+// an owner's running count of one allocation, for owners that resize it in
+// several places; Set() reports the difference to the last count
+struct MyMemoryCount
+{
+	MemorySide side;
+	MemoryCategory category;
+	long long bytes;
+
+	MyMemoryCount(MemorySide side, MemoryCategory category) : side(side), category(category), bytes(0)
+	{}
+
+	void Set(long long newBytes)
+	{
+		CountMemory(side, category, newBytes - bytes);
+		bytes = newBytes;
+	}
+};
+
+// prints the bytes held and their peaks by side and category, the caps and
+// what the evictors released
+void PrintMemoryStats();
+
+// parses the memory options shared by every mode:
+//   --host-memory-cap <MB>  --gpu-memory-cap <MB>  --memory-stats
+// returns true and advances *i past the option if argv[*i] is one of them
+bool ParseMemoryOption(int argc, char *argv[], int *i);
+
+// --memory-stats was given, the stats are printed when a mode finishes
+bool MemoryStatsRequested();
+
+#endif
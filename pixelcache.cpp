@@ -0,0 +1,345 @@
+// ==========================================================================
+// On-disk cache of decoded pixels
+// ==========================================================================
+
+#include "pixelcache.h"
+#include "memory.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <stb_image.h>
+
+using namespace std;
+
+// layout of a cache file: this header, the source path, then the texels
+// starting at pixelOffset
+struct MyCacheHeader
+{
+	char magic[4];              // "BPXC"
+	unsigned int version;
+	int width;
+	int height;
+	int numComponents;
+	int bytesPerComponent;
+	long long sourceSize;
+	long long sourceModified;   // seconds since the epoch
+	unsigned int pathLength;
+	unsigned int pixelOffset;
+};
+
+const unsigned int cacheVersion = 1;
+
+// texels start on a boundary that suits the texture upload and SIMD loads
+const unsigned int cacheAlignment = 64;
+
+// set from the command line before any load, otherwise resolved by the first
+// load; the thumbnail workers load at the same time as the main thread, so
+// the default is resolved only once
+static string cacheDirectory;
+static bool cacheDirectorySet = false;
+static once_flag cacheDirectoryResolved;
+
+void SetPixelCacheDirectory(const char *directory)
+{
+	cacheDirectory = directory;
+	cacheDirectorySet = true;
+}
+
+// also set from the command line before any load
+static long long cacheLimit = 1024ll * 1024 * 1024;
+
+void SetPixelCacheLimit(long long bytes)
+{
+	cacheLimit = bytes;
+}
+
+static void ResolveCacheDirectory()
+{
+	if (cacheDirectorySet)
+		return;
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && *xdg)
+		cacheDirectory = string(xdg) + "/boilerplate";
+	else if (home && *home)
+		cacheDirectory = string(home) + "/.cache/boilerplate";
+	cacheDirectorySet = true;
+}
+
+static const string &CacheDirectory()
+{
+	call_once(cacheDirectoryResolved, ResolveCacheDirectory);
+	return cacheDirectory;
+}
+
+// creates the directory and any missing parents
+static bool MakeDirectories(const string &path)
+{
+	for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+	{
+		string prefix = path.substr(0, slash);
+		if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+			return false;
+		if (slash == string::npos)
+			return true;
+	}
+}
+
+// 64-bit FNV-1a of the key names the entry
+static string EntryName(const string &path)
+{
+	unsigned long long hash = 14695981039346656037ull;
+	for (size_t i = 0; i < path.size(); i++)
+	{
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ull;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.px", hash);
+	return CacheDirectory() + "/" + name;
+}
+
+static size_t PixelBytes(const MyCacheHeader &header)
+{
+	return (size_t)header.width * header.height * header.numComponents * header.bytesPerComponent;
+}
+
+// maps the entry stored under the key, the source's path for its texels, if
+// it is still up to date with the source, and marks it as used; an entry that
+// is not is deleted, the decoded texels are written in its place
+static bool MapEntry(const string &entry, const string &path, const struct stat &source, MyMappedImage *image)
+{
+	int fd = open(entry.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	void *mapping = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(MyCacheHeader))
+		mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		unlink(entry.c_str());
+		return false;
+	}
+
+	const MyCacheHeader &header = *(const MyCacheHeader *)mapping;
+	const char *entryPath = (const char *)mapping + sizeof(MyCacheHeader);
+	size_t size = info.st_size;
+	bool valid = memcmp(header.magic, "BPXC", 4) == 0 && header.version == cacheVersion &&
+		header.sourceSize == (long long)source.st_size && header.sourceModified == (long long)source.st_mtime &&
+		header.pathLength == path.size() && sizeof(MyCacheHeader) + header.pathLength <= size &&
+		memcmp(entryPath, path.c_str(), header.pathLength) == 0 &&
+		header.width > 0 && header.height > 0 && header.numComponents >= 1 && header.numComponents <= 4 &&
+		(header.bytesPerComponent == 1 || header.bytesPerComponent == 2) &&
+		header.pixelOffset <= size && PixelBytes(header) == size - header.pixelOffset;
+	if (!valid)
+	{
+		munmap(mapping, size);
+		unlink(entry.c_str());
+		return false;
+	}
+
+	// the modification time orders the entries for PruneEntries()
+	utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+
+	image->width = header.width;
+	image->height = header.height;
+	image->numComponents = header.numComponents;
+	image->bytesPerComponent = header.bytesPerComponent;
+	image->pixels = (const unsigned char *)mapping + header.pixelOffset;
+	image->mapping = mapping;
+	image->mappingSize = size;
+	CountMemory(hostMemory, cacheMemory, size);
+	return true;
+}
+
+// deletes the least recently used entries until the rest fit in cacheLimit;
+// keep, the entry just written, stays even if it is over the limit on its own
+static void PruneEntries(const string &keep)
+{
+	if (cacheLimit <= 0)
+		return;
+
+	// the thumbnail workers write entries at the same time
+	static mutex pruning;
+	lock_guard<mutex> lock(pruning);
+	DIR *directory = opendir(CacheDirectory().c_str());
+	if (directory == nullptr)
+		return;
+	vector<pair<long long, pair<string, long long> > > entries;
+	long long total = 0;
+	while (dirent *file = readdir(directory))
+	{
+		string name = file->d_name;
+		if (name.size() < 3 || name.compare(name.size() - 3, 3, ".px") != 0)
+			continue;
+		string entry = CacheDirectory() + "/" + name;
+		struct stat info;
+		if (stat(entry.c_str(), &info) != 0)
+			continue;
+		total += info.st_size;
+		if (entry != keep)
+			entries.push_back(make_pair((long long)info.st_mtime, make_pair(entry, (long long)info.st_size)));
+	}
+	closedir(directory);
+
+	sort(entries.begin(), entries.end());
+	for (size_t i = 0; i < entries.size() && total > cacheLimit; i++)
+		if (unlink(entries[i].second.first.c_str()) == 0)
+			total -= entries[i].second.second;
+}
+
+// writes the entry next to its final name and renames it into place, so that
+// a concurrent reader never maps a partial file
+static void WriteEntry(const string &entry, const string &path, const struct stat &source, const MyMappedImage &image)
+{
+	if (!MakeDirectories(CacheDirectory()))
+		return;
+
+	MyCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "BPXC", 4);
+	header.version = cacheVersion;
+	header.width = image.width;
+	header.height = image.height;
+	header.numComponents = image.numComponents;
+	header.bytesPerComponent = image.bytesPerComponent;
+	header.sourceSize = source.st_size;
+	header.sourceModified = source.st_mtime;
+	header.pathLength = path.size();
+	header.pixelOffset = (sizeof(header) + path.size() + cacheAlignment - 1) / cacheAlignment * cacheAlignment;
+
+	char temporary[PATH_MAX];
+	snprintf(temporary, sizeof(temporary), "%s.%d", entry.c_str(), (int)getpid());
+	FILE *file = fopen(temporary, "wb");
+	if (file == nullptr)
+		return;
+	static const char padding[cacheAlignment] = {};
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(path.c_str(), 1, path.size(), file) == path.size() &&
+		fwrite(padding, 1, header.pixelOffset - sizeof(header) - path.size(), file) ==
+			header.pixelOffset - sizeof(header) - path.size() &&
+		fwrite(image.pixels, 1, PixelBytes(header), file) == PixelBytes(header);
+	written = fclose(file) == 0 && written;
+	if (!written || rename(temporary, entry.c_str()) != 0)
+	{
+		cout << "Unable to write the pixel cache entry " << entry << endl;
+		unlink(temporary);
+		return;
+	}
+	PruneEntries(entry);
+}
+
+// bytes of the texels stb_image decoded into image
+static long long DecodedBytes(const MyMappedImage &image)
+{
+	return (long long)image.width * image.height * image.numComponents * image.bytesPerComponent;
+}
+
+bool LoadCachedPixels(const char *filename, MyMappedImage *image)
+{
+	*image = MyMappedImage();
+	struct stat source;
+	char path[PATH_MAX];
+	bool cached = !CacheDirectory().empty() && stat(filename, &source) == 0 && realpath(filename, path) != nullptr;
+	string entry = cached ? EntryName(path) : string();
+	if (cached && MapEntry(entry, path, source, image))
+		return true;
+
+	// decode like LoadImage, keeping 16 bits for 16-bit sources
+	stbi_set_flip_vertically_on_load_thread(true);
+	image->bytesPerComponent = stbi_is_16_bit(filename) ? 2 : 1;
+	if (image->bytesPerComponent == 2)
+		image->decoded = stbi_load_16(filename, &image->width, &image->height, &image->numComponents, 0);
+	else
+		image->decoded = stbi_load(filename, &image->width, &image->height, &image->numComponents, 0);
+	if (image->decoded == nullptr)
+		return false;
+	image->pixels = (const unsigned char *)image->decoded;
+	CountMemory(hostMemory, sourceMemory, DecodedBytes(*image));
+
+	if (cached)
+		WriteEntry(entry, path, source, *image);
+	return true;
+}
+
+void ReleaseCachedPixels(MyMappedImage *image)
+{
+	if (image->mapping)
+	{
+		munmap(image->mapping, image->mappingSize);
+		CountMemory(hostMemory, cacheMemory, -(long long)image->mappingSize);
+	}
+	if (image->decoded)
+	{
+		stbi_image_free(image->decoded);
+		CountMemory(hostMemory, sourceMemory, -DecodedBytes(*image));
+	}
+	*image = MyMappedImage();
+}
+
+static void CopyMapped(const MyMappedImage &mapped, MyImage *image)
+{
+	image->width = mapped.width;
+	image->height = mapped.height;
+	image->numComponents = mapped.numComponents;
+	image->bytesPerComponent = mapped.bytesPerComponent;
+	image->pixels.assign(mapped.pixels, mapped.pixels +
+		(size_t)mapped.width * mapped.height * mapped.numComponents * mapped.bytesPerComponent);
+}
+
+bool LoadCachedImage(MyImage *image, const char *filename)
+{
+	MyMappedImage mapped;
+	if (!LoadCachedPixels(filename, &mapped))
+		return false;
+	CopyMapped(mapped, image);
+	ReleaseCachedPixels(&mapped);
+	return true;
+}
+
+bool LoadCachedThumbnail(MyImage *thumbnail, const char *filename, int size)
+{
+	struct stat source;
+	char path[PATH_MAX];
+	bool cached = !CacheDirectory().empty() && stat(filename, &source) == 0 && realpath(filename, path) != nullptr;
+	string key = cached ? string(path) + "#thumbnail" + to_string(size) : string();
+	MyMappedImage mapped;
+	if (cached && MapEntry(EntryName(key), key, source, &mapped))
+	{
+		CopyMapped(mapped, thumbnail);
+		ReleaseCachedPixels(&mapped);
+		return true;
+	}
+
+	MyImage image;
+	if (!LoadImage(&image, filename))
+		return false;
+	Downscale(image, size, thumbnail);
+
+	if (cached)
+	{
+		mapped.width = thumbnail->width;
+		mapped.height = thumbnail->height;
+		mapped.numComponents = thumbnail->numComponents;
+		mapped.bytesPerComponent = thumbnail->bytesPerComponent;
+		mapped.pixels = &thumbnail->pixels[0];
+		WriteEntry(EntryName(key), key, source, mapped);
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+// ==========================================================================
+// On-disk cache of decoded pixels
+//
+// Decoding a large JPEG or PNG dominates the time to the first picture. The
+// first load of a file stores its decoded texels, already flipped like
+// stbi_set_flip_vertically_on_load(true) leaves them, as a small header
+// followed by the raw texels. Later loads, also in later runs, map that file
+// and hand the texels straight to the texture upload without decoding.
+// Entries are keyed by the absolute path of the source and only used while
+// its size and modification time are unchanged; an entry that is out of date
+// is deleted. Thumbnails are cached the same way. Every use of an entry
+// refreshes its modification time, and when the entries outgrow the limit the
+// least recently used ones are deleted.
+// ==========================================================================
+
+#ifndef PIXELCACHE_H
+#define PIXELCACHE_H
+
+#include <stddef.h>
+
+#include "image.h"
+
+// decoded texels that are either mapped from the cache or owned by stb_image
+struct MyMappedImage
+{
+	int width;
+	int height;
+	int numComponents;
+	int bytesPerComponent;          // 1, or 2 for 16-bit sources
+	const unsigned char *pixels;    // rows bottom-up, like MyImage
+
+	// what to release: a mapping of the cache file, or stb_image's buffer
+	void *mapping;
+	size_t mappingSize;
+	void *decoded;
+
+	MyMappedImage() : width(0), height(0), numComponents(0), bytesPerComponent(1),
+		pixels(nullptr), mapping(nullptr), mappingSize(0), decoded(nullptr)
+	{}
+};
+
+// directory the entries are kept in; defaults to $XDG_CACHE_HOME/boilerplate
+// or ~/.cache/boilerplate. An empty directory turns the cache off
+void SetPixelCacheDirectory(const char *directory);
+
+// bytes all entries may take together, 1 GB by default; 0 removes the limit
+void SetPixelCacheLimit(long long bytes);
+
+// loads the texels of an image file from the cache, or decodes it and adds it
+// to the cache; returns true if successful. Release with ReleaseCachedPixels
+bool LoadCachedPixels(const char *filename, MyMappedImage *image);
+void ReleaseCachedPixels(MyMappedImage *image);
+
+// like LoadImage, but through the cache
+bool LoadCachedImage(MyImage *image, const char *filename);
+
+// a Downscale() of the picture to size x size, cached on its own so that the
+// full size texels of a directory full of pictures are not kept around
+bool LoadCachedThumbnail(MyImage *thumbnail, const char *filename, int size);
+
+#endif
@@ -0,0 +1,259 @@
+// ==========================================================================
+// Golden-image regression run
+// ==========================================================================
+
+#include "regress.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include <stb_image_write.h>
+
+#include "fixedpoint.h"
+
+using namespace std;
+
+// the pictures behind the 1 - 8 keys
+static const char *const bundledImages[8] = {
+	"image1-mandrill.png", "image2-uclogo.png", "image3-aerial.jpg", "image4-thirsk.jpg",
+	"image5-pattern.png", "image6-war.jpg", "image7-mario.jpg", "image8-coolGuy.jpeg"
+};
+
+// longest side of the copies of the pictures the effects are run on
+const int inputSize = 128;
+
+// fraction of the bytes of a result that may exceed the tolerance, for the
+// odd texel that rounds differently on another driver or instruction set
+const double outlierFraction = 0.001;
+
+// timed runs of every filter, the fastest one counts; the inputs are small,
+// so it takes a few to get past the odd slow one
+const int timedRuns = 7;
+
+struct MyRegressCase
+{
+	string name;
+	EffectState state;
+	double budget;          // nanoseconds per texel
+};
+
+// every effect the keys can select, with a time budget per texel that a
+// filter has to stay within on either path
+static vector<MyRegressCase> RegressCases()
+{
+	vector<MyRegressCase> cases;
+	// auto levels and equalization build a histogram of the picture first
+	const double colourBudget = 30.0, levelsBudget = 60.0;
+	for (int i = 1; i <= 7; i++)
+	{
+		MyRegressCase test = { "colour" + to_string(i), EffectState(), i <= 5 ? colourBudget : levelsBudget };
+		test.state.colourEffect = i;
+		cases.push_back(test);
+	}
+
+	const char *edgeNames[3] = { "edge-h", "edge-v", "edge-u" };
+	const float *kernels[3] = { horizontalSobel, verticalSobel, unsharpMask };
+	for (int i = 0; i < 3; i++)
+	{
+		MyRegressCase test = { edgeNames[i], EffectState(), 60.0 };
+		test.state.edgeEffect = i == 2 ? 2 : 1;
+		copy(kernels[i], kernels[i] + 9, test.state.edge);
+		cases.push_back(test);
+	}
+	MyRegressCase canny = { "edge-canny", EffectState(), 150.0 };
+	canny.state.edgeEffect = 3;
+	cases.push_back(canny);
+
+	const double blurBudgets[4] = { 60.0, 80.0, 100.0, 200.0 };
+	for (int i = 1; i <= 4; i++)
+	{
+		MyRegressCase test = { "blur" + to_string(i), EffectState(), blurBudgets[i - 1] };
+		test.state.blur = i;
+		cases.push_back(test);
+	}
+
+	// the two windows the fragment program sorts itself
+	for (int r = 1; r <= maxNetworkRankRadius; r++)
+	{
+		MyRegressCase test = { "median" + to_string(2 * r + 1), EffectState(), 600.0 };
+		test.state.blur = 5;
+		test.state.rankRadius = r;
+		cases.push_back(test);
+	}
+	return cases;
+}
+
+static string Stem(const string &filename)
+{
+	return filename.substr(0, filename.rfind('.'));
+}
+
+static bool SaveFrame(const string &filename, const MyImage &image)
+{
+	stbi_flip_vertically_on_write(1);
+	if (!stbi_write_png(filename.c_str(), image.width, image.height, image.numComponents,
+	                    &image.pixels[0], image.width * image.numComponents))
+	{
+		cout << "Unable to save image: " << filename << endl;
+		return false;
+	}
+	return true;
+}
+
+// loads the copy of a bundled picture the effects run on, from the inputs
+// directory next to the goldens. The copies are shrunk so that the goldens
+// stay small, and stored as PNGs so that no result depends on the JPEG
+// decoder; a missing copy is made when the goldens are updated
+static bool LoadInput(const MyRegressOptions &options, const char *bundled, MyImage *image)
+{
+	string directory = options.goldens + "/inputs";
+	string input = directory + "/" + Stem(bundled) + ".png";
+	if (LoadImage(image, input.c_str()))
+		return true;
+	if (!options.update)
+	{
+		cout << "Unable to load image: " << input << endl;
+		return false;
+	}
+
+	MyImage full;
+	if (!LoadImage(&full, bundled))
+	{
+		cout << "Unable to load image: " << bundled << endl;
+		return false;
+	}
+	Downscale(full, inputSize, image);
+	mkdir(directory.c_str(), 0755);
+	return SaveFrame(input, *image);
+}
+
+// filters a copy of the frame, flushing stages that finish a call later, and
+// returns the seconds it took
+static double FilterOnce(FrameFilter filter, const MyFrame &source, MyFrame *done)
+{
+	MyFrame frame = source;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool finished = filter(&frame, done) || filter(nullptr, done);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return finished ? seconds : -1.0;
+}
+
+// the fastest of timedRuns filterings of the frame, in seconds, with the
+// result in done; -1 if the filter failed
+static double BestOf(FrameFilter filter, const MyFrame &source, MyFrame *done)
+{
+	double best = -1.0;
+	for (int run = 0; run < timedRuns; run++)
+	{
+		double seconds = FilterOnce(filter, source, done);
+		if (seconds < 0.0)
+			return -1.0;
+		best = run == 0 ? seconds : min(best, seconds);
+	}
+	return best;
+}
+
+// number of bytes further than tolerance from the golden, and the largest
+// difference; -1 if the sizes do not match
+static int CompareFrames(const MyImage &result, const MyImage &golden, int tolerance, int *largest)
+{
+	*largest = 0;
+	if (result.width != golden.width || result.height != golden.height ||
+	    result.numComponents != golden.numComponents || golden.bytesPerComponent != 1)
+		return -1;
+
+	int outliers = 0;
+	for (size_t i = 0; i < result.pixels.size(); i++)
+	{
+		int difference = abs((int)result.pixels[i] - (int)golden.pixels[i]);
+		*largest = max(*largest, difference);
+		outliers += difference > tolerance;
+	}
+	return outliers;
+}
+
+int RunRegression(const MyRegressOptions &options, FrameFilter filter, const char *path, bool fixedOnly)
+{
+	if (options.update)
+		mkdir(options.goldens.c_str(), 0755);
+
+	vector<MyRegressCase> cases = RegressCases();
+	int failures = 0, checked = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		MyFrame source;
+		if (!LoadInput(options, bundledImages[i], &source.image))
+		{
+			failures++;
+			continue;
+		}
+		double texels = (double)source.image.width * source.image.height;
+
+		// the budgets are for what an effect adds to passing the picture
+		// through unchanged, so that the cost every frame has whatever its
+		// size, such as the upload and read back of the GPU path, does not
+		// count against the small inputs
+		MyFrame plain = source, done;
+		double baseline = options.update ? 0.0 : max(BestOf(filter, plain, &done), 0.0);
+
+		for (size_t j = 0; j < cases.size(); j++)
+		{
+			const MyRegressCase &test = cases[j];
+			if (fixedOnly && !FixedSupported(test.state))
+				continue;
+			string name = Stem(bundledImages[i]) + "-" + test.name + "-" + path;
+			string golden = options.goldens + "/" + name + ".png";
+			source.effects = test.state;
+
+			double best = BestOf(filter, source, &done);
+			if (best < 0.0)
+			{
+				cout << "  " << name << ": the filter failed" << endl;
+				failures++;
+				continue;
+			}
+			checked++;
+
+			if (options.update)
+			{
+				failures += !SaveFrame(golden, done.image);
+				continue;
+			}
+
+			MyImage expected;
+			int largest = 0;
+			int outliers = LoadImage(&expected, golden.c_str()) ?
+				CompareFrames(done.image, expected, options.tolerance, &largest) : -2;
+			bool looks = outliers >= 0 && outliers <= outlierFraction * done.image.pixels.size();
+
+			double perTexel = max(best - baseline, 0.0) * 1e9 / texels;
+			double budget = test.budget * options.budgetScale;
+			bool fast = perTexel <= budget;
+
+			if (!looks)
+			{
+				SaveFrame(options.goldens + "/" + name + "-actual.png", done.image);
+				if (outliers == -2)
+					cout << "  " << name << ": no golden image " << golden << endl;
+				else if (outliers == -1)
+					cout << "  " << name << ": size differs from the golden image" << endl;
+				else
+					cout << "  " << name << ": " << outliers << " bytes off by more than " << options.tolerance
+					     << " (up to " << largest << "), wrote " << name << "-actual.png" << endl;
+			}
+			if (!fast)
+				cout << "  " << name << ": " << perTexel << " ns per texel more than the plain pass, over the budget of " << budget << endl;
+			failures += !looks || !fast;
+		}
+	}
+
+	if (options.update)
+		cout << "Wrote " << checked << " golden images to " << options.goldens << endl;
+	else
+		cout << "Checked " << checked << " results on the " << path << " path, " << failures << " failed" << endl;
+	return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,38 @@
+// ==========================================================================
+// Golden-image regression run
+//
+// Renders every effect on small PNG copies of the bundled image1 - image8
+// without a visible window, on the CPU path or on the GPU (which can be
+// Mesa's llvmpipe, e.g. with LIBGL_ALWAYS_SOFTWARE=1), compares each result
+// with a stored golden PNG and checks that each filter stays within its time
+// budget. A visual change, a slowdown and a missing golden all make the run
+// fail.
+// ==========================================================================
+
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include <string>
+
+#include "sequence.h"
+
+struct MyRegressOptions
+{
+	std::string goldens;    // directory of the golden PNGs
+	bool update;            // write the results as the new goldens
+	int tolerance;          // levels a byte may differ from its golden
+	double budgetScale;     // multiplies every time budget, for slow machines
+
+	MyRegressOptions() : update(false), tolerance(2), budgetScale(1.0)
+	{}
+};
+
+// runs every effect on every bundled image through the filter stage, named
+// cpu, float or gpu in the golden file names; returns 0 if every result
+// matches its golden and meets its budget. With fixedOnly, only the effects
+// the fixed-point kernels cover are run, for the float stage that the cpu
+// one bypasses for them
+int RunRegression(const MyRegressOptions &options, FrameFilter filter, const char *path,
+                  bool fixedOnly = false);
+
+#endif
@@ -0,0 +1,445 @@
+// ==========================================================================
+// High quality resampling of the view for exports
+// ==========================================================================
+
+#include "resample.h"
+#include "pixelcache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <math.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <stb_image_write.h>
+
+using namespace std;
+
+// the clear colour of the window
+static const float exportBackground[4] = { 0.2f, 0.2f, 0.2f, 1.f };
+
+// --------------------------------------------------------------------------
+// Kernels
+
+static double Lanczos3(double x)
+{
+	x = fabs(x);
+	if (x < 1e-8)
+		return 1.0;
+	if (x >= 3.0)
+		return 0.0;
+	double px = M_PI * x;
+	return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+// Keys' cubic with a = -0.5, as Catmull-Rom
+static double Bicubic(double x)
+{
+	x = fabs(x);
+	if (x < 1.0)
+		return (1.5 * x - 2.5) * x * x + 1.0;
+	if (x < 2.0)
+		return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+	return 0.0;
+}
+
+static double Kernel(double x, bool bicubic)
+{
+	return bicubic ? Bicubic(x) : Lanczos3(x);
+}
+
+static int KernelRadius(bool bicubic)
+{
+	return bicubic ? 2 : 3;
+}
+
+// --------------------------------------------------------------------------
+// Vector loops
+
+// out[x] = sum of weights[k] * rows[k][x]
+static void SumRows(float *out, const float *const *rows, const float *weights, int taps, int count)
+{
+	int x = 0;
+#ifdef __SSE2__
+	for (; x + 4 <= count; x += 4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < taps; k++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + x)));
+		_mm_storeu_ps(out + x, sum);
+	}
+#endif
+	for (; x < count; x++)
+	{
+		float sum = 0.f;
+		for (int k = 0; k < taps; k++)
+			sum += weights[k] * rows[k][x];
+		out[x] = sum;
+	}
+}
+
+// sum of in[k] * weights[k], count a multiple of 4
+static inline float Dot(const float *in, const float *weights, int count)
+{
+#ifdef __SSE2__
+	__m128 sum = _mm_setzero_ps();
+	for (int k = 0; k < count; k += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + k), _mm_loadu_ps(weights + k)));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0.f;
+	for (int k = 0; k < count; k++)
+		sum += in[k] * weights[k];
+	return sum;
+#endif
+}
+
+// the 2D kernel at one position: the rows weighted by wy, summed, and the
+// sum weighted by wx; stride is 4 or 8
+static inline float KernelTexel(const float *const *rows, size_t offset, const float *wx,
+                                const float *wy, int taps, int stride)
+{
+#ifdef __SSE2__
+	__m128 low = _mm_setzero_ps(), high = _mm_setzero_ps();
+	for (int k = 0; k < taps; k++)
+	{
+		__m128 weight = _mm_set1_ps(wy[k]);
+		const float *row = rows[k] + offset;
+		low = _mm_add_ps(low, _mm_mul_ps(weight, _mm_loadu_ps(row)));
+		if (stride == 8)
+			high = _mm_add_ps(high, _mm_mul_ps(weight, _mm_loadu_ps(row + 4)));
+	}
+	__m128 sum = _mm_mul_ps(low, _mm_loadu_ps(wx));
+	if (stride == 8)
+		sum = _mm_add_ps(sum, _mm_mul_ps(high, _mm_loadu_ps(wx + 4)));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0.f;
+	for (int k = 0; k < taps; k++)
+		sum += wy[k] * Dot(rows[k] + offset, wx, stride);
+	return sum;
+#endif
+}
+
+// --------------------------------------------------------------------------
+// Separable resampling
+
+// weights of the source texels behind each output texel along one axis
+struct MyAxisWeights
+{
+	int taps;                   // source texels per output texel
+	int stride;                 // taps rounded up to a multiple of 4, padded with zeros
+	vector<int> first;          // first source texel of each output texel
+	vector<float> weights;      // stride per output texel
+
+	MyAxisWeights() : taps(0), stride(0)
+	{}
+};
+
+// output texel o sits at source position scale * o + offset, texel i of the
+// source at i; the kernel is stretched by the shrink factor
+static void BuildAxisWeights(int count, double scale, double offset, int sourceCount,
+                             bool bicubic, MyAxisWeights *axis)
+{
+	double stretch = max(1.0, fabs(scale));
+	double support = KernelRadius(bicubic) * stretch;
+	axis->taps = (int)ceil(2.0 * support);
+	axis->stride = (axis->taps + 3) / 4 * 4;
+	axis->first.resize(count);
+	axis->weights.assign((size_t)count * axis->stride, 0.f);
+
+	for (int o = 0; o < count; o++)
+	{
+		// texels past the picture end up as background anyway
+		double u = min(max(scale * o + offset, -1.0), (double)sourceCount);
+		int first = (int)floor(u - support) + 1;
+		float *weights = &axis->weights[(size_t)o * axis->stride];
+		double sum = 0.0;
+		for (int k = 0; k < axis->taps; k++)
+			sum += Kernel((first + k - u) / stretch, bicubic);
+		for (int k = 0; k < axis->taps; k++)
+			weights[k] = (float)(Kernel((first + k - u) / stretch, bicubic) / sum);
+		axis->first[o] = first;
+	}
+}
+
+// resamples src into width x height texels, output texel (x, y) sitting at
+// source position (scaleX * x + offsetX, scaleY * y + offsetY). Texels whose
+// centre falls outside the picture get background, unless it is null
+static void ResampleAxes(const MyPlanarImage &src, double scaleX, double offsetX,
+                         double scaleY, double offsetY, int width, int height,
+                         bool bicubic, const float *background, MyPlanarImage *dst)
+{
+	MyAxisWeights columns, rows;
+	BuildAxisWeights(width, scaleX, offsetX, src.width, bicubic, &columns);
+	BuildAxisWeights(height, scaleY, offsetY, src.height, bicubic, &rows);
+
+	// the source columns any output texel reads
+	int x0 = src.width, x1 = 0;
+	for (int x = 0; x < width; x++)
+	{
+		x0 = min(x0, columns.first[x]);
+		x1 = max(x1, columns.first[x] + columns.stride);
+	}
+	x0 = max(x0, 0);
+	x1 = max(min(x1, src.width), x0 + 1);
+	int pad = columns.stride + 2;
+
+	vector<bool> inside(width);
+	for (int x = 0; x < width; x++)
+	{
+		double u = scaleX * x + offsetX;
+		inside[x] = background == nullptr || (u >= -0.5 && u < src.width - 0.5);
+	}
+
+	ResizePlanar(dst, width, height);
+	ForEachStrip(height, [&](int y0, int y1)
+	{
+		// one row of the picture resampled vertically, with replicated ends
+		// for the taps that reach past it
+		vector<float> line(x1 - x0 + 2 * pad);
+		vector<const float *> taps(rows.taps);
+		for (int y = y0; y < y1; y++)
+		{
+			double v = scaleY * y + offsetY;
+			bool rowInside = background == nullptr || (v >= -0.5 && v < src.height - 0.5);
+			const float *rowWeights = &rows.weights[(size_t)y * rows.stride];
+			for (int c = 0; c < 4; c++)
+			{
+				float *out = dst->Row(c, y);
+				if (!rowInside)
+				{
+					fill(out, out + width, background[c]);
+					continue;
+				}
+
+				for (int k = 0; k < rows.taps; k++)
+					taps[k] = src.Row(c, rows.first[y] + k) + x0;
+				float *middle = &line[pad];
+				SumRows(middle, &taps[0], rowWeights, rows.taps, x1 - x0);
+				fill(&line[0], middle, middle[0]);
+				fill(middle + (x1 - x0), &line[0] + line.size(), middle[x1 - x0 - 1]);
+
+				for (int x = 0; x < width; x++)
+					out[x] = inside[x] ? Dot(middle + columns.first[x] - x0,
+					                         &columns.weights[(size_t)x * columns.stride], columns.stride)
+					                   : background[c];
+			}
+		}
+	});
+	ExtendBorders(dst);
+}
+
+// --------------------------------------------------------------------------
+// Rotated resampling
+
+// sub-texel positions the weights are tabulated for
+const int resamplePhases = 256;
+
+// weights of the 2 * radius texels around each phase, the first sitting
+// radius - 1 texels before the texel the position falls in
+struct MyPhaseTable
+{
+	int radius;
+	int stride;                 // 2 * radius rounded up to a multiple of 4
+	vector<float> weights;      // stride per phase, resamplePhases + 1 of them
+
+	MyPhaseTable() : radius(0), stride(0)
+	{}
+};
+
+static void BuildPhaseTable(bool bicubic, MyPhaseTable *table)
+{
+	table->radius = KernelRadius(bicubic);
+	table->stride = (2 * table->radius + 3) / 4 * 4;
+	table->weights.assign((resamplePhases + 1) * table->stride, 0.f);
+	for (int p = 0; p <= resamplePhases; p++)
+	{
+		double fraction = (double)p / resamplePhases;
+		float *weights = &table->weights[p * table->stride];
+		double sum = 0.0;
+		for (int k = 0; k < 2 * table->radius; k++)
+			sum += Kernel(k - (table->radius - 1) - fraction, bicubic);
+		for (int k = 0; k < 2 * table->radius; k++)
+			weights[k] = (float)(Kernel(k - (table->radius - 1) - fraction, bicubic) / sum);
+	}
+}
+
+// resamples src into width x height texels, output texel (x, y) sitting at
+// source position (m[0] x + m[1] y + m[2], m[3] x + m[4] y + m[5]); src has
+// about the texel size of the output, so the kernel is not stretched
+static void ResampleAffine(const MyPlanarImage &src, const double m[6], int width, int height,
+                           bool bicubic, const float background[4], MyPlanarImage *dst)
+{
+	MyPhaseTable table;
+	BuildPhaseTable(bicubic, &table);
+	const int radius = table.radius, stride = table.stride;
+
+	ResizePlanar(dst, width, height);
+	ForEachStrip(height, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			float *out[4] = { dst->Row(0, y), dst->Row(1, y), dst->Row(2, y), dst->Row(3, y) };
+			for (int x = 0; x < width; x++)
+			{
+				double u = m[0] * x + m[1] * y + m[2];
+				double v = m[3] * x + m[4] * y + m[5];
+				if (u < -0.5 || u >= src.width - 0.5 || v < -0.5 || v >= src.height - 0.5)
+				{
+					for (int c = 0; c < 4; c++)
+						out[c][x] = background[c];
+					continue;
+				}
+
+				// the planar border covers the taps of texels next to the edge
+				int ix = (int)floor(u), iy = (int)floor(v);
+				const float *wx = &table.weights[(int)((u - ix) * resamplePhases + 0.5) * stride];
+				const float *wy = &table.weights[(int)((v - iy) * resamplePhases + 0.5) * stride];
+				const float *rows[8];
+				for (int k = 0; k < 2 * radius; k++)
+					rows[k] = src.Row(0, iy - (radius - 1) + k) + ix - (radius - 1);
+				for (int c = 0; c < 4; c++)
+					out[c][x] = KernelTexel(rows, (size_t)c * src.height * src.stride, wx, wy, 2 * radius, stride);
+			}
+		}
+	});
+	ExtendBorders(dst);
+}
+
+// --------------------------------------------------------------------------
+// View
+
+// source position of the centre of output texel (x, y), undoing the
+// transform of InitializeGeometry() like VisibleRect() does
+static void ViewToTexel(const MyView &view, int srcWidth, int srcHeight,
+                        int width, int height, double x, double y, double *u, double *v)
+{
+	double heightRatio = 1.0, widthRatio = 1.0;
+	if (srcWidth > srcHeight)
+		widthRatio = (double)srcWidth / srcHeight;
+	else if (srcHeight > srcWidth)
+		heightRatio = (double)srcHeight / srcWidth;
+
+	double dx = ((x + 0.5) * 2.0 / width - 1.0 - view.centerX) / view.mag;
+	double dy = ((y + 0.5) * 2.0 / height - 1.0 - view.centerY) / view.mag;
+	double lx = dx * cos(view.orien) + dy * sin(view.orien);
+	double ly = -dx * sin(view.orien) + dy * cos(view.orien);
+	*u = (lx * heightRatio + 1.0) * 0.5 * srcWidth - 0.5;
+	*v = (ly * widthRatio + 1.0) * 0.5 * srcHeight - 0.5;
+}
+
+void ResampleView(const MyPlanarImage &src, const MyView &view, int width, int height,
+                  bool bicubic, const float background[4], MyPlanarImage *dst)
+{
+	// the transform is affine, so three texels give all of it
+	double m[6];
+	double u, v, ux, vx, uy, vy;
+	ViewToTexel(view, src.width, src.height, width, height, 0.0, 0.0, &u, &v);
+	ViewToTexel(view, src.width, src.height, width, height, 1.0, 0.0, &ux, &vx);
+	ViewToTexel(view, src.width, src.height, width, height, 0.0, 1.0, &uy, &vy);
+	m[0] = ux - u; m[1] = uy - u; m[2] = u;
+	m[3] = vx - v; m[4] = vy - v; m[5] = v;
+
+	if (fabs(sin(view.orien)) < 1e-6)
+	{
+		ResampleAxes(src, m[0], m[2], m[4], m[5], width, height, bicubic, background, dst);
+		return;
+	}
+
+	// shrink first, so that the rotation reads about one texel per texel
+	double shrink = max(hypot(m[0], m[3]), hypot(m[1], m[4]));
+	if (shrink <= 1.0)
+	{
+		ResampleAffine(src, m, width, height, bicubic, background, dst);
+		return;
+	}
+	MyPlanarImage shrunk;
+	int shrunkWidth = max((int)ceil(src.width / shrink), 1);
+	int shrunkHeight = max((int)ceil(src.height / shrink), 1);
+	double scaleX = (double)src.width / shrunkWidth, scaleY = (double)src.height / shrunkHeight;
+	ResampleAxes(src, scaleX, 0.5 * scaleX - 0.5, scaleY, 0.5 * scaleY - 0.5,
+	             shrunkWidth, shrunkHeight, bicubic, nullptr, &shrunk);
+	for (int i = 0; i < 3; i++)
+	{
+		m[i] /= scaleX;
+		m[3 + i] /= scaleY;
+	}
+	m[2] += 0.5 / scaleX - 0.5;
+	m[5] += 0.5 / scaleY - 0.5;
+	ResampleAffine(shrunk, m, width, height, bicubic, background, dst);
+}
+
+// --------------------------------------------------------------------------
+// Export
+
+bool ExportView(const MyPlanarImage &src, const MyExportOptions &options)
+{
+	if (options.width <= 0 || options.height <= 0 || src.width == 0)
+	{
+		cout << "Nothing to export" << endl;
+		return false;
+	}
+
+	MyPlanarImage filtered;
+	FilterImage(src, options.effects, &filtered);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	MyPlanarImage resampled;
+	ResampleView(filtered, options.view, options.width, options.height,
+	             options.bicubic, exportBackground, &resampled);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	double megapixels = (double)options.width * options.height / 1e6;
+	cout << "Resampled to " << options.width << "x" << options.height << " with "
+	     << (options.bicubic ? "bicubic" : "Lanczos-3") << " in " << seconds * 1000.0
+	     << " ms, " << megapixels / seconds << " Mpixel/s" << endl;
+
+	// the window shows no alpha
+	MyImage image;
+	image.width = options.width;
+	image.height = options.height;
+	image.numComponents = 3;
+	image.pixels.resize((size_t)image.width * image.height * 3);
+	vector<float> rgba((size_t)image.width * 4);
+	for (int y = 0; y < image.height; y++)
+	{
+		const float *const planes[4] = { resampled.Row(0, y), resampled.Row(1, y),
+		                                 resampled.Row(2, y), resampled.Row(3, y) };
+		InterleaveRGBA(planes, image.width, &rgba[0]);
+		QuantizeRGBA(&rgba[0], image.width, 3, &image.pixels[(size_t)y * image.width * 3]);
+	}
+
+	stbi_flip_vertically_on_write(1);
+	if (!stbi_write_png(options.output.c_str(), image.width, image.height, 3,
+	                    &image.pixels[0], image.width * 3))
+	{
+		cout << "Unable to save image: " << options.output << endl;
+		return false;
+	}
+	cout << "Exported " << options.output << endl;
+	return true;
+}
+
+int RunExport(MyExportOptions options)
+{
+	MyImage image;
+	if (!LoadCachedImage(&image, options.input.c_str()))
+	{
+		cout << "Unable to load image: " << options.input << endl;
+		return 1;
+	}
+	MyPlanarImage planes;
+	Deinterleave(image, &planes);
+
+	if (options.width <= 0 || options.height <= 0)
+		options.width = options.height = max(planes.width, planes.height);
+	return ExportView(planes, options) ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+// ==========================================================================
+// High quality resampling of the view for exports
+//
+// The window samples the picture with GL_LINEAR, which blurs when zoomed in
+// and aliases when zoomed out. Exports resample the filtered picture on the
+// CPU with a Lanczos-3 or bicubic kernel instead, at any output size and
+// with the magnification, rotation and position of the view.
+//
+// Without rotation the kernel is separable: a table of weights is built once
+// per output column and once per output row, widened by the shrink factor
+// when shrinking so that nothing aliases, and every output row is a weighted
+// sum of source rows followed by a dot product per texel. A rotated view
+// first shrinks the picture that way to about the output's texel size, then
+// looks up the weights of each texel's sub-texel position in a table of
+// phases.
+// ==========================================================================
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <string>
+
+#include "cpufilter.h"
+
+// the transform InitializeGeometry() applies to the picture
+struct MyView
+{
+	float centerX;      // picture centre in clip coordinates
+	float centerY;
+	float mag;
+	float orien;        // radians, counter-clockwise
+
+	MyView() : centerX(0.f), centerY(0.f), mag(1.f), orien(0.f)
+	{}
+};
+
+// resamples src as the window shows it under view into a width x height
+// picture covering the whole window; texels whose centre falls outside the
+// picture get background
+void ResampleView(const MyPlanarImage &src, const MyView &view, int width, int height,
+                  bool bicubic, const float background[4], MyPlanarImage *dst);
+
+struct MyExportOptions
+{
+	std::string input;      // picture to export, for --export
+	std::string output;     // PNG to write
+	int width;              // size of the export, 0 for the default
+	int height;
+	bool bicubic;           // bicubic instead of Lanczos-3
+	MyView view;
+	EffectState effects;
+
+	MyExportOptions() : width(0), height(0), bicubic(false)
+	{}
+};
+
+// filters src, resamples it into options.width x options.height texels and
+// writes options.output, reporting the resampling throughput in Mpixel/s;
+// returns true if successful
+bool ExportView(const MyPlanarImage &src, const MyExportOptions &options);
+
+// exports options.input without a window; the export defaults to a square as
+// large as the longer side of the picture. Returns 0 if successful
+int RunExport(MyExportOptions options);
+
+#endif
@@ -0,0 +1,219 @@
+// ==========================================================================
+// Pipelined processing of numbered image sequences
+// ==========================================================================
+
+#include "sequence.h"
+#include "fixedpoint.h"
+#include "memory.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <stb_image_write.h>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Bounded frame queues between the stages
+
+struct MyFrameQueue
+{
+	deque<MyFrame> frames;
+	size_t capacity;
+	bool closed;
+	mutex lock;
+	condition_variable changed;
+	MemoryCategory category;    // what the frames count as while queued
+
+	MyFrameQueue(MemoryCategory category) : capacity(2), closed(false), category(category)
+	{}
+};
+
+// blocks while the queue is full; over the host memory cap the queue shrinks
+// to a single frame, which keeps the pipeline going with less overlap
+static void PushFrame(MyFrameQueue *queue, MyFrame &frame)
+{
+	long long bytes = frame.image.pixels.size();
+	bool fits = ReserveMemory(hostMemory, bytes);
+
+	unique_lock<mutex> guard(queue->lock);
+	if (!fits && queue->capacity > 1)
+	{
+		queue->capacity = 1;
+		cout << "Over the host memory cap, the " << (queue->category == sourceMemory ? "decoded" : "filtered")
+		     << " frame queue holds one frame" << endl;
+	}
+	queue->changed.wait(guard, [queue] { return queue->frames.size() < queue->capacity; });
+	CountMemory(hostMemory, queue->category, bytes);
+	queue->frames.push_back(move(frame));
+	queue->changed.notify_all();
+}
+
+// blocks while the queue is empty, returns false once it is closed and drained
+static bool PopFrame(MyFrameQueue *queue, MyFrame *frame)
+{
+	unique_lock<mutex> guard(queue->lock);
+	queue->changed.wait(guard, [queue] { return !queue->frames.empty() || queue->closed; });
+	if (queue->frames.empty())
+		return false;
+	*frame = move(queue->frames.front());
+	queue->frames.pop_front();
+	CountMemory(hostMemory, queue->category, -(long long)frame->image.pixels.size());
+	queue->changed.notify_all();
+	return true;
+}
+
+// no more frames will be pushed
+static void CloseQueue(MyFrameQueue *queue)
+{
+	lock_guard<mutex> guard(queue->lock);
+	queue->closed = true;
+	queue->changed.notify_all();
+}
+
+// --------------------------------------------------------------------------
+// Pipeline stages
+
+static string FrameName(const string &pattern, int number)
+{
+	char name[1024];
+	snprintf(name, sizeof(name), pattern.c_str(), number);
+	return name;
+}
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool FloatFilterFrame(MyFrame *frame, MyFrame *done)
+{
+	if (frame == nullptr)
+		return false;
+
+	MyPlanarImage planes;
+	Deinterleave(frame->image, &planes);
+
+	PixelRect all(0, 0, planes.width, planes.height);
+	vector<float> rgba((size_t)all.Width() * all.Height() * 4);
+	ApplyEffects(planes, frame->effects, all, &rgba[0]);
+
+	int numComponents = frame->image.numComponents % 2 == 0 ? 4 : 3;
+	done->index = frame->index;
+	done->image.width = planes.width;
+	done->image.height = planes.height;
+	done->image.numComponents = numComponents;
+	done->image.bytesPerComponent = 1;
+	done->image.pixels.resize((size_t)planes.width * planes.height * numComponents);
+	QuantizeRGBA(&rgba[0], planes.width * planes.height, numComponents, &done->image.pixels[0]);
+	return true;
+}
+
+bool CpuFilterFrame(MyFrame *frame, MyFrame *done)
+{
+	if (frame == nullptr)
+		return false;
+
+	// 8-bit frames stay in 16-bit integer lanes when the effects allow it
+	if (ApplyEffectsFixed(frame->image, frame->effects, &done->image))
+	{
+		done->index = frame->index;
+		return true;
+	}
+	return FloatFilterFrame(frame, done);
+}
+
+static void DecodeFrames(const MySequenceOptions &options, MyFrameQueue *decoded, double *busy)
+{
+	for (int i = 0; options.count < 0 || i < options.count; i++)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		MyFrame frame;
+		frame.index = options.first + i;
+		frame.effects = options.effects;
+		string name = FrameName(options.input, frame.index);
+		if (!LoadImage(&frame.image, name.c_str()))
+		{
+			if (options.count >= 0)
+				cout << "Unable to load frame: " << name << endl;
+			break;
+		}
+		*busy += Seconds(start);
+		PushFrame(decoded, frame);
+	}
+	CloseQueue(decoded);
+}
+
+static void EncodeFrames(const MySequenceOptions &options, MyFrameQueue *filtered, double *busy, int *written)
+{
+	// frames are kept bottom-up like stb_image loads them
+	stbi_flip_vertically_on_write(1);
+
+	MyFrame frame;
+	while (PopFrame(filtered, &frame))
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		string name = FrameName(options.output, frame.index);
+		const MyImage &image = frame.image;
+		if (!stbi_write_png(name.c_str(), image.width, image.height, image.numComponents,
+		                    &image.pixels[0], image.width * image.numComponents))
+			cout << "Unable to save image: " << name << endl;
+		else
+			(*written)++;
+		*busy += Seconds(start);
+	}
+}
+
+int RunSequence(const MySequenceOptions &options, FrameFilter filter)
+{
+	MyFrameQueue decoded(sourceMemory), filtered(intermediateMemory);
+	decoded.capacity = filtered.capacity = max(options.queueSize, 1);
+
+	double decodeBusy = 0.0, filterBusy = 0.0, encodeBusy = 0.0;
+	int written = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	thread decoder(DecodeFrames, cref(options), &decoded, &decodeBusy);
+	thread encoder(EncodeFrames, cref(options), &filtered, &encodeBusy, &written);
+
+	// the filter stage runs here, where the caller's GL context is current;
+	// every stage handles one frame at a time, so frames stay in order
+	MyFrame frame, done;
+	bool more = true;
+	while (more)
+	{
+		more = PopFrame(&decoded, &frame);
+		chrono::steady_clock::time_point filterStart = chrono::steady_clock::now();
+		bool finished = filter(more ? &frame : nullptr, &done);
+		filterBusy += Seconds(filterStart);
+		if (finished)
+			PushFrame(&filtered, done);
+
+		// drain whatever the filter still holds after the last frame
+		while (!more && filter(nullptr, &done))
+			PushFrame(&filtered, done);
+	}
+	CloseQueue(&filtered);
+
+	decoder.join();
+	encoder.join();
+
+	double elapsed = Seconds(start);
+	if (written == 0)
+	{
+		cout << "No frames processed, check the pattern " << options.input << endl;
+		return -1;
+	}
+	cout << "Processed " << written << " frames in " << elapsed << " s, "
+	     << (elapsed > 0.0 ? written / elapsed : 0.0) << " fps sustained" << endl;
+	cout << "  busy decoding " << decodeBusy << " s, filtering " << filterBusy
+	     << " s, encoding " << encodeBusy << " s" << endl;
+	return 0;
+}
@@ -0,0 +1,63 @@
+// ==========================================================================
+// Pipelined processing of numbered image sequences
+//
+// Applies the effect stack to frame_0001.png, frame_0002.png, ... for video
+// post-processing. Decoding, filtering and encoding run on their own threads
+// joined by small bounded queues, so frame N+2 is decoded while N+1 is
+// filtered and N is written out; a full queue stalls the stage feeding it.
+// ==========================================================================
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <string>
+
+#include "cpufilter.h"
+
+struct MyFrame
+{
+	int index;
+
+	// the decoded source, replaced by the filtered texels, 3 components for
+	// opaque sources and 4 for sources with alpha
+	MyImage image;
+
+	// what to apply to it
+	EffectState effects;
+
+	MyFrame() : index(0)
+	{}
+};
+
+// the filter stage takes the decoded frames in order. It may finish a frame
+// one call later (double buffering on the GPU), so it moves a finished frame
+// into done and returns true when it has one. After the last frame it is
+// called with frame == nullptr until it returns false.
+typedef bool (*FrameFilter)(MyFrame *frame, MyFrame *done);
+
+struct MySequenceOptions
+{
+	std::string input;      // printf pattern of the source frames, e.g. frame_%04d.png
+	std::string output;     // printf pattern of the filtered frames
+	int first;              // number of the first frame
+	int count;              // frames to process, or -1 to stop at the first missing one
+	int queueSize;          // frames each queue holds before back-pressure
+	EffectState effects;
+
+	MySequenceOptions() : first(1), count(-1), queueSize(2)
+	{}
+};
+
+// filters the frames on the CPU, 8-bit ones with the fixed-point kernels
+// where they cover the effects
+bool CpuFilterFrame(MyFrame *frame, MyFrame *done);
+
+// filters the frames on the CPU with the float filters the interactive
+// viewer uses
+bool FloatFilterFrame(MyFrame *frame, MyFrame *done);
+
+// runs the pipeline with the given filter stage on the calling thread and
+// reports the sustained frame rate; returns 0 if successful
+int RunSequence(const MySequenceOptions &options, FrameFilter filter);
+
+#endif
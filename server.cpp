@@ -0,0 +1,444 @@
+// ==========================================================================
+// Persistent filter server
+// ==========================================================================
+
+#include "server.h"
+#include "memory.h"
+#include "pixelcache.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <map>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <stb_image.h>
+#include <stb_image_write.h>
+
+using namespace std;
+
+// images the server keeps decoded between jobs
+const size_t imageCacheSize = 16;
+
+// --------------------------------------------------------------------------
+// Socket and shared memory helpers
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static bool ReadFully(int socket, void *data, size_t size)
+{
+	char *bytes = (char *)data;
+	while (size > 0)
+	{
+		ssize_t n = read(socket, bytes, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		bytes += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool WriteFully(int socket, const void *data, size_t size)
+{
+	const char *bytes = (const char *)data;
+	while (size > 0)
+	{
+		ssize_t n = write(socket, bytes, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		bytes += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool SocketAddress(const char *socketPath, sockaddr_un *address)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address->sun_path))
+	{
+		cout << "Socket path is too long: " << socketPath << endl;
+		return false;
+	}
+	strcpy(address->sun_path, socketPath);
+	return true;
+}
+
+struct MySharedMemory
+{
+	unsigned char *data;
+	size_t size;
+
+	MySharedMemory() : data(nullptr), size(0)
+	{}
+};
+
+// maps an existing shared memory object, or creates one of the given size
+static bool MapSharedMemory(MySharedMemory *memory, const char *name, size_t create)
+{
+	int fd = create ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		cout << "Unable to open shared memory " << name << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	struct stat info;
+	bool sized = create ? ftruncate(fd, create) == 0 : fstat(fd, &info) == 0;
+	memory->size = create ? create : sized ? (size_t)info.st_size : 0;
+	void *data = sized && memory->size > 0 ?
+		mmap(nullptr, memory->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		cout << "Unable to map shared memory " << name << endl;
+		if (create)
+			shm_unlink(name);
+		return false;
+	}
+	memory->data = (unsigned char *)data;
+	return true;
+}
+
+static void UnmapSharedMemory(MySharedMemory *memory)
+{
+	if (memory->data)
+		munmap(memory->data, memory->size);
+	memory->data = nullptr;
+	memory->size = 0;
+}
+
+// --------------------------------------------------------------------------
+// Server
+
+struct MyCachedImage
+{
+	time_t modified;
+	off_t size;
+	unsigned long lastUse;
+	MyImage image;
+
+	MyCachedImage() : modified(0), size(0), lastUse(0)
+	{}
+};
+
+static map<string, MyCachedImage> imageCache;
+static unsigned long imageCacheClock = 0;
+
+// drops the least recently used image, returning its bytes
+static long long DropOldestImage()
+{
+	if (imageCache.empty())
+		return 0;
+	map<string, MyCachedImage>::iterator oldest = imageCache.begin();
+	for (map<string, MyCachedImage>::iterator it = imageCache.begin(); it != imageCache.end(); ++it)
+		if (it->second.lastUse < oldest->second.lastUse)
+			oldest = it;
+	long long bytes = oldest->second.image.pixels.size();
+	imageCache.erase(oldest);
+	CountMemory(hostMemory, cacheMemory, -bytes);
+	return bytes;
+}
+
+// frees the least recently used images until bytes are released; the image
+// of the running job is a copy, so every entry may go
+static long long EvictImages(long long bytes)
+{
+	long long released = 0;
+	while (released < bytes && !imageCache.empty())
+		released += DropOldestImage();
+	return released;
+}
+
+// returns the decoded file, loading it again only if it changed on disk
+static const MyImage *CachedImage(const char *path)
+{
+	struct stat info;
+	if (stat(path, &info) != 0)
+		return nullptr;
+
+	map<string, MyCachedImage>::iterator found = imageCache.find(path);
+	if (found == imageCache.end() || found->second.modified != info.st_mtime || found->second.size != info.st_size)
+	{
+		MyCachedImage entry;
+		if (!LoadCachedImage(&entry.image, path))
+			return nullptr;
+		entry.modified = info.st_mtime;
+		entry.size = info.st_size;
+
+		// make room by dropping the least recently used image; under the
+		// memory cap the cache shrinks until the new image fits
+		if (found != imageCache.end())
+		{
+			CountMemory(hostMemory, cacheMemory, -(long long)found->second.image.pixels.size());
+			imageCache.erase(found);
+		}
+		else if (imageCache.size() >= imageCacheSize)
+			DropOldestImage();
+		ReserveMemory(hostMemory, entry.image.pixels.size());
+		CountMemory(hostMemory, cacheMemory, entry.image.pixels.size());
+		found = imageCache.insert(make_pair(string(path), MyCachedImage())).first;
+		found->second = move(entry);
+	}
+	found->second.lastUse = ++imageCacheClock;
+	return &found->second.image;
+}
+
+static MyJobReply RunJob(const MyJobRequest &request, FrameFilter filter)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	MyJobReply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = jobMagic;
+	reply.status = -1;
+
+	MySharedMemory memory;
+	char name[sizeof(request.sharedMemory) + 1] = {};
+	memcpy(name, request.sharedMemory, sizeof(request.sharedMemory));
+	if (request.magic != jobMagic || !MapSharedMemory(&memory, name, 0))
+		return reply;
+
+	MyFrame frame, done;
+	frame.effects.colourEffect = request.colourEffect;
+	frame.effects.edgeEffect = request.edgeEffect;
+	frame.effects.blur = request.blur;
+	memcpy(frame.effects.edge, request.edge, sizeof(request.edge));
+	frame.effects.rankRadius = min(max(request.rankRadius, 1), maxRankRadius);
+	frame.effects.rankPercentile = min(max(request.rankPercentile, 0), 100);
+	frame.effects.bilateralSpatial = min(max(request.bilateralSpatial, minBilateralSpatial), maxBilateralSpatial);
+	frame.effects.bilateralRange = min(max(request.bilateralRange, minBilateralRange), maxBilateralRange);
+
+	bool loaded = false;
+	if (request.path[0] != '\0')
+	{
+		char path[sizeof(request.path) + 1] = {};
+		memcpy(path, request.path, sizeof(request.path));
+		const MyImage *cached = CachedImage(path);
+		if (cached)
+		{
+			frame.image = *cached;
+			loaded = true;
+		}
+		else
+			cout << "Unable to load image: " << path << endl;
+	}
+	else if (request.width > 0 && request.height > 0 && request.numComponents >= 1 && request.numComponents <= 4 &&
+	         (size_t)request.width * request.height * request.numComponents <= memory.size)
+	{
+		frame.image.width = request.width;
+		frame.image.height = request.height;
+		frame.image.numComponents = request.numComponents;
+		frame.image.pixels.assign(memory.data, memory.data + (size_t)request.width * request.height * request.numComponents);
+		loaded = true;
+	}
+
+	// the GPU stage hands a frame back one call later, so flush it
+	if (loaded && (filter(&frame, &done) || filter(nullptr, &done)))
+	{
+		size_t size = done.image.pixels.size();
+		if (size <= memory.size)
+		{
+			memcpy(memory.data, &done.image.pixels[0], size);
+			reply.status = 0;
+			reply.width = done.image.width;
+			reply.height = done.image.height;
+			reply.numComponents = done.image.numComponents;
+		}
+		else
+			cout << "Shared memory " << name << " is too small for the result" << endl;
+	}
+
+	UnmapSharedMemory(&memory);
+	reply.seconds = Seconds(start);
+	return reply;
+}
+
+int RunServer(const char *socketPath, FrameFilter filter)
+{
+	sockaddr_un address;
+	if (!SocketAddress(socketPath, &address))
+		return -1;
+
+	// a client that goes away mid-reply must not take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath);
+	if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 8) != 0)
+	{
+		cout << "Unable to listen on " << socketPath << ": " << strerror(errno) << endl;
+		if (listener >= 0)
+			close(listener);
+		return -1;
+	}
+	cout << "Serving filter jobs on " << socketPath << endl;
+	RegisterEvictor(hostMemory, cacheMemory, EvictImages);
+
+	int jobs = 0;
+	for (;;)
+	{
+		int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			cout << "Unable to accept a connection: " << strerror(errno) << endl;
+			break;
+		}
+
+		// a client may send any number of jobs on one connection
+		MyJobRequest request;
+		while (ReadFully(connection, &request, sizeof(request)))
+		{
+			MyJobReply reply = RunJob(request, filter);
+			jobs++;
+			if (MemoryStatsRequested())
+				PrintMemoryStats();
+			if (!WriteFully(connection, &reply, sizeof(reply)))
+				break;
+		}
+		close(connection);
+	}
+
+	close(listener);
+	unlink(socketPath);
+	cout << "Served " << jobs << " jobs" << endl;
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+// Client
+
+int SubmitJob(const char *socketPath, const char *input, const char *output,
+              const EffectState &effects, bool byPath, int repeat)
+{
+	MyJobRequest request;
+	memset(&request, 0, sizeof(request));
+	request.magic = jobMagic;
+	request.colourEffect = effects.colourEffect;
+	request.edgeEffect = effects.edgeEffect;
+	request.blur = effects.blur;
+	memcpy(request.edge, effects.edge, sizeof(request.edge));
+	request.rankRadius = effects.rankRadius;
+	request.rankPercentile = effects.rankPercentile;
+	request.bilateralSpatial = effects.bilateralSpatial;
+	request.bilateralRange = effects.bilateralRange;
+
+	// the server has its own working directory, so it gets an absolute path
+	MyImage image;
+	int width, height, numComponents;
+	char path[PATH_MAX];
+	if (byPath)
+	{
+		if (!realpath(input, path) || strlen(path) >= sizeof(request.path) ||
+		    !stbi_info(path, &width, &height, &numComponents))
+		{
+			cout << "Unable to read image: " << input << endl;
+			return -1;
+		}
+		memcpy(request.path, path, strlen(path));
+	}
+	else
+	{
+		if (!LoadImage(&image, input))
+		{
+			cout << "Unable to load image: " << input << endl;
+			return -1;
+		}
+
+		// texels are passed with 8 bits per component, keep the high bytes
+		if (image.bytesPerComponent == 2)
+		{
+			const unsigned short *wide = (const unsigned short *)&image.pixels[0];
+			size_t count = image.pixels.size() / 2;
+			for (size_t i = 0; i < count; i++)
+				image.pixels[i] = (unsigned char)(wide[i] >> 8);
+			image.pixels.resize(count);
+			image.bytesPerComponent = 1;
+		}
+		width = request.width = image.width;
+		height = request.height = image.height;
+		request.numComponents = image.numComponents;
+	}
+
+	// room for the RGBA result, which is never larger than the source
+	snprintf(request.sharedMemory, sizeof(request.sharedMemory), "/boilerplate-%d", (int)getpid());
+	MySharedMemory memory;
+	if (!MapSharedMemory(&memory, request.sharedMemory, (size_t)width * height * 4))
+		return -1;
+
+	sockaddr_un address;
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection < 0 || !SocketAddress(socketPath, &address) ||
+	    connect(connection, (sockaddr *)&address, sizeof(address)) != 0)
+	{
+		cout << "Unable to connect to the server on " << socketPath << endl;
+		if (connection >= 0)
+			close(connection);
+		UnmapSharedMemory(&memory);
+		shm_unlink(request.sharedMemory);
+		return -1;
+	}
+
+	MyJobReply reply;
+	memset(&reply, 0, sizeof(reply));
+	for (int i = 0; i < max(repeat, 1); i++)
+	{
+		// the result overwrites the source, so copy it in for every job
+		if (!byPath)
+			memcpy(memory.data, &image.pixels[0], image.pixels.size());
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if (!WriteFully(connection, &request, sizeof(request)) || !ReadFully(connection, &reply, sizeof(reply)) ||
+		    reply.magic != jobMagic)
+		{
+			cout << "Lost the connection to the server" << endl;
+			reply.status = -1;
+			break;
+		}
+		double roundTrip = Seconds(start);
+		if (reply.status != 0)
+		{
+			cout << "The server could not filter " << input << endl;
+			break;
+		}
+		cout << "Job " << i + 1 << ": " << roundTrip * 1000.0 << " ms round trip, "
+		     << reply.seconds * 1000.0 << " ms on the server" << endl;
+	}
+	close(connection);
+
+	int result = reply.status;
+	if (result == 0)
+	{
+		stbi_flip_vertically_on_write(1);
+		if (!stbi_write_png(output, reply.width, reply.height, reply.numComponents,
+		                    memory.data, reply.width * reply.numComponents))
+		{
+			cout << "Unable to save image: " << output << endl;
+			result = -1;
+		}
+	}
+
+	UnmapSharedMemory(&memory);
+	shm_unlink(request.sharedMemory);
+	return result;
+}
@@ -0,0 +1,59 @@
+// ==========================================================================
+// Persistent filter server
+//
+// Starting the program pays for process start, GLFW, shader compilation and
+// the first texture upload before any filtering happens. A server started
+// with --serve keeps the filter engine, the compiled programs and recently
+// loaded images warm and takes jobs over a Unix domain socket. Only a small
+// fixed-size request and reply travel over the socket; the texels are passed
+// through POSIX shared memory that the client creates and the server maps.
+// ==========================================================================
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "sequence.h"
+
+// marks requests and replies of this protocol version
+const unsigned int jobMagic = 0x4b4a4f43;
+
+struct MyJobRequest
+{
+	unsigned int magic;
+	char sharedMemory[64];  // name of the shared memory object holding the texels
+	char path[1024];        // if set, the server loads this file through its cache
+	                        // instead of reading texels from the shared memory
+	int width;              // size and 8-bit components of the texels in the
+	int height;             // shared memory, unused when path is set
+	int numComponents;
+	int colourEffect;
+	int edgeEffect;
+	int blur;
+	float edge[9];
+	int rankRadius;
+	int rankPercentile;
+	int bilateralSpatial;
+	float bilateralRange;
+};
+
+struct MyJobReply
+{
+	unsigned int magic;
+	int status;             // 0 if the filtered texels are in the shared memory
+	int width;
+	int height;
+	int numComponents;
+	double seconds;         // time the server spent on the job
+};
+
+// answers jobs on the socket with the given filter stage until killed;
+// returns 0 if it shut down cleanly
+int RunServer(const char *socketPath, FrameFilter filter);
+
+// sends an image to a running server, writes the result to output and
+// prints the round trip and filter times of each of the repeats; with
+// byPath the server loads the image itself. Returns 0 if successful
+int SubmitJob(const char *socketPath, const char *input, const char *output,
+              const EffectState &effects, bool byPath, int repeat);
+
+#endif
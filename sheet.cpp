@@ -0,0 +1,126 @@
+// ==========================================================================
+// Thumbnails for the contact sheet
+// ==========================================================================
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+
+#include "memory.h"
+#include "pixelcache.h"
+
+using namespace std;
+
+static bool IsImageName(const string &name)
+{
+	static const char *const extensions[] = {
+		"png", "jpg", "jpeg", "bmp", "tga", "gif", "psd", "hdr", "pic", "pnm", "ppm", "pgm"
+	};
+	size_t dot = name.rfind('.');
+	if (dot == string::npos)
+		return false;
+	string extension = name.substr(dot + 1);
+	for (size_t i = 0; i < extension.size(); i++)
+		extension[i] = tolower((unsigned char)extension[i]);
+	for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+		if (extension == extensions[i])
+			return true;
+	return false;
+}
+
+vector<string> ListImages(const string &directory)
+{
+	vector<string> files;
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr)
+		return files;
+	while (dirent *entry = readdir(dir))
+		if (entry->d_name[0] != '.' && IsImageName(entry->d_name))
+			files.push_back(directory + "/" + entry->d_name);
+	closedir(dir);
+	sort(files.begin(), files.end());
+	return files;
+}
+
+static void MakeThumbnails(MyThumbnailJobs *jobs)
+{
+	const long long thumbnailBytes = (long long)thumbnailSize * thumbnailSize * 4;
+	for (;;)
+	{
+		// the evictors belong to the main thread, so over the host memory cap
+		// the workers wait for it to upload what they made instead
+		{
+			unique_lock<mutex> guard(jobs->lock);
+			jobs->released.wait(guard, [jobs, thumbnailBytes] {
+				return jobs->stop || jobs->heldBytes == 0 || MemoryFits(hostMemory, thumbnailBytes);
+			});
+		}
+
+		int i = jobs->next++;
+		if (jobs->stop || i >= (int)jobs->files.size())
+			return;
+		// each slot is written by one worker, and only read by the main
+		// thread once its index has been handed over under the lock
+		if (!LoadCachedThumbnail(&jobs->thumbnails[i], jobs->files[i].c_str(), thumbnailSize))
+			jobs->thumbnails[i] = MyImage();
+
+		long long bytes = jobs->thumbnails[i].pixels.size();
+		CountMemory(hostMemory, cacheMemory, bytes);
+		lock_guard<mutex> guard(jobs->lock);
+		jobs->heldBytes += bytes;
+		jobs->finished.push_back(i);
+	}
+}
+
+void StartThumbnails(MyThumbnailJobs *jobs, const vector<string> &files)
+{
+	StopThumbnails(jobs);
+	jobs->files = files;
+	jobs->thumbnails.assign(files.size(), MyImage());
+	jobs->finished.clear();
+	jobs->next = 0;
+	jobs->stop = false;
+
+	int count = min(max((int)thread::hardware_concurrency(), 1), max((int)files.size(), 1));
+	for (int i = 0; i < count; i++)
+		jobs->workers.push_back(thread(MakeThumbnails, jobs));
+}
+
+void CollectThumbnails(MyThumbnailJobs *jobs, vector<int> *ready)
+{
+	ready->clear();
+	lock_guard<mutex> guard(jobs->lock);
+	ready->swap(jobs->finished);
+}
+
+void ReleaseThumbnail(MyThumbnailJobs *jobs, int i)
+{
+	long long bytes = jobs->thumbnails[i].pixels.size();
+	jobs->thumbnails[i] = MyImage();
+	CountMemory(hostMemory, cacheMemory, -bytes);
+	{
+		lock_guard<mutex> guard(jobs->lock);
+		jobs->heldBytes -= bytes;
+	}
+	jobs->released.notify_all();
+}
+
+void StopThumbnails(MyThumbnailJobs *jobs)
+{
+	{
+		lock_guard<mutex> guard(jobs->lock);
+		jobs->stop = true;
+	}
+	jobs->released.notify_all();
+	for (size_t i = 0; i < jobs->workers.size(); i++)
+		jobs->workers[i].join();
+	jobs->workers.clear();
+
+	// the thumbnails that were never uploaded
+	for (size_t i = 0; i < jobs->thumbnails.size(); i++)
+		if (!jobs->thumbnails[i].pixels.empty())
+			ReleaseThumbnail(jobs, i);
+	jobs->finished.clear();
+}
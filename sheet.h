@@ -0,0 +1,60 @@
+// ==========================================================================
+// Thumbnails for the contact sheet
+//
+// The contact sheet shows every picture of a directory as a grid of
+// thumbnails. They are decoded and shrunk on a pool of worker threads, one
+// per core, and kept in the pixel cache, so reopening a directory of a
+// thousand pictures only maps small files. The main thread collects the
+// finished ones each frame and uploads them into its texture array. Until
+// then they count as host cache memory, and over the host memory cap the
+// workers wait for the uploads before making more.
+// ==========================================================================
+
+#ifndef SHEET_H
+#define SHEET_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image.h"
+
+// longest side of a thumbnail, in texels
+const int thumbnailSize = 128;
+
+struct MyThumbnailJobs
+{
+	std::vector<std::string> files;
+	std::vector<MyImage> thumbnails;    // indexed like files
+	std::vector<int> finished;          // indices not yet collected
+	std::atomic<int> next;              // next file a worker takes
+	std::atomic<bool> stop;
+	std::mutex lock;
+	std::condition_variable released;
+	long long heldBytes;                // of the thumbnails not released yet
+	std::vector<std::thread> workers;
+
+	MyThumbnailJobs() : next(0), stop(false), heldBytes(0)
+	{}
+};
+
+// the pictures stb_image can decode in the directory, sorted by name
+std::vector<std::string> ListImages(const std::string &directory);
+
+// starts making thumbnails of the files in the background
+void StartThumbnails(MyThumbnailJobs *jobs, const std::vector<std::string> &files);
+
+// moves the indices of the thumbnails finished since the last call into
+// ready; a thumbnail that failed to load is left empty
+void CollectThumbnails(MyThumbnailJobs *jobs, std::vector<int> *ready);
+
+// frees the texels of thumbnail i once they have been uploaded
+void ReleaseThumbnail(MyThumbnailJobs *jobs, int i);
+
+// abandons the remaining files and waits for the workers
+void StopThumbnails(MyThumbnailJobs *jobs);
+
+#endif
@@ -0,0 +1,20 @@
+// ==========================================================================
+// Colours a thumbnail of the contact sheet from the texture array
+// ==========================================================================
+#version 410
+
+in vec3 textureCoords;
+
+// first output is mapped to the framebuffer's colour index by default
+out vec4 FragmentColour;
+
+uniform sampler2DArray thumbnails;
+
+void main(void)
+{
+    //a plain tile stands in for thumbnails that are still loading
+    if (textureCoords.z < 0.0)
+        FragmentColour = vec4(0.3, 0.3, 0.3, 1.0);
+    else
+        FragmentColour = texture(thumbnails, textureCoords);
+}
@@ -0,0 +1,27 @@
+// ==========================================================================
+// Places one thumbnail of the contact sheet per instance
+// ==========================================================================
+#version 410
+
+// the same unit square for every instance, (0, 0) at its top left
+layout(location = 0) in vec2 Corner;
+
+// per instance: where the thumbnail goes, in window pixels with y down as
+// x, y, width, height, and its layer in the array with the fraction of the
+// layer it fills (layer < 0 while it is still loading)
+layout(location = 1) in vec4 Rect;
+layout(location = 2) in vec3 Thumbnail;
+
+uniform vec2 viewport;  //window size in pixels
+uniform float scroll;   //pixels the sheet is scrolled down by
+
+out vec3 textureCoords;
+
+void main()
+{
+    vec2 position = Rect.xy + Corner * Rect.zw - vec2(0.0, scroll);
+    gl_Position = vec4(position.x / viewport.x * 2.0 - 1.0, 1.0 - position.y / viewport.y * 2.0, 0.0, 1.0);
+
+    //thumbnails are stored bottom-up, like the pictures
+    textureCoords = vec3(Corner.x * Thumbnail.y, (1.0 - Corner.y) * Thumbnail.z, Thumbnail.x);
+}